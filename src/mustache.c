@@ -26,10 +26,25 @@
 #include "mustache.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>      /* for snprintf() */
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>  /* for off_t */
+#ifndef _WIN32
+    #include <limits.h>     /* for IOV_MAX */
+    #include <sys/uio.h>    /* for writev() */
+    #include <unistd.h>
+#endif
+
+#if defined __AVX2__
+    #include <immintrin.h>
+    #define MUSTACHE_SCAN_AVX2      1
+#elif defined __SSE2__  ||  defined _M_X64  ||  (defined _M_IX86_FP  &&  _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define MUSTACHE_SCAN_SSE2      1
+#endif
 
 
 #ifdef _MSC_VER
@@ -38,6 +53,16 @@
     #ifndef __cplusplus
         #define inline __inline
     #endif
+
+    #include <intrin.h>     /* for _BitScanForward() */
+#endif
+
+/* With compilers supporting the labels-as-values extension, the interpreter
+ * in mustache_process_ex() dispatches the instructions via a table of labels
+ * (direct threading), with one indirect jump after each instruction handler.
+ * Otherwise (or if MUSTACHE_NO_COMPUTED_GOTO is defined), it uses a switch. */
+#if defined __GNUC__  &&  !defined MUSTACHE_NO_COMPUTED_GOTO
+    #define MUSTACHE_COMPUTED_GOTO  1
 #endif
 
 
@@ -47,6 +72,52 @@
 #define MUSTACHE_MAXCLOSERLENGTH    32
 
 
+/*************************
+ *** Memory Management ***
+ *************************/
+
+static void*
+mustache_default_alloc(size_t size, void* allocator_data)
+{
+    return malloc(size);
+}
+
+static void*
+mustache_default_realloc(void* ptr, size_t old_size, size_t new_size, void* allocator_data)
+{
+    return realloc(ptr, new_size);
+}
+
+static void
+mustache_default_free(void* ptr, size_t size, void* allocator_data)
+{
+    free(ptr);
+}
+
+static const MUSTACHE_ALLOCATOR mustache_default_allocator = {
+    mustache_default_alloc,
+    mustache_default_realloc,
+    mustache_default_free
+};
+
+static void*
+mustache_mem_realloc(const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                     void* ptr, size_t old_size, size_t new_size)
+{
+    if(ptr == NULL)
+        return allocator->mem_alloc(new_size, allocator_data);
+    return allocator->mem_realloc(ptr, old_size, new_size, allocator_data);
+}
+
+static inline void
+mustache_mem_free(const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                  void* ptr, size_t size)
+{
+    if(ptr != NULL)
+        allocator->mem_free(ptr, size, allocator_data);
+}
+
+
 /**********************
  *** Growing Buffer ***
  **********************/
@@ -55,12 +126,25 @@ typedef struct MUSTACHE_BUFFER {
     uint8_t* data;
     size_t n;
     size_t alloc;
+    const MUSTACHE_ALLOCATOR* allocator;
+    void* allocator_data;
 } MUSTACHE_BUFFER;
 
+static inline void
+mustache_buffer_init(MUSTACHE_BUFFER* buf,
+                     const MUSTACHE_ALLOCATOR* allocator, void* allocator_data)
+{
+    buf->data = NULL;
+    buf->n = 0;
+    buf->alloc = 0;
+    buf->allocator = allocator;
+    buf->allocator_data = allocator_data;
+}
+
 static inline void
 mustache_buffer_free(MUSTACHE_BUFFER* buf)
 {
-    free(buf->data);
+    mustache_mem_free(buf->allocator, buf->allocator_data, buf->data, buf->alloc);
 }
 
 static int
@@ -70,7 +154,8 @@ mustache_buffer_insert(MUSTACHE_BUFFER* buf, off_t off, const void* data, size_t
         size_t new_alloc = (buf->n + n) * 2;
         uint8_t* new_data;
 
-        new_data = (uint8_t*) realloc(buf->data, new_alloc);
+        new_data = (uint8_t*) mustache_mem_realloc(buf->allocator,
+                    buf->allocator_data, buf->data, buf->alloc, new_alloc);
         if(new_data == NULL)
             return -1;
 
@@ -88,6 +173,24 @@ mustache_buffer_insert(MUSTACHE_BUFFER* buf, off_t off, const void* data, size_t
     return 0;
 }
 
+static int
+mustache_buffer_reserve(MUSTACHE_BUFFER* buf, size_t n)
+{
+    if(n > buf->alloc) {
+        uint8_t* new_data;
+
+        new_data = (uint8_t*) mustache_mem_realloc(buf->allocator,
+                    buf->allocator_data, buf->data, buf->alloc, n);
+        if(new_data == NULL)
+            return -1;
+
+        buf->data = new_data;
+        buf->alloc = n;
+    }
+
+    return 0;
+}
+
 static inline int
 mustache_buffer_append(MUSTACHE_BUFFER* buf, const void* data, size_t n)
 {
@@ -95,7 +198,7 @@ mustache_buffer_append(MUSTACHE_BUFFER* buf, const void* data, size_t n)
 }
 
 static int
-mustache_buffer_insert_num(MUSTACHE_BUFFER* buf, off_t off, uint64_t num)
+mustache_buffer_append_num(MUSTACHE_BUFFER* buf, uint64_t num)
 {
     uint8_t tmp[16];
     size_t n = 0;
@@ -109,13 +212,39 @@ mustache_buffer_insert_num(MUSTACHE_BUFFER* buf, off_t off, uint64_t num)
         tmp[15 - n++] = 0x80 | (num & 0x7f);
     }
 
-    return mustache_buffer_insert(buf, off, tmp+16-n, n);
+    return mustache_buffer_append(buf, tmp+16-n, n);
 }
 
+/* Numbers which have to be resolved only later (e.g. a jump forward to some
+ * place which is not yet known), are encoded with a fixed width. The encoding
+ * is still compatible with mustache_decode_num(), it just pads the number
+ * with leading zero digits. Thanks to that, the final value can be written in
+ * place and no instructions have to be moved. */
+#define MUSTACHE_FIXEDNUM_WIDTH     5
+#define MUSTACHE_FIXEDNUM_MAX       ((((uint64_t) 1) << (7 * MUSTACHE_FIXEDNUM_WIDTH)) - 1)
+
 static inline int
-mustache_buffer_append_num(MUSTACHE_BUFFER* buf, uint64_t num)
+mustache_buffer_append_fixed_num(MUSTACHE_BUFFER* buf)
+{
+    static const uint8_t placeholder[MUSTACHE_FIXEDNUM_WIDTH] = { 0 };
+    return mustache_buffer_append(buf, placeholder, MUSTACHE_FIXEDNUM_WIDTH);
+}
+
+static int
+mustache_buffer_write_fixed_num(MUSTACHE_BUFFER* buf, off_t off, uint64_t num)
 {
-    return mustache_buffer_insert_num(buf, buf->n, num);
+    int i;
+
+    if(num > MUSTACHE_FIXEDNUM_MAX)
+        return -1;
+
+    buf->data[off + MUSTACHE_FIXEDNUM_WIDTH - 1] = num & 0x7f;
+    for(i = MUSTACHE_FIXEDNUM_WIDTH - 2; i >= 0; i--) {
+        num = num >> 7;
+        buf->data[off + i] = 0x80 | (num & 0x7f);
+    }
+
+    return 0;
 }
 
 static uint64_t
@@ -133,6 +262,48 @@ mustache_decode_num(const uint8_t* data, off_t off, off_t* p_off)
     return num;
 }
 
+/* In the (default) wide format of the compiled template, all numbers are
+ * stored as 32-bit words in native byte order at offsets aligned to the word
+ * size, and strings are padded with zero bytes so that anything following
+ * them stays aligned too. (The words are accessed via memcpy(), so nothing
+ * depends on the alignment of the buffer itself; compilers turn it into a
+ * single load or store.) */
+#define MUSTACHE_WORD_SIZE          sizeof(uint32_t)
+#define MUSTACHE_WORD_ALIGN(n)      (((n) + MUSTACHE_WORD_SIZE - 1) & ~(MUSTACHE_WORD_SIZE - 1))
+
+static int
+mustache_buffer_append_word(MUSTACHE_BUFFER* buf, uint64_t num)
+{
+    uint32_t word = (uint32_t) num;
+
+    if(num > UINT32_MAX)
+        return -1;
+    return mustache_buffer_append(buf, &word, MUSTACHE_WORD_SIZE);
+}
+
+static inline void
+mustache_buffer_write_word(MUSTACHE_BUFFER* buf, off_t off, uint32_t word)
+{
+    memcpy(buf->data + off, &word, MUSTACHE_WORD_SIZE);
+}
+
+static inline uint32_t
+mustache_decode_word(const uint8_t* data, off_t off, off_t* p_off)
+{
+    uint32_t word;
+
+    memcpy(&word, data + off, MUSTACHE_WORD_SIZE);
+    *p_off = off + MUSTACHE_WORD_SIZE;
+    return word;
+}
+
+static inline const char*
+mustache_decode_str(const uint8_t* data, off_t off, off_t* p_off, size_t len, int compact)
+{
+    *p_off = off + (compact ? len : MUSTACHE_WORD_ALIGN(len));
+    return (const char*)(data + off);
+}
+
 
 /****************************
  *** Stack Implementation ***
@@ -164,6 +335,12 @@ mustache_stack_peek(MUSTACHE_STACK* stack)
     return *((uintptr_t*)(stack->data + (stack->n - sizeof(uintptr_t))));
 }
 
+static inline void
+mustache_stack_set_top(MUSTACHE_STACK* stack, uintptr_t item)
+{
+    *((uintptr_t*)(stack->data + (stack->n - sizeof(uintptr_t)))) = item;
+}
+
 static inline uintptr_t
 mustache_stack_pop(MUSTACHE_STACK* stack)
 {
@@ -173,6 +350,26 @@ mustache_stack_pop(MUSTACHE_STACK* stack)
 }
 
 
+/***************
+ *** Symbols ***
+ ***************/
+
+/* FNV-1a. */
+unsigned
+mustache_hash(const char* name, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < size; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+
+    return (unsigned) hash;
+}
+
+
 /***************************
  *** Parsing & Compiling ***
  ***************************/
@@ -198,306 +395,1204 @@ static const char* mustache_err_messages[] = {
     "Invalid specification of delimiters."
 };
 
-/* For the given template, we construct list of MUSTACHE_TAGINFO structures.
- * Along the way, we also check for any parsing errors and report them
- * to the app.
+/* The compiled template is a sequence of following instruction types.
+ * The instructions have two types of arguments:
+ *  -- NUM: a number.
+ *  -- STR: a string (always preceded with a NUM denoting its length).
+ *
+ * There are two formats of the compiled template which differ in how the
+ * opcodes and arguments are encoded:
+ *
+ *  -- The wide format (default): Each opcode and each NUM is a 32-bit word
+ *     (mustache_buffer_append_word()). Each STR is padded to a multiple of
+ *     the word size. All jump targets are absolute offsets. Thanks to the
+ *     alignment, each NUM is fetched with a single load, and every argument
+ *     has a fixed position relative to the preceding string (if any).
+ *
+ *  -- The compact format (MUSTACHE_FLAG_COMPACT): Each opcode and NUM is
+ *     encoded with mustache_buffer_append_num() (or, if it has to be resolved
+ *     later, with mustache_buffer_append_fixed_num()). Strings are not padded.
+ *     Jump targets are relative, so small jumps need just a byte or two.
+ *
+ * Jump targets of the RESOLVE_setjmp instruction (which always jumps
+ * forward) are in the compact format relative to the end of the NUM. Jump
+ * targets of the LEAVE instruction (which always jumps back) are relative to
+ * the beginning of the NUM.
+ *
+ * The names to resolve (an argument of RESOLVE_setjmp, RESOLVE and their
+ * superinstructions) are encoded as a NUM header, (N << 2) | MODE, where the
+ * MODE is one of the MUSTACHE_NAMES_xxx below:
+ *
+ *  -- MUSTACHE_NAMES_RESOLVE: Resolve the N names (N NUMs with their symbol
+ *     IDs follow the header; N == 0 means the implicit iterator). If N > 1,
+ *     a NUM with the index of the path in MUSTACHE_TEMPLATE::paths is between
+ *     the header and the symbol IDs.
+ *  -- MUSTACHE_NAMES_STORE: Same, but a NUM with a slot index is right after
+ *     the header, and the result is stored into the slot.
+ *  -- MUSTACHE_NAMES_LOAD: Nothing follows the header. N is a slot index and
+ *     the result is just loaded from the slot (see MUSTACHE_FLAG_CSE).
+ */
+#define MUSTACHE_NAMES_RESOLVE      0
+#define MUSTACHE_NAMES_STORE        1
+#define MUSTACHE_NAMES_LOAD         2
+
+/* Instruction denoting end of template.
  */
+#define MUSTACHE_OP_EXIT            0
 
-typedef enum MUSTACHE_TAGTYPE {
-    MUSTACHE_TAGTYPE_NONE = 0,
-    MUSTACHE_TAGTYPE_DELIM,             /* {{=@ @=}} */
-    MUSTACHE_TAGTYPE_COMMENT,           /* {{! comment }} */
-    MUSTACHE_TAGTYPE_VAR,               /* {{ var }} */
-    MUSTACHE_TAGTYPE_VERBATIMVAR,       /* {{{ var }}} */
-    MUSTACHE_TAGTYPE_VERBATIMVAR2,      /* {{& var }} */
-    MUSTACHE_TAGTYPE_OPENSECTION,       /* {{# section }} */
-    MUSTACHE_TAGTYPE_OPENSECTIONINV,    /* {{^ section }} */
-    MUSTACHE_TAGTYPE_CLOSESECTION,      /* {{/ section }} */
-    MUSTACHE_TAGTYPE_CLOSESECTIONINV,
-    MUSTACHE_TAGTYPE_PARTIAL,           /* {{> partial }} */
-    MUSTACHE_TAGTYPE_INDENT      /* for internal purposes. */
-} MUSTACHE_TAGTYPE;
+/* Instruction for outputting a literal text.
+ *
+ *   Arg #1: Length of the literal string (NUM).
+ *   Arg #2: The literal string (STR).
+ */
+#define MUSTACHE_OP_LITERAL         1
 
-typedef struct MUSTACHE_TAGINFO {
-    MUSTACHE_TAGTYPE type;
-    off_t line;
-    off_t col;
-    off_t beg;
-    off_t end;
-    off_t name_beg;
-    off_t name_end;
-} MUSTACHE_TAGINFO;
+/* Instruction to resolve a tag name.
+ *
+ *   Arg #1: (Relative) setjmp value (fixed-width NUM).
+ *   Arg #2: The names (see above).
+ *
+ *   Registers: reg_node is set to the resolved node, or NULL.
+ *              reg_jmpaddr is set to address where some next instruction may
+ *              want to jump on some condition.
+ */
+#define MUSTACHE_OP_RESOLVE_setjmp  2
+
+/* Instruction to resolve a tag name.
+ *
+ *   Arg #1: The names (see above).
+ *
+ *   Registers: reg_node is set to the resolved node, or NULL.
+ */
+#define MUSTACHE_OP_RESOLVE         3
+
+/* Instructions to output a node.
+ *
+ * Registers: If it is not NULL, reg_node determines the node to output.
+ *            Otherwise, it is noop.
+ */
+#define MUSTACHE_OP_OUTVERBATIM     4
+#define MUSTACHE_OP_OUTESCAPED      5
+
+/* Instruction to enter a node in register reg_node, i.e. to change a lookup
+ * context for resolve instructions.
+ *
+ * Registers: If it is not NULL, reg_node is pushed to the stack.
+ *            Otherwise, program counter is changed to address in reg_jmpaddr.
+ */
+#define MUSTACHE_OP_ENTER           6
+
+/* Instruction to leave a node. The top node in the lookup context stack is
+ * popped out.
+ *
+ * Arg #1: (Relative) setjmp value (NUM) for jumping back for next loop iteration.
+ */
+#define MUSTACHE_OP_LEAVE           7
+
+/* Instruction to open inverted section.
+ * Note there is no MUSTACHE_OP_LEAVEINV instruction as it is noop.
+ *
+ * Registers: If reg_node is NULL, continues normally.
+ *            Otherwise, program counter is changed to address in reg_jmpaddr.
+ */
+#define MUSTACHE_OP_ENTERINV        8
+
+/* Instruction to enter a partial.
+ *
+ * Arg #1: Length of the partial name (NUM).
+ * Arg #2: The partial name (STR).
+ * Arg #3: Length of the indentation string (NUM).
+ * Arg #4: Indentation, i.e. string composed of whitespace characters (STR).
+ */
+#define MUSTACHE_OP_PARTIAL         9
+
+/* Instruction to insert extra indentation (inherited from parent templates).
+ */
+#define MUSTACHE_OP_INDENT          10
+
+/* Superinstructions, i.e. fused sequences of the instructions above which are
+ * very common. Unless MUSTACHE_FLAG_NOOPTIMIZE is used, the compiler emits
+ * them instead of the sequences:
+ *
+ *   RESOLVE_OUTVERBATIM  ~  RESOLVE + OUTVERBATIM
+ *   RESOLVE_OUTESCAPED   ~  RESOLVE + OUTESCAPED
+ *   RESOLVE_ENTER        ~  RESOLVE_setjmp + ENTER
+ *   RESOLVE_ENTERINV     ~  RESOLVE_setjmp + ENTERINV
+ *   INDENT_LITERAL       ~  INDENT + LITERAL
+ *
+ * Arguments are the same as of the first instruction of the sequence (or, for
+ * INDENT_LITERAL, of the LITERAL).
+ */
+#define MUSTACHE_OP_RESOLVE_OUTVERBATIM 11
+#define MUSTACHE_OP_RESOLVE_OUTESCAPED  12
+#define MUSTACHE_OP_RESOLVE_ENTER       13
+#define MUSTACHE_OP_RESOLVE_ENTERINV    14
+#define MUSTACHE_OP_INDENT_LITERAL      15
+
+
+/* The code generator is fed by the parser with the template contents, piece
+ * after piece as the parser proceeds through the template, and it appends the
+ * corresponding instructions right away. Thanks to that, no intermediate
+ * representation of the whole template has to be built: Except the
+ * instructions themselves, the compiler only keeps a small stack of the
+ * currently open sections.
+ *
+ * Unless MUSTACHE_FLAG_NOOPTIMIZE is used, the code generator also performs
+ * some peephole optimizations on the fly: It emits the superinstructions
+ * instead of the instruction sequences they replace, and it merges adjacent
+ * literals (e.g. when separated by a comment or by a standalone tag). To be
+ * able to do the latter, a literal is not emitted right away but it is kept
+ * pending until some other instruction is emitted.
+ *
+ * With MUSTACHE_FLAG_CSE, the code generator also keeps a table of the names
+ * resolved so far in the current scope. Within a scope, the lookup context
+ * stays the same, so when the same name is used again, it is not resolved
+ * again but the result of its first resolution (which has been stored into
+ * a slot) is reused. A scope is the body of a (non-inverted) section (or the
+ * top level of the template). Names first resolved within a body of an
+ * inverted section are forgotten at its end because the body might have been
+ * skipped. Note that names cannot be reused across the scopes: E.g. a name
+ * resolved at the top level has to be resolved again inside a section as the
+ * items of the section may have a member of the same name.
+ */
+#define MUSTACHE_CSE_MAX_SLOTS      128
+
+typedef struct MUSTACHE_CSE_ENTRY {
+    const char* name;
+    size_t size;
+} MUSTACHE_CSE_ENTRY;
+
+/* Place of an INDENT instruction stripped from the code: the offset of the
+ * instruction it has preceded, or of a LITERAL instruction and the offset into
+ * its string. As inverted sections end with no instruction of their own, the
+ * nesting level of the inverted sections tells whether the INDENT goes before
+ * or after the end of a section at the same place. */
+typedef struct MUSTACHE_INDENT_POS {
+    uint32_t pc;
+    uint32_t off;
+    uint32_t depth;
+} MUSTACHE_INDENT_POS;
+
+struct MUSTACHE_TEMPLATE {
+    const MUSTACHE_ALLOCATOR* allocator;
+    void* allocator_data;
+
+    uint8_t* insns;
+    size_t insns_alloc;
+    unsigned flags;                 /* MUSTACHE_FLAG_xxx from compilation. */
+
+    /* Unless MUSTACHE_FLAG_NOOPTIMIZE is used, the code above has no INDENT
+     * instructions, as they are noop when there is no indentation to insert,
+     * i.e. always for the top-level template and usually for the partials.
+     * Their places are kept in the table instead, and the copy of the code
+     * with them is built the first time the template is processed as an
+     * indented partial (or right away with MUSTACHE_FLAG_INDENTCOPY). */
+    MUSTACHE_INDENT_POS* indents;
+    unsigned n_indents;
+    size_t indents_alloc;
+    uint8_t* insns_indent;          /* NULL if not built (yet). */
+    size_t insns_indent_alloc;
+    size_t insns_indent_size;
+
+    /* Symbol table: All names (the tokens of the dotted names) used in the
+     * template, indexed by their ID. The names themselves are stored in the
+     * same memory block, right after the array. */
+    MUSTACHE_SYMBOL* symbols;
+    unsigned n_symbols;
+    size_t symbols_alloc;
+
+    /* Symbols of all the dotted names (for get_child_by_path()), one path after
+     * another. */
+    const MUSTACHE_SYMBOL** paths;
+    size_t paths_alloc;
+
+    /* Some info gathered during the compilation so mustache_process() can
+     * prepare its stacks in advance. The partials themselves are known only
+     * to mustache_link() (and only those the linker provides); the compiler
+     * counts each partial tag as a single level with no sections inside. */
+    unsigned max_section_depth;     /* Nesting level of non-inverted sections. */
+    unsigned max_partial_depth;     /* Nesting level of partials. */
+    size_t max_partial_indent;      /* Total standalone indentation of them. */
+
+    unsigned n_slots;               /* Count of slots (MUSTACHE_FLAG_CSE). */
+
+    /* Statistics for mustache_template_info(). */
+    size_t insns_size;
+    unsigned n_insns;
+    unsigned n_insns_saved;
+    unsigned n_resolves_reused;
+};
+
+typedef struct MUSTACHE_COMPILER {
+    MUSTACHE_BUFFER insns;
+    MUSTACHE_STACK jmp_pos_stack;
+    unsigned flags;
+    int compact;
+    int optimize;
+    unsigned section_depth;
+    unsigned max_section_depth;
+    unsigned max_partial_depth;
+    size_t max_partial_indent;
+    unsigned n_insns;
+    unsigned n_insns_saved;
+
+    /* Pending literal (and/or INDENT), not yet emitted. The literal string
+     * points into the template text, or into pending_buf if it has been
+     * merged from multiple pieces. */
+    const char* pending_str;
+    size_t pending_len;
+    int pending_indent;
+    MUSTACHE_BUFFER pending_buf;
+
+    /* Symbol table being built. The names still point into the template text;
+     * mustache_compiler_build_symbols() copies them into the final table. */
+    MUSTACHE_BUFFER symbols;            /* Array of MUSTACHE_SYMBOL. */
+    MUSTACHE_BUFFER symbol_hashtable;   /* Open addressing; (ID + 1) or 0. */
+    unsigned n_symbols;
+    size_t symbol_names_size;
+    MUSTACHE_BUFFER path_ids;           /* Symbol IDs of the dotted names. */
+
+    /* Names resolved in the current scope (MUSTACHE_FLAG_CSE). The index of
+     * an entry is the index of the slot holding its result. Only the entries
+     * from cse_base are visible in the current scope. cse_scope_stack keeps
+     * the count of the entries and cse_base of each enclosing scope. */
+    int cse;
+    MUSTACHE_BUFFER cse_entries;        /* Array of MUSTACHE_CSE_ENTRY. */
+    MUSTACHE_STACK cse_scope_stack;
+    unsigned cse_base;
+    unsigned n_slots;
+    unsigned n_resolves_reused;
+} MUSTACHE_COMPILER;
 
 static void
-mustache_parse_error(int err_code, const char* msg,
-                    unsigned line, unsigned column, void* parser_data)
+mustache_compiler_init(MUSTACHE_COMPILER* compiler,
+                       const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                       unsigned flags)
 {
-    /* noop */
+    memset(compiler, 0, sizeof(MUSTACHE_COMPILER));
+    mustache_buffer_init(&compiler->insns, allocator, allocator_data);
+    mustache_buffer_init(&compiler->jmp_pos_stack, allocator, allocator_data);
+    mustache_buffer_init(&compiler->pending_buf, allocator, allocator_data);
+    mustache_buffer_init(&compiler->symbols, allocator, allocator_data);
+    mustache_buffer_init(&compiler->symbol_hashtable, allocator, allocator_data);
+    mustache_buffer_init(&compiler->path_ids, allocator, allocator_data);
+    mustache_buffer_init(&compiler->cse_entries, allocator, allocator_data);
+    mustache_buffer_init(&compiler->cse_scope_stack, allocator, allocator_data);
+    compiler->flags = flags;
+    compiler->compact = ((flags & MUSTACHE_FLAG_COMPACT) != 0);
+    compiler->optimize = ((flags & MUSTACHE_FLAG_NOOPTIMIZE) == 0);
+    compiler->cse = ((flags & MUSTACHE_FLAG_CSE) != 0);
 }
 
-static int
-mustache_is_std_closer(const char* closer, size_t closer_len)
+static void
+mustache_compiler_free(MUSTACHE_COMPILER* compiler)
 {
-    off_t off;
+    mustache_buffer_free(&compiler->insns);
+    mustache_stack_free(&compiler->jmp_pos_stack);
+    mustache_buffer_free(&compiler->pending_buf);
+    mustache_buffer_free(&compiler->symbols);
+    mustache_buffer_free(&compiler->symbol_hashtable);
+    mustache_buffer_free(&compiler->path_ids);
+    mustache_buffer_free(&compiler->cse_entries);
+    mustache_stack_free(&compiler->cse_scope_stack);
+}
 
-    for(off = 0; off < closer_len; off++) {
-        if(closer[off] != '}')
-            return 0;
-    }
+/* Helpers appending the opcodes and arguments in the target format. */
 
-    return 1;
+static inline int
+mustache_compiler_append_num(MUSTACHE_COMPILER* compiler, uint64_t num)
+{
+    if(compiler->compact)
+        return mustache_buffer_append_num(&compiler->insns, num);
+    else
+        return mustache_buffer_append_word(&compiler->insns, num);
 }
 
-static int
-mustache_validate_tagname(const char* tagname, size_t size)
+static inline int
+mustache_compiler_append_op(MUSTACHE_COMPILER* compiler, unsigned opcode)
 {
-    off_t off;
+    compiler->n_insns++;
+    return mustache_compiler_append_num(compiler, opcode);
+}
 
-    if(size == 1  &&  tagname[0] == '.')
-        return 0;
+static int
+mustache_compiler_append_str(MUSTACHE_COMPILER* compiler, const char* str, size_t len)
+{
+    static const uint8_t padding[MUSTACHE_WORD_SIZE] = { 0 };
 
-    /* Verify there is no whitespace and that '.' is used only as a delimiter
-     * of non-empty tokens. */
-    if(tagname[0] == '.'  ||  tagname[size-1] == '.')
+    if(mustache_compiler_append_num(compiler, len) != 0  ||
+       mustache_buffer_append(&compiler->insns, str, len) != 0)
         return -1;
-    for(off = 0; off < size; off++) {
-        if(MUSTACHE_ISWHITESPACE(tagname[off]))
-            return -1;
-        if(tagname[off] == '.'  &&  off+1 < size  &&  tagname[off+1] == '.')
+
+    if(!compiler->compact) {
+        if(mustache_buffer_append(&compiler->insns, padding,
+                    MUSTACHE_WORD_ALIGN(len) - len) != 0)
             return -1;
     }
 
     return 0;
 }
 
+/* Append a placeholder for a forward jump target. Its position is pushed to
+ * jmp_pos_stack so mustache_compiler_resolve_jmp() can fill it later. */
 static int
-mustache_validate_sections(const char* templ_data, MUSTACHE_BUFFER* tags_buffer,
-                           const MUSTACHE_PARSER* parser, void* parser_data)
+mustache_compiler_append_jmp(MUSTACHE_COMPILER* compiler)
 {
-    MUSTACHE_TAGINFO* tags = (MUSTACHE_TAGINFO*) tags_buffer->data;
-    unsigned n_tags = tags_buffer->n / sizeof(MUSTACHE_TAGINFO);
-    unsigned i;
-    MUSTACHE_STACK section_stack = { 0 };
-    MUSTACHE_TAGINFO* opener;
-    int n_errors = 0;
-    int ret = -1;
-
-    for(i = 0; i < n_tags; i++) {
-        switch(tags[i].type) {
-        case MUSTACHE_TAGTYPE_OPENSECTION:
-        case MUSTACHE_TAGTYPE_OPENSECTIONINV:
-            if(mustache_stack_push(&section_stack, (uintptr_t) &tags[i]) != 0)
-                goto err;
-            break;
+    MUSTACHE_BUFFER* insns = &compiler->insns;
 
-        case MUSTACHE_TAGTYPE_CLOSESECTION:
-        case MUSTACHE_TAGTYPE_CLOSESECTIONINV:
-            if(mustache_stack_is_empty(&section_stack)) {
-                parser->parse_error(MUSTACHE_ERR_DANGLINGSECTIONCLOSER,
-                        mustache_err_messages[MUSTACHE_ERR_DANGLINGSECTIONCLOSER],
-                        (unsigned)tags[i].line, (unsigned)tags[i].col,
-                        parser_data);
-                n_errors++;
-            } else {
-                opener = (MUSTACHE_TAGINFO*) mustache_stack_pop(&section_stack);
+    if(mustache_stack_push(&compiler->jmp_pos_stack, insns->n) != 0)
+        return -1;
 
-                if(opener->name_end - opener->name_beg != tags[i].name_end - tags[i].name_beg  ||
-                   strncmp(templ_data + opener->name_beg,
-                           templ_data + tags[i].name_beg,
-                           opener->name_end - opener->name_beg) != 0)
-                {
-                    parser->parse_error(MUSTACHE_ERR_SECTIONNAMEMISMATCH,
-                            mustache_err_messages[MUSTACHE_ERR_SECTIONNAMEMISMATCH],
-                            (unsigned)tags[i].line, (unsigned)tags[i].col,
-                            parser_data);
-                    parser->parse_error(MUSTACHE_ERR_SECTIONOPENERHERE,
-                            mustache_err_messages[MUSTACHE_ERR_SECTIONOPENERHERE],
-                            (unsigned)opener->line, (unsigned)opener->col,
-                            parser_data);
-                    n_errors++;
-                }
+    if(compiler->compact)
+        return mustache_buffer_append_fixed_num(insns);
+    else
+        return mustache_buffer_append_word(insns, 0);
+}
 
-                if(opener->type == MUSTACHE_TAGTYPE_OPENSECTIONINV)
-                    tags[i].type = MUSTACHE_TAGTYPE_CLOSESECTIONINV;
-            }
-            break;
+/* Resolve the forward jump on top of jmp_pos_stack to the current position. */
+static int
+mustache_compiler_resolve_jmp(MUSTACHE_COMPILER* compiler)
+{
+    MUSTACHE_BUFFER* insns = &compiler->insns;
+    off_t jmp_pos = (off_t) mustache_stack_pop(&compiler->jmp_pos_stack);
 
-        default:
-            break;
-        }
+    if(compiler->compact) {
+        return mustache_buffer_write_fixed_num(insns, jmp_pos,
+                    insns->n - (jmp_pos + MUSTACHE_FIXEDNUM_WIDTH));
+    } else {
+        if(insns->n > UINT32_MAX)
+            return -1;
+        mustache_buffer_write_word(insns, jmp_pos, (uint32_t) insns->n);
+        return 0;
     }
+}
 
-    if(!mustache_stack_is_empty(&section_stack)) {
-        while(!mustache_stack_is_empty(&section_stack)) {
-            opener = (MUSTACHE_TAGINFO*) mustache_stack_pop(&section_stack);
-
-            parser->parse_error(MUSTACHE_ERR_DANGLINGSECTIONOPENER,
-                    mustache_err_messages[MUSTACHE_ERR_DANGLINGSECTIONOPENER],
-                    (unsigned)opener->line, (unsigned)opener->col,
-                    parser_data);
-            n_errors++;
+/* Append a backward jump target. */
+static int
+mustache_compiler_append_jmp_back(MUSTACHE_COMPILER* compiler, off_t target)
+{
+    if(compiler->compact)
+        return mustache_buffer_append_num(&compiler->insns, compiler->insns.n - target);
+    else
+        return mustache_buffer_append_word(&compiler->insns, target);
+}
+
+/* Rebuild the symbol hashtable so it has the given count of buckets (a power
+ * of two). */
+static int
+mustache_compiler_rehash_symbols(MUSTACHE_COMPILER* compiler, size_t n_buckets)
+{
+    const MUSTACHE_SYMBOL* symbols = (const MUSTACHE_SYMBOL*) compiler->symbols.data;
+    MUSTACHE_BUFFER* hashtable = &compiler->symbol_hashtable;
+    unsigned* buckets;
+    unsigned id;
+
+    if(mustache_buffer_reserve(hashtable, n_buckets * sizeof(unsigned)) != 0)
+        return -1;
+    hashtable->n = n_buckets * sizeof(unsigned);
+    buckets = (unsigned*) hashtable->data;
+    memset(buckets, 0, hashtable->n);
+
+    for(id = 0; id < compiler->n_symbols; id++) {
+        size_t i = symbols[id].hash & (n_buckets - 1);
+        while(buckets[i] != 0)
+            i = (i + 1) & (n_buckets - 1);
+        buckets[i] = id + 1;
+    }
+
+    return 0;
+}
+
+/* Look up the name in the symbol table (add it if not there yet), and get
+ * its ID. */
+static int
+mustache_compiler_intern_symbol(MUSTACHE_COMPILER* compiler, const char* name, size_t size,
+                                unsigned* p_id)
+{
+    unsigned hash = mustache_hash(name, size);
+    MUSTACHE_SYMBOL* symbols = (MUSTACHE_SYMBOL*) compiler->symbols.data;
+    size_t n_buckets = compiler->symbol_hashtable.n / sizeof(unsigned);
+    unsigned* buckets = (unsigned*) compiler->symbol_hashtable.data;
+    MUSTACHE_SYMBOL sym;
+    size_t i = 0;
+
+    if(n_buckets > 0) {
+        i = hash & (n_buckets - 1);
+        while(buckets[i] != 0) {
+            const MUSTACHE_SYMBOL* s = &symbols[buckets[i] - 1];
+            if(s->hash == hash  &&  s->size == size  &&  memcmp(s->name, name, size) == 0) {
+                *p_id = s->id;
+                return 0;
+            }
+            i = (i + 1) & (n_buckets - 1);
         }
     }
 
-    if(n_errors == 0)
-        ret = 0;
+    /* Not found: Add new symbol. Keep the hashtable at most half full. */
+    sym.name = name;
+    sym.size = size;
+    sym.hash = hash;
+    sym.id = compiler->n_symbols;
+    if(mustache_buffer_append(&compiler->symbols, &sym, sizeof(MUSTACHE_SYMBOL)) != 0)
+        return -1;
+    compiler->n_symbols++;
+    compiler->symbol_names_size += size + 1;
 
-err:
-    mustache_stack_free(&section_stack);
-    return ret;
+    if(2 * compiler->n_symbols > n_buckets) {
+        if(mustache_compiler_rehash_symbols(compiler, (n_buckets > 0) ? 2 * n_buckets : 16) != 0)
+            return -1;
+    } else {
+        buckets[i] = sym.id + 1;
+    }
+
+    *p_id = sym.id;
+    return 0;
+}
+
+/* Build the final symbol table as a single memory block, with the names
+ * copied (and zero-terminated) right after the array of the symbols. */
+static MUSTACHE_SYMBOL*
+mustache_compiler_build_symbols(MUSTACHE_COMPILER* compiler, size_t* p_alloc)
+{
+    const MUSTACHE_ALLOCATOR* allocator = compiler->symbols.allocator;
+    void* allocator_data = compiler->symbols.allocator_data;
+    size_t alloc;
+    MUSTACHE_SYMBOL* symbols;
+    char* names;
+    unsigned id;
+
+    alloc = compiler->n_symbols * sizeof(MUSTACHE_SYMBOL) + compiler->symbol_names_size;
+    *p_alloc = alloc;
+    if(alloc == 0)
+        return NULL;
+
+    symbols = (MUSTACHE_SYMBOL*) allocator->mem_alloc(alloc, allocator_data);
+    if(symbols == NULL)
+        return NULL;
+
+    memcpy(symbols, compiler->symbols.data, compiler->n_symbols * sizeof(MUSTACHE_SYMBOL));
+    names = (char*) (symbols + compiler->n_symbols);
+    for(id = 0; id < compiler->n_symbols; id++) {
+        memcpy(names, symbols[id].name, symbols[id].size);
+        names[symbols[id].size] = '\0';
+        symbols[id].name = names;
+        names += symbols[id].size + 1;
+    }
+
+    return symbols;
+}
+
+/* Build the table of the dotted names (MUSTACHE_TEMPLATE::paths) from the
+ * recorded symbol IDs. */
+static const MUSTACHE_SYMBOL**
+mustache_compiler_build_paths(MUSTACHE_COMPILER* compiler, const MUSTACHE_SYMBOL* symbols,
+                              size_t* p_alloc)
+{
+    const MUSTACHE_ALLOCATOR* allocator = compiler->path_ids.allocator;
+    void* allocator_data = compiler->path_ids.allocator_data;
+    const unsigned* ids = (const unsigned*) compiler->path_ids.data;
+    size_t n = compiler->path_ids.n / sizeof(unsigned);
+    const MUSTACHE_SYMBOL** paths;
+    size_t i;
+
+    *p_alloc = n * sizeof(const MUSTACHE_SYMBOL*);
+    if(n == 0)
+        return NULL;
+
+    paths = (const MUSTACHE_SYMBOL**) allocator->mem_alloc(*p_alloc, allocator_data);
+    if(paths == NULL)
+        return NULL;
+
+    for(i = 0; i < n; i++)
+        paths[i] = &symbols[ids[i]];
+    return paths;
 }
 
+/* Enter a new scope for MUSTACHE_FLAG_CSE. For an inverted section, the
+ * names of the enclosing scope stay visible. */
 static int
-mustache_parse_delimiters(const char* delim_spec, size_t size,
-                          char* opener, size_t* p_opener_len,
-                          char* closer, size_t* p_closer_len)
+mustache_compiler_push_cse_scope(MUSTACHE_COMPILER* compiler, int inverted)
 {
-    off_t opener_beg, opener_end;
-    off_t closer_beg, closer_end;
+    unsigned n_entries = (unsigned) (compiler->cse_entries.n / sizeof(MUSTACHE_CSE_ENTRY));
 
-    opener_beg = 0;
+    if(mustache_stack_push(&compiler->cse_scope_stack, n_entries) != 0  ||
+       mustache_stack_push(&compiler->cse_scope_stack, compiler->cse_base) != 0)
+        return -1;
 
-    opener_end = opener_beg;
-    while(opener_end < size) {
-        if(MUSTACHE_ISWHITESPACE(delim_spec[opener_end]))
-            break;
-        if(delim_spec[opener_end] == '=')
-            return -1;
-        opener_end++;
+    if(!inverted)
+        compiler->cse_base = n_entries;
+    return 0;
+}
+
+static void
+mustache_compiler_pop_cse_scope(MUSTACHE_COMPILER* compiler)
+{
+    compiler->cse_base = (unsigned) mustache_stack_pop(&compiler->cse_scope_stack);
+    compiler->cse_entries.n = (size_t) mustache_stack_pop(&compiler->cse_scope_stack)
+                                    * sizeof(MUSTACHE_CSE_ENTRY);
+}
+
+static int
+mustache_compile_tagname(MUSTACHE_COMPILER* compiler, const char* name, size_t size)
+{
+    unsigned n_tokens = 1;
+    unsigned mode = MUSTACHE_NAMES_RESOLVE;
+    unsigned slot = 0;
+    unsigned i;
+    off_t tok_beg, tok_end;
+
+    if(size == 1  &&  name[0] == '.') {
+        /* Implicit iterator. */
+        n_tokens = 0;
+    } else {
+        for(i = 0; i < size; i++) {
+            if(name[i] == '.')
+                n_tokens++;
+        }
     }
-    if(opener_end <= opener_beg  ||  opener_end - opener_beg > MUSTACHE_MAXOPENERLENGTH)
+
+    /* With MUSTACHE_FLAG_CSE, reuse the result if the name has already been
+     * resolved in the scope, or store it for the reuse otherwise. */
+    if(compiler->cse  &&  n_tokens > 0) {
+        const MUSTACHE_CSE_ENTRY* entries = (const MUSTACHE_CSE_ENTRY*) compiler->cse_entries.data;
+        unsigned n_entries = (unsigned) (compiler->cse_entries.n / sizeof(MUSTACHE_CSE_ENTRY));
+        MUSTACHE_CSE_ENTRY entry;
+
+        for(i = compiler->cse_base; i < n_entries; i++) {
+            if(entries[i].size == size  &&  memcmp(entries[i].name, name, size) == 0) {
+                compiler->n_resolves_reused++;
+                return mustache_compiler_append_num(compiler,
+                            (i << 2) | MUSTACHE_NAMES_LOAD);
+            }
+        }
+
+        if(n_entries < MUSTACHE_CSE_MAX_SLOTS) {
+            entry.name = name;
+            entry.size = size;
+            if(mustache_buffer_append(&compiler->cse_entries, &entry, sizeof(MUSTACHE_CSE_ENTRY)) != 0)
+                return -1;
+            if(n_entries >= compiler->n_slots)
+                compiler->n_slots = n_entries + 1;
+
+            mode = MUSTACHE_NAMES_STORE;
+            slot = n_entries;
+        }
+    }
+
+    if(mustache_compiler_append_num(compiler, (n_tokens << 2) | mode) != 0)
         return -1;
+    if(mode == MUSTACHE_NAMES_STORE) {
+        if(mustache_compiler_append_num(compiler, slot) != 0)
+            return -1;
+    }
 
-    closer_beg = opener_end;
-    while(closer_beg < size) {
-        if(!MUSTACHE_ISWHITESPACE(delim_spec[closer_beg]))
-            break;
-        closer_beg++;
+    /* For a dotted name, record the whole path into the table of paths. */
+    if(n_tokens > 1) {
+        if(mustache_compiler_append_num(compiler,
+                    compiler->path_ids.n / sizeof(unsigned)) != 0)
+            return -1;
     }
-    if(closer_beg <= opener_end)
+
+    tok_beg = 0;
+    for(i = 0; i < n_tokens; i++) {
+        unsigned id;
+
+        tok_end = tok_beg;
+        while(tok_end < size  &&  name[tok_end] != '.')
+            tok_end++;
+
+        if(mustache_compiler_intern_symbol(compiler, name + tok_beg, tok_end - tok_beg, &id) != 0  ||
+           mustache_compiler_append_num(compiler, id) != 0)
+            return -1;
+        if(n_tokens > 1) {
+            if(mustache_buffer_append(&compiler->path_ids, &id, sizeof(unsigned)) != 0)
+                return -1;
+        }
+
+        tok_beg = tok_end + 1;
+    }
+
+    return 0;
+}
+
+/* Emit the pending literal and/or INDENT (if any). Every emitter (except the
+ * ones of LITERAL and INDENT) has to call this first. */
+static int
+mustache_compiler_flush(MUSTACHE_COMPILER* compiler)
+{
+    if(compiler->pending_indent) {
+        compiler->pending_indent = 0;
+        if(compiler->pending_len == 0)
+            return mustache_compiler_append_op(compiler, MUSTACHE_OP_INDENT);
+
+        if(mustache_compiler_append_op(compiler, MUSTACHE_OP_INDENT_LITERAL) != 0)
+            return -1;
+        compiler->n_insns_saved++;
+    } else if(compiler->pending_len > 0) {
+        if(mustache_compiler_append_op(compiler, MUSTACHE_OP_LITERAL) != 0)
+            return -1;
+    } else {
+        return 0;
+    }
+
+    if(mustache_compiler_append_str(compiler, compiler->pending_str, compiler->pending_len) != 0)
         return -1;
 
-    closer_end = closer_beg;
-    while(closer_end < size) {
-        if(MUSTACHE_ISWHITESPACE(delim_spec[closer_end]))
+    compiler->pending_len = 0;
+    return 0;
+}
+
+static int
+mustache_emit_literal(MUSTACHE_COMPILER* compiler, const char* str, size_t len)
+{
+    MUSTACHE_BUFFER* pending_buf = &compiler->pending_buf;
+
+    if(len == 0)
+        return 0;
+
+    if(!compiler->optimize) {
+        if(mustache_compiler_append_op(compiler, MUSTACHE_OP_LITERAL) != 0  ||
+           mustache_compiler_append_str(compiler, str, len) != 0)
             return -1;
-        closer_end++;
+        return 0;
     }
-    if(closer_end <= closer_beg  ||   closer_end - closer_beg > MUSTACHE_MAXCLOSERLENGTH)
+
+    if(compiler->pending_len == 0) {
+        compiler->pending_str = str;
+        compiler->pending_len = len;
+        return 0;
+    }
+
+    /* Merge with the pending literal. */
+    if(compiler->pending_str != (const char*) pending_buf->data) {
+        pending_buf->n = 0;
+        if(mustache_buffer_append(pending_buf, compiler->pending_str, compiler->pending_len) != 0)
+            return -1;
+    }
+    if(mustache_buffer_append(pending_buf, str, len) != 0)
         return -1;
-    if(closer_end != size)
+    compiler->pending_str = (const char*) pending_buf->data;
+    compiler->pending_len = pending_buf->n;
+    compiler->n_insns_saved++;
+    return 0;
+}
+
+static int
+mustache_emit_var(MUSTACHE_COMPILER* compiler, const char* name, size_t name_len,
+                  int escaped)
+{
+    if(mustache_compiler_flush(compiler) != 0)
+        return -1;
+
+    if(compiler->optimize) {
+        if(mustache_compiler_append_op(compiler, escaped ?
+                    MUSTACHE_OP_RESOLVE_OUTESCAPED : MUSTACHE_OP_RESOLVE_OUTVERBATIM) != 0  ||
+           mustache_compile_tagname(compiler, name, name_len) != 0)
+            return -1;
+        compiler->n_insns_saved++;
+        return 0;
+    }
+
+    if(mustache_compiler_append_op(compiler, MUSTACHE_OP_RESOLVE) != 0  ||
+       mustache_compile_tagname(compiler, name, name_len) != 0  ||
+       mustache_compiler_append_op(compiler, escaped ?
+                    MUSTACHE_OP_OUTESCAPED : MUSTACHE_OP_OUTVERBATIM) != 0)
         return -1;
 
-    memcpy(opener, delim_spec + opener_beg, opener_end - opener_beg);
-    *p_opener_len = opener_end - opener_beg;
-    memcpy(closer, delim_spec + closer_beg, closer_end - closer_beg);
-    *p_closer_len = closer_end - closer_beg;
     return 0;
 }
 
 static int
-mustache_parse(const char* templ_data, size_t templ_size,
-               const MUSTACHE_PARSER* parser, void* parser_data,
-               MUSTACHE_TAGINFO** p_tags, unsigned* p_n_tags)
+mustache_emit_open_section(MUSTACHE_COMPILER* compiler, const char* name,
+                           size_t name_len, int inverted)
 {
-    int n_errors = 0;
-    char opener[MUSTACHE_MAXOPENERLENGTH] = MUSTACHE_DEFAULTOPENER;
-    char closer[MUSTACHE_MAXCLOSERLENGTH] = MUSTACHE_DEFAULTCLOSER;
-    size_t opener_len;
-    size_t closer_len;
-    off_t off = 0;
-    off_t line = 1;
-    off_t col = 1;
-    MUSTACHE_TAGINFO current_tag;
-    MUSTACHE_BUFFER tags = { 0 };
+    if(mustache_compiler_flush(compiler) != 0)
+        return -1;
 
-    /* If this template will ever be used as a partial, it may inherit an
-     * extra indentation from parent template, so we mark every line beginning
-     * with the dummy tag for further processing in mustache_compile(). */
-    if(off < templ_size) {
-        current_tag.type = MUSTACHE_TAGTYPE_INDENT;
-        current_tag.beg = off;
-        current_tag.end = off;
-        if(mustache_buffer_append(&tags, &current_tag, sizeof(MUSTACHE_TAGINFO)) != 0)
-            goto err;
+    if(compiler->optimize) {
+        if(mustache_compiler_append_op(compiler, inverted ?
+                    MUSTACHE_OP_RESOLVE_ENTERINV : MUSTACHE_OP_RESOLVE_ENTER) != 0  ||
+           mustache_compiler_append_jmp(compiler) != 0  ||
+           mustache_compile_tagname(compiler, name, name_len) != 0)
+            return -1;
+        compiler->n_insns_saved++;
+    } else {
+        if(mustache_compiler_append_op(compiler, MUSTACHE_OP_RESOLVE_setjmp) != 0  ||
+           mustache_compiler_append_jmp(compiler) != 0  ||
+           mustache_compile_tagname(compiler, name, name_len) != 0  ||
+           mustache_compiler_append_op(compiler, inverted ?
+                    MUSTACHE_OP_ENTERINV : MUSTACHE_OP_ENTER) != 0)
+            return -1;
     }
 
-    current_tag.type = MUSTACHE_TAGTYPE_NONE;
+    if(compiler->cse  &&  mustache_compiler_push_cse_scope(compiler, inverted) != 0)
+        return -1;
 
-    opener_len = strlen(MUSTACHE_DEFAULTOPENER);
-    closer_len = strlen(MUSTACHE_DEFAULTCLOSER);
+    if(!inverted) {
+        /* LEAVE jumps back here for next iteration. */
+        if(mustache_stack_push(&compiler->jmp_pos_stack, compiler->insns.n) != 0)
+            return -1;
 
-    while(off < templ_size) {
-        int is_opener, is_closer;
+        compiler->section_depth++;
+        if(compiler->section_depth > compiler->max_section_depth)
+            compiler->max_section_depth = compiler->section_depth;
+    }
 
-        is_opener = (off + opener_len <= templ_size  &&  memcmp(templ_data+off, opener, opener_len) == 0);
-        is_closer = (off + closer_len <= templ_size  &&  memcmp(templ_data+off, closer, closer_len) == 0);
-        if(is_opener && is_closer) {
-            /* Opener and closer may be defined to be the same string.
-             * Consider for example "{{=@ @=}}".
-             * Determine the real meaning from current parser state:
-             */
-            if(current_tag.type == MUSTACHE_TAGTYPE_NONE)
-                is_closer = 0;
-            else
-                is_opener = 0;
-        }
+    return 0;
+}
 
-        if(is_opener) {
-            /* Handle tag opener "{{" */
+static int
+mustache_emit_close_section(MUSTACHE_COMPILER* compiler, int inverted)
+{
+    if(mustache_compiler_flush(compiler) != 0)
+        return -1;
 
-            if(current_tag.type != MUSTACHE_TAGTYPE_NONE  &&  current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
-                /* Opener after some previous opener??? */
-                parser->parse_error(MUSTACHE_ERR_DANGLINGTAGOPENER,
-                        mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGOPENER],
-                        (unsigned)current_tag.line, (unsigned)current_tag.col,
-                        parser_data);
-                n_errors++;
-                current_tag.type = MUSTACHE_TAGTYPE_NONE;
-            }
+    if(!inverted) {
+        if(mustache_compiler_append_op(compiler, MUSTACHE_OP_LEAVE) != 0  ||
+           mustache_compiler_append_jmp_back(compiler,
+                    (off_t) mustache_stack_pop(&compiler->jmp_pos_stack)) != 0)
+            return -1;
 
-            current_tag.line = line;
-            current_tag.col = col;
-            current_tag.beg = off;
-            off += opener_len;
+        compiler->section_depth--;
+    }
 
-            if(off < templ_size) {
-                switch(templ_data[off]) {
-                case '=':   current_tag.type = MUSTACHE_TAGTYPE_DELIM; off++; break;
-                case '!':   current_tag.type = MUSTACHE_TAGTYPE_COMMENT; off++; break;
-                case '{':   current_tag.type = MUSTACHE_TAGTYPE_VERBATIMVAR; off++; break;
-                case '&':   current_tag.type = MUSTACHE_TAGTYPE_VERBATIMVAR2; off++; break;
-                case '#':   current_tag.type = MUSTACHE_TAGTYPE_OPENSECTION; off++; break;
-                case '^':   current_tag.type = MUSTACHE_TAGTYPE_OPENSECTIONINV; off++; break;
-                case '/':   current_tag.type = MUSTACHE_TAGTYPE_CLOSESECTION; off++; break;
-                case '>':   current_tag.type = MUSTACHE_TAGTYPE_PARTIAL; off++; break;
-                default:    current_tag.type = MUSTACHE_TAGTYPE_VAR; break;
-                }
-            }
+    if(compiler->cse)
+        mustache_compiler_pop_cse_scope(compiler);
 
-            while(off < templ_size  &&  MUSTACHE_ISWHITESPACE(templ_data[off]))
-                off++;
-            current_tag.name_beg = off;
+    /* Resolve the jump of the section opener to this place. */
+    return mustache_compiler_resolve_jmp(compiler);
+}
 
-            col += current_tag.name_beg - current_tag.beg;
-        } else if(is_closer  &&  current_tag.type == MUSTACHE_TAGTYPE_NONE) {
-            /* Invalid closer. */
-            parser->parse_error(MUSTACHE_ERR_DANGLINGTAGCLOSER,
-                    mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGCLOSER],
-                    (unsigned) line, (unsigned) col, parser_data);
-            n_errors++;
-            off++;
-            col++;
-        } else if(is_closer) {
-            /* Handle tag closer "}}" */
+static int
+mustache_emit_partial(MUSTACHE_COMPILER* compiler, const char* name, size_t name_len,
+                      const char* indent, size_t indent_len)
+{
+    if(mustache_compiler_flush(compiler) != 0  ||
+       mustache_compiler_append_op(compiler, MUSTACHE_OP_PARTIAL) != 0  ||
+       mustache_compiler_append_str(compiler, name, name_len) != 0  ||
+       mustache_compiler_append_str(compiler, indent, indent_len) != 0)
+        return -1;
 
-            current_tag.name_end = off;
-            off += closer_len;
-            col += closer_len;
-            if(current_tag.type == MUSTACHE_TAGTYPE_VERBATIMVAR) {
-                /* Eat the extra '}'. Note it may be after the found
-                 * closer (if closer is "}}" or before it for a custom
-                 * closer. */
+    if(compiler->max_partial_depth < 1)
+        compiler->max_partial_depth = 1;
+    if(compiler->max_partial_indent < indent_len)
+        compiler->max_partial_indent = indent_len;
+    return 0;
+}
+
+static int
+mustache_emit_indent(MUSTACHE_COMPILER* compiler)
+{
+    if(!compiler->optimize)
+        return mustache_compiler_append_op(compiler, MUSTACHE_OP_INDENT);
+
+    /* The indentation may only be fused with a literal which follows it. */
+    if(mustache_compiler_flush(compiler) != 0)
+        return -1;
+    compiler->pending_indent = 1;
+    return 0;
+}
+
+static inline int
+mustache_emit_exit(MUSTACHE_COMPILER* compiler)
+{
+    if(mustache_compiler_flush(compiler) != 0)
+        return -1;
+    return mustache_compiler_append_op(compiler, MUSTACHE_OP_EXIT);
+}
+
+
+/* The parser recognizes the tags in the template and checks for any parsing
+ * errors, reporting them to the app. Unless any error is found, it feeds
+ * the code generator with the tags and the literal text between them.
+ */
+
+typedef enum MUSTACHE_TAGTYPE {
+    MUSTACHE_TAGTYPE_NONE = 0,
+    MUSTACHE_TAGTYPE_DELIM,             /* {{=@ @=}} */
+    MUSTACHE_TAGTYPE_COMMENT,           /* {{! comment }} */
+    MUSTACHE_TAGTYPE_VAR,               /* {{ var }} */
+    MUSTACHE_TAGTYPE_VERBATIMVAR,       /* {{{ var }}} */
+    MUSTACHE_TAGTYPE_VERBATIMVAR2,      /* {{& var }} */
+    MUSTACHE_TAGTYPE_OPENSECTION,       /* {{# section }} */
+    MUSTACHE_TAGTYPE_OPENSECTIONINV,    /* {{^ section }} */
+    MUSTACHE_TAGTYPE_CLOSESECTION,      /* {{/ section }} */
+    MUSTACHE_TAGTYPE_PARTIAL            /* {{> partial }} */
+} MUSTACHE_TAGTYPE;
+
+typedef struct MUSTACHE_TAGINFO {
+    MUSTACHE_TAGTYPE type;
+    off_t line;
+    off_t col;
+    off_t beg;
+    off_t end;
+    off_t name_beg;
+    off_t name_end;
+} MUSTACHE_TAGINFO;
+
+static void
+mustache_parse_error(int err_code, const char* msg,
+                    unsigned line, unsigned column, void* parser_data)
+{
+    /* noop */
+}
+
+/* Count trailing zero bits. The mask must not be zero. */
+static inline unsigned
+mustache_ctz(uint32_t mask)
+{
+#if defined __GNUC__
+    return (unsigned) __builtin_ctz(mask);
+#elif defined _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned) index;
+#else
+    unsigned index = 0;
+    while(!(mask & 1)) {
+        mask >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+/* Find the nearest byte at or after the offset which may start the tag opener
+ * (ch1), the tag closer (ch2) or a new line. Any other byte is a plain text
+ * from the parser's point of view, so it can skip whole vectors of them at
+ * once and confirm the candidates with memcmp() only.
+ *
+ * Returns templ_size if there is no such byte.
+ */
+static off_t
+mustache_scan(const char* templ_data, size_t templ_size, off_t off, char ch1, char ch2)
+{
+#if defined MUSTACHE_SCAN_AVX2
+    const __m256i v1 = _mm256_set1_epi8(ch1);
+    const __m256i v2 = _mm256_set1_epi8(ch2);
+    const __m256i vcr = _mm256_set1_epi8('\r');
+    const __m256i vlf = _mm256_set1_epi8('\n');
+
+    while(off + 32 <= templ_size) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(templ_data + off));
+        __m256i hits = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, v1), _mm256_cmpeq_epi8(chunk, v2)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, vcr), _mm256_cmpeq_epi8(chunk, vlf)));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+
+        if(mask != 0)
+            return off + mustache_ctz(mask);
+        off += 32;
+    }
+#elif defined MUSTACHE_SCAN_SSE2
+    const __m128i v1 = _mm_set1_epi8(ch1);
+    const __m128i v2 = _mm_set1_epi8(ch2);
+    const __m128i vcr = _mm_set1_epi8('\r');
+    const __m128i vlf = _mm_set1_epi8('\n');
+
+    while(off + 16 <= templ_size) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(templ_data + off));
+        __m128i hits = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, vcr), _mm_cmpeq_epi8(chunk, vlf)));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(hits);
+
+        if(mask != 0)
+            return off + mustache_ctz(mask);
+        off += 16;
+    }
+#endif
+
+    /* Portable path (and the tail for the vectorized ones). */
+    while(off < templ_size) {
+        char ch = templ_data[off];
+        if(ch == ch1  ||  ch == ch2  ||  MUSTACHE_ISNEWLINE(ch))
+            break;
+        off++;
+    }
+
+    return off;
+}
+
+static int
+mustache_is_std_closer(const char* closer, size_t closer_len)
+{
+    off_t off;
+
+    for(off = 0; off < closer_len; off++) {
+        if(closer[off] != '}')
+            return 0;
+    }
+
+    return 1;
+}
+
+static int
+mustache_validate_tagname(const char* tagname, size_t size)
+{
+    off_t off;
+
+    if(size == 1  &&  tagname[0] == '.')
+        return 0;
+
+    /* Verify there is no whitespace and that '.' is used only as a delimiter
+     * of non-empty tokens. */
+    if(tagname[0] == '.'  ||  tagname[size-1] == '.')
+        return -1;
+    for(off = 0; off < size; off++) {
+        if(MUSTACHE_ISWHITESPACE(tagname[off]))
+            return -1;
+        if(tagname[off] == '.'  &&  off+1 < size  &&  tagname[off+1] == '.')
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+mustache_parse_delimiters(const char* delim_spec, size_t size,
+                          char* opener, size_t* p_opener_len,
+                          char* closer, size_t* p_closer_len)
+{
+    off_t opener_beg, opener_end;
+    off_t closer_beg, closer_end;
+
+    opener_beg = 0;
+
+    opener_end = opener_beg;
+    while(opener_end < size) {
+        if(MUSTACHE_ISWHITESPACE(delim_spec[opener_end]))
+            break;
+        if(delim_spec[opener_end] == '=')
+            return -1;
+        opener_end++;
+    }
+    if(opener_end <= opener_beg  ||  opener_end - opener_beg > MUSTACHE_MAXOPENERLENGTH)
+        return -1;
+
+    closer_beg = opener_end;
+    while(closer_beg < size) {
+        if(!MUSTACHE_ISWHITESPACE(delim_spec[closer_beg]))
+            break;
+        closer_beg++;
+    }
+    if(closer_beg <= opener_end)
+        return -1;
+
+    closer_end = closer_beg;
+    while(closer_end < size) {
+        if(MUSTACHE_ISWHITESPACE(delim_spec[closer_end]))
+            return -1;
+        closer_end++;
+    }
+    if(closer_end <= closer_beg  ||   closer_end - closer_beg > MUSTACHE_MAXCLOSERLENGTH)
+        return -1;
+    if(closer_end != size)
+        return -1;
+
+    memcpy(opener, delim_spec + opener_beg, opener_end - opener_beg);
+    *p_opener_len = opener_end - opener_beg;
+    memcpy(closer, delim_spec + closer_beg, closer_end - closer_beg);
+    *p_closer_len = closer_end - closer_beg;
+    return 0;
+}
+
+/* Check the section-closing tag pairs with the innermost open section, and
+ * compile the tag. (All other section-related errors are dangling openers,
+ * and those can be detected only at the end of the template.)
+ */
+static int
+mustache_parse_close_section(const char* templ_data, MUSTACHE_BUFFER* section_stack,
+                             const MUSTACHE_TAGINFO* closer,
+                             const MUSTACHE_PARSER* parser, void* parser_data,
+                             MUSTACHE_COMPILER* compiler, int* p_n_errors)
+{
+    MUSTACHE_TAGINFO opener;
+
+    if(section_stack->n == 0) {
+        parser->parse_error(MUSTACHE_ERR_DANGLINGSECTIONCLOSER,
+                mustache_err_messages[MUSTACHE_ERR_DANGLINGSECTIONCLOSER],
+                (unsigned)closer->line, (unsigned)closer->col,
+                parser_data);
+        (*p_n_errors)++;
+        return 0;
+    }
+
+    section_stack->n -= sizeof(MUSTACHE_TAGINFO);
+    memcpy(&opener, section_stack->data + section_stack->n, sizeof(MUSTACHE_TAGINFO));
+
+    if(opener.name_end - opener.name_beg != closer->name_end - closer->name_beg  ||
+       strncmp(templ_data + opener.name_beg,
+               templ_data + closer->name_beg,
+               opener.name_end - opener.name_beg) != 0)
+    {
+        parser->parse_error(MUSTACHE_ERR_SECTIONNAMEMISMATCH,
+                mustache_err_messages[MUSTACHE_ERR_SECTIONNAMEMISMATCH],
+                (unsigned)closer->line, (unsigned)closer->col,
+                parser_data);
+        parser->parse_error(MUSTACHE_ERR_SECTIONOPENERHERE,
+                mustache_err_messages[MUSTACHE_ERR_SECTIONOPENERHERE],
+                (unsigned)opener.line, (unsigned)opener.col,
+                parser_data);
+        (*p_n_errors)++;
+    }
+
+    if(*p_n_errors > 0)
+        return 0;
+    return mustache_emit_close_section(compiler,
+                    (opener.type == MUSTACHE_TAGTYPE_OPENSECTIONINV));
+}
+
+static int
+mustache_parse_emit_tag(const char* templ_data, const MUSTACHE_TAGINFO* tag,
+                        MUSTACHE_COMPILER* compiler)
+{
+    const char* name = templ_data + tag->name_beg;
+    size_t name_len = tag->name_end - tag->name_beg;
+    size_t indent_len;
+
+    switch(tag->type) {
+    case MUSTACHE_TAGTYPE_VAR:
+    case MUSTACHE_TAGTYPE_VERBATIMVAR:
+    case MUSTACHE_TAGTYPE_VERBATIMVAR2:
+        return mustache_emit_var(compiler, name, name_len,
+                    (tag->type == MUSTACHE_TAGTYPE_VAR));
+
+    case MUSTACHE_TAGTYPE_OPENSECTION:
+    case MUSTACHE_TAGTYPE_OPENSECTIONINV:
+        return mustache_emit_open_section(compiler, name, name_len,
+                    (tag->type == MUSTACHE_TAGTYPE_OPENSECTIONINV));
+
+    case MUSTACHE_TAGTYPE_PARTIAL:
+        indent_len = 0;
+        while(MUSTACHE_ISWHITESPACE(templ_data[tag->beg + indent_len]))
+            indent_len++;
+        return mustache_emit_partial(compiler, name, name_len,
+                    templ_data + tag->beg, indent_len);
+
+    default:
+        /* Section closers are handled by mustache_parse_close_section();
+         * comments and delimiter changes produce no code. */
+        return 0;
+    }
+}
+
+static int
+mustache_parse(const char* templ_data, size_t templ_size,
+               const MUSTACHE_PARSER* parser, void* parser_data,
+               MUSTACHE_COMPILER* compiler)
+{
+    int n_errors = 0;
+    char opener[MUSTACHE_MAXOPENERLENGTH] = MUSTACHE_DEFAULTOPENER;
+    char closer[MUSTACHE_MAXCLOSERLENGTH] = MUSTACHE_DEFAULTCLOSER;
+    size_t opener_len;
+    size_t closer_len;
+    off_t off = 0;
+    off_t lit_beg = 0;  /* Start of a literal text not yet compiled. */
+    off_t line = 1;
+    off_t col = 1;
+    MUSTACHE_TAGINFO current_tag;
+    MUSTACHE_BUFFER section_stack;          /* Stack of MUSTACHE_TAGINFO. */
+    int ret = -1;
+
+    mustache_buffer_init(&section_stack, compiler->insns.allocator,
+                compiler->insns.allocator_data);
+
+    /* If this template will ever be used as a partial, it may inherit an
+     * extra indentation from parent template, so we mark every line beginning
+     * for it. */
+    if(off < templ_size) {
+        if(mustache_emit_indent(compiler) != 0)
+            goto err;
+    }
+
+    current_tag.type = MUSTACHE_TAGTYPE_NONE;
+
+    opener_len = strlen(MUSTACHE_DEFAULTOPENER);
+    closer_len = strlen(MUSTACHE_DEFAULTCLOSER);
+
+    while(off < templ_size) {
+        int is_opener, is_closer;
+
+        /* Skip quickly over any text which cannot be interesting for us. */
+        if(templ_data[off] != opener[0]  &&  templ_data[off] != closer[0]  &&
+           !MUSTACHE_ISNEWLINE(templ_data[off]))
+        {
+            off_t next = mustache_scan(templ_data, templ_size, off, opener[0], closer[0]);
+            col += next - off;
+            off = next;
+            if(off >= templ_size)
+                break;
+        }
+
+        is_opener =(off + opener_len <= templ_size  &&  memcmp(templ_data+off, opener, opener_len) == 0);
+        is_closer = (off + closer_len <= templ_size  &&  memcmp(templ_data+off, closer, closer_len) == 0);
+        if(is_opener && is_closer) {
+            /* Opener and closer may be defined to be the same string.
+             * Consider for example "{{=@ @=}}".
+             * Determine the real meaning from current parser state:
+             */
+            if(current_tag.type == MUSTACHE_TAGTYPE_NONE)
+                is_closer = 0;
+            else
+                is_opener = 0;
+        }
+
+        if(is_opener) {
+            /* Handle tag opener "{{" */
+
+            if(current_tag.type != MUSTACHE_TAGTYPE_NONE  &&  current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
+                /* Opener after some previous opener??? */
+                parser->parse_error(MUSTACHE_ERR_DANGLINGTAGOPENER,
+                        mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGOPENER],
+                        (unsigned)current_tag.line, (unsigned)current_tag.col,
+                        parser_data);
+                n_errors++;
+                current_tag.type = MUSTACHE_TAGTYPE_NONE;
+            }
+
+            current_tag.line = line;
+            current_tag.col = col;
+            current_tag.beg = off;
+            off += opener_len;
+
+            if(off < templ_size) {
+                switch(templ_data[off]) {
+                case '=':   current_tag.type = MUSTACHE_TAGTYPE_DELIM; off++; break;
+                case '!':   current_tag.type = MUSTACHE_TAGTYPE_COMMENT; off++; break;
+                case '{':   current_tag.type = MUSTACHE_TAGTYPE_VERBATIMVAR; off++; break;
+                case '&':   current_tag.type = MUSTACHE_TAGTYPE_VERBATIMVAR2; off++; break;
+                case '#':   current_tag.type = MUSTACHE_TAGTYPE_OPENSECTION; off++; break;
+                case '^':   current_tag.type = MUSTACHE_TAGTYPE_OPENSECTIONINV; off++; break;
+                case '/':   current_tag.type = MUSTACHE_TAGTYPE_CLOSESECTION; off++; break;
+                case '>':   current_tag.type = MUSTACHE_TAGTYPE_PARTIAL; off++; break;
+                default:    current_tag.type = MUSTACHE_TAGTYPE_VAR; break;
+                }
+            }
+
+            while(off < templ_size  &&  MUSTACHE_ISWHITESPACE(templ_data[off]))
+                off++;
+            current_tag.name_beg = off;
+
+            col += current_tag.name_beg - current_tag.beg;
+        } else if(is_closer  &&  current_tag.type == MUSTACHE_TAGTYPE_NONE) {
+            /* Invalid closer. */
+            parser->parse_error(MUSTACHE_ERR_DANGLINGTAGCLOSER,
+                    mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGCLOSER],
+                    (unsigned) line, (unsigned) col, parser_data);
+            n_errors++;
+            off++;
+            col++;
+        } else if(is_closer) {
+            /* Handle tag closer "}}" */
+
+            current_tag.name_end = off;
+            off += closer_len;
+            col += closer_len;
+            if(current_tag.type == MUSTACHE_TAGTYPE_VERBATIMVAR) {
+                /* Eat the extra '}'. Note it may be after the found
+                 * closer (if closer is "}}" or before it for a custom
+                 * closer. */
                 if(current_tag.name_end > current_tag.name_beg  &&
                             templ_data[current_tag.name_end-1] == '}') {
                     current_tag.name_end--;
@@ -506,657 +1601,2902 @@ mustache_parse(const char* templ_data, size_t templ_size,
                     off++;
                     col++;
                 } else {
-                    parser->parse_error(MUSTACHE_ERR_INCOMPATIBLETAGCLOSER,
-                            mustache_err_messages[MUSTACHE_ERR_INCOMPATIBLETAGCLOSER],
-                            (unsigned) line, (unsigned) col, parser_data);
-                    n_errors++;
+                    parser->parse_error(MUSTACHE_ERR_INCOMPATIBLETAGCLOSER,
+                            mustache_err_messages[MUSTACHE_ERR_INCOMPATIBLETAGCLOSER],
+                            (unsigned) line, (unsigned) col, parser_data);
+                    n_errors++;
+                }
+            } else if(current_tag.type == MUSTACHE_TAGTYPE_DELIM) {
+                /* Maybe we are not really the closer. Maybe the directive
+                 * does not change the closer so we are the "new closer" in
+                 * something like "{{=<something> }}=}}". */
+                if(templ_data[current_tag.name_end - 1] != '='  &&
+                   off + closer_len < templ_size  &&
+                   templ_data[off] == '='  &&
+                   memcmp(templ_data + off + 1, closer, closer_len) == 0)
+                {
+                    current_tag.name_end += closer_len + 1;
+                    off += closer_len + 1;
+                    col += closer_len + 1;
+                }
+
+                if(templ_data[current_tag.name_end - 1] != '=') {
+                    parser->parse_error(MUSTACHE_ERR_INCOMPATIBLETAGCLOSER,
+                            mustache_err_messages[MUSTACHE_ERR_INCOMPATIBLETAGCLOSER],
+                            (unsigned) line, (unsigned) col, parser_data);
+                    n_errors++;
+                } else if(current_tag.name_end > current_tag.name_beg) {
+                    current_tag.name_end--;     /* Consume the closer's '=' */
+                }
+            }
+
+            current_tag.end = off;
+
+            /* If the tag is standalone, expand it to consume also any
+             * preceding whitespace and also one new-line (before or after). */
+            if(current_tag.type != MUSTACHE_TAGTYPE_VAR &&
+               current_tag.type != MUSTACHE_TAGTYPE_VERBATIMVAR &&
+               current_tag.type != MUSTACHE_TAGTYPE_VERBATIMVAR2 &&
+               (current_tag.end >= templ_size || MUSTACHE_ISNEWLINE(templ_data[current_tag.end])))
+            {
+                off_t tmp_off = current_tag.beg;
+                while(tmp_off > 0 && MUSTACHE_ISWHITESPACE(templ_data[tmp_off-1]))
+                    tmp_off--;
+                if(tmp_off == 0 || MUSTACHE_ISNEWLINE(templ_data[tmp_off-1])) {
+                    current_tag.beg = tmp_off;
+
+                    if(current_tag.end < templ_size && templ_data[current_tag.end] == '\r')
+                        current_tag.end++;
+                    if(current_tag.end < templ_size && templ_data[current_tag.end] == '\n')
+                        current_tag.end++;
+                }
+            }
+
+            while(current_tag.name_end > current_tag.name_beg  &&
+                        MUSTACHE_ISWHITESPACE(templ_data[current_tag.name_end-1]))
+                current_tag.name_end--;
+
+            if(current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
+                if(current_tag.name_end <= current_tag.name_beg) {
+                    parser->parse_error(MUSTACHE_ERR_NOTAGNAME,
+                            mustache_err_messages[MUSTACHE_ERR_NOTAGNAME],
+                            (unsigned)current_tag.line, (unsigned)current_tag.col,
+                            parser_data);
+                    n_errors++;
+                }
+            }
+
+            if(current_tag.type == MUSTACHE_TAGTYPE_DELIM) {
+                if(mustache_parse_delimiters(templ_data + current_tag.name_beg,
+                        current_tag.name_end - current_tag.name_beg,
+                        opener, &opener_len, closer, &closer_len) != 0)
+                {
+                    parser->parse_error(MUSTACHE_ERR_INVALIDDELIMITERS,
+                            mustache_err_messages[MUSTACHE_ERR_INVALIDDELIMITERS],
+                            (unsigned)current_tag.line, (unsigned)current_tag.col,
+                            parser_data);
+                    n_errors++;
+                }
+
+                /* From now on, ignore this tag. */
+                current_tag.type = MUSTACHE_TAGTYPE_COMMENT;
+            }
+
+            if(current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
+                if(mustache_validate_tagname(templ_data + current_tag.name_beg,
+                            current_tag.name_end - current_tag.name_beg) != 0) {
+                    parser->parse_error(MUSTACHE_ERR_INVALIDTAGNAME,
+                            mustache_err_messages[MUSTACHE_ERR_INVALIDTAGNAME],
+                            (unsigned)current_tag.line, (unsigned)current_tag.col,
+                            parser_data);
+                    n_errors++;
+                }
+            }
+
+            /* Compile the tag, together with any literal text preceding it. */
+            if(n_errors == 0  &&  lit_beg < current_tag.beg) {
+                if(mustache_emit_literal(compiler, templ_data + lit_beg,
+                            current_tag.beg - lit_beg) != 0)
+                    goto err;
+            }
+
+            if(current_tag.type == MUSTACHE_TAGTYPE_OPENSECTION  ||
+               current_tag.type == MUSTACHE_TAGTYPE_OPENSECTIONINV) {
+                if(mustache_buffer_append(&section_stack, &current_tag, sizeof(MUSTACHE_TAGINFO)) != 0)
+                    goto err;
+            }
+
+            if(current_tag.type == MUSTACHE_TAGTYPE_CLOSESECTION) {
+                if(mustache_parse_close_section(templ_data, &section_stack, &current_tag,
+                            parser, parser_data, compiler, &n_errors) != 0)
+                    goto err;
+            } else if(n_errors == 0) {
+                if(mustache_parse_emit_tag(templ_data, &current_tag, compiler) != 0)
+                    goto err;
+            }
+
+            lit_beg = current_tag.end;
+
+            current_tag.type = MUSTACHE_TAGTYPE_NONE;
+        } else if(MUSTACHE_ISNEWLINE(templ_data[off])) {
+            /* Handle end of line. */
+
+            if(current_tag.type != MUSTACHE_TAGTYPE_NONE  &&  current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
+                parser->parse_error(MUSTACHE_ERR_DANGLINGTAGOPENER,
+                        mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGOPENER],
+                        (unsigned)current_tag.line, (unsigned)current_tag.col,
+                        parser_data);
+                n_errors++;
+                current_tag.type = MUSTACHE_TAGTYPE_NONE;
+            }
+
+            /* New line may be formed by digraph "\r\n". */
+            if(templ_data[off] == '\r')
+                off++;
+            if(off < templ_size  &&  templ_data[off] == '\n')
+                off++;
+
+            if(current_tag.type == MUSTACHE_TAGTYPE_NONE  &&  off < templ_size  &&  n_errors == 0) {
+                if(lit_beg < off) {
+                    if(mustache_emit_literal(compiler, templ_data + lit_beg, off - lit_beg) != 0)
+                        goto err;
+                    lit_beg = off;
+                }
+                if(mustache_emit_indent(compiler) != 0)
+                    goto err;
+            }
+
+            line++;
+            col = 1;
+        } else {
+            /* Handle any other character. */
+            off++;
+            col++;
+        }
+    }
+
+    /* Any section still open is an error. */
+    while(section_stack.n > 0) {
+        MUSTACHE_TAGINFO opener;
+
+        section_stack.n -= sizeof(MUSTACHE_TAGINFO);
+        memcpy(&opener, section_stack.data + section_stack.n, sizeof(MUSTACHE_TAGINFO));
+
+        parser->parse_error(MUSTACHE_ERR_DANGLINGSECTIONOPENER,
+                mustache_err_messages[MUSTACHE_ERR_DANGLINGSECTIONOPENER],
+                (unsigned)opener.line, (unsigned)opener.col,
+                parser_data);
+        n_errors++;
+    }
+
+    if(n_errors > 0)
+        goto err;
+
+    /* Compile any trailing literal text and mark end of the template. */
+    if(lit_beg < templ_size) {
+        if(mustache_emit_literal(compiler, templ_data + lit_beg, templ_size - lit_beg) != 0)
+            goto err;
+    }
+    if(mustache_emit_exit(compiler) != 0)
+        goto err;
+
+    /* Success. */
+    ret = 0;
+
+err:
+    mustache_buffer_free(&section_stack);
+    return ret;
+}
+
+static int mustache_strip_indents(MUSTACHE_TEMPLATE* t);
+
+/* Build the template from the compiler state. On success, the compiler gives
+ * up the ownership of the instructions. */
+static MUSTACHE_TEMPLATE*
+mustache_compiler_build_template(MUSTACHE_COMPILER* compiler,
+                                 const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                                 unsigned flags)
+{
+    MUSTACHE_TEMPLATE* t;
+
+    t = (MUSTACHE_TEMPLATE*) allocator->mem_alloc(sizeof(MUSTACHE_TEMPLATE), allocator_data);
+    if(t == NULL)
+        return NULL;
+
+    t->symbols = mustache_compiler_build_symbols(compiler, &t->symbols_alloc);
+    if(t->symbols == NULL  &&  t->symbols_alloc > 0) {
+        mustache_mem_free(allocator, allocator_data, t, sizeof(MUSTACHE_TEMPLATE));
+        return NULL;
+    }
+
+    t->paths = mustache_compiler_build_paths(compiler, t->symbols, &t->paths_alloc);
+    if(t->paths == NULL  &&  t->paths_alloc > 0) {
+        mustache_mem_free(allocator, allocator_data, t->symbols, t->symbols_alloc);
+        mustache_mem_free(allocator, allocator_data, t, sizeof(MUSTACHE_TEMPLATE));
+        return NULL;
+    }
+
+    t->allocator = allocator;
+    t->allocator_data = allocator_data;
+    t->insns = compiler->insns.data;
+    t->insns_alloc = compiler->insns.alloc;
+    t->indents = NULL;
+    t->n_indents = 0;
+    t->indents_alloc = 0;
+    t->insns_indent = NULL;
+    t->insns_indent_alloc = 0;
+    t->insns_indent_size = 0;
+    t->flags = flags;
+    t->n_symbols = compiler->n_symbols;
+    t->max_section_depth = compiler->max_section_depth;
+    t->max_partial_depth = compiler->max_partial_depth;
+    t->max_partial_indent = compiler->max_partial_indent;
+    t->n_slots = compiler->n_slots;
+    t->insns_size = compiler->insns.n;
+    t->n_insns = compiler->n_insns;
+    t->n_insns_saved = compiler->n_insns_saved;
+    t->n_resolves_reused = compiler->n_resolves_reused;
+
+    compiler->insns.data = NULL;
+    return t;
+}
+
+MUSTACHE_TEMPLATE*
+mustache_compile_ex(const char* templ_data, size_t templ_size,
+                    const MUSTACHE_PARSER* parser, void* parser_data,
+                    const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                    unsigned flags)
+{
+    static const MUSTACHE_PARSER default_parser = { mustache_parse_error };
+    MUSTACHE_COMPILER compiler;
+    MUSTACHE_TEMPLATE* t;
+
+    if(parser == NULL)
+        parser = &default_parser;
+    if(allocator == NULL)
+        allocator = &mustache_default_allocator;
+
+    mustache_compiler_init(&compiler, allocator, allocator_data, flags);
+
+    if(mustache_parse(templ_data, templ_size, parser, parser_data, &compiler) != 0) {
+        mustache_compiler_free(&compiler);
+        return NULL;
+    }
+
+    t = mustache_compiler_build_template(&compiler, allocator, allocator_data, flags);
+    mustache_compiler_free(&compiler);
+    if(t != NULL  &&  mustache_strip_indents(t) != 0) {
+        mustache_release(t);
+        return NULL;
+    }
+    return t;
+}
+
+MUSTACHE_TEMPLATE*
+mustache_compile(const char* templ_data, size_t templ_size,
+                 const MUSTACHE_PARSER* parser, void* parser_data,
+                 unsigned flags)
+{
+    return mustache_compile_ex(templ_data, templ_size, parser, parser_data,
+                    NULL, NULL, flags);
+}
+
+void
+mustache_template_info(const MUSTACHE_TEMPLATE* t, MUSTACHE_TEMPLATE_INFO* info)
+{
+    info->insns_size = t->insns_size;
+    info->insns_indent_size = t->insns_indent_size;
+    info->n_insns = t->n_insns;
+    info->n_insns_saved = t->n_insns_saved;
+    info->n_symbols = t->n_symbols;
+    info->n_resolves_reused = t->n_resolves_reused;
+}
+
+const MUSTACHE_SYMBOL*
+mustache_template_symbol(const MUSTACHE_TEMPLATE* t, const char* name, size_t size)
+{
+    unsigned hash = mustache_hash(name, size);
+    unsigned id;
+
+    for(id = 0; id < t->n_symbols; id++) {
+        const MUSTACHE_SYMBOL* sym = &t->symbols[id];
+        if(sym->hash == hash  &&  sym->size == size  &&  memcmp(sym->name, name, size) == 0)
+            return sym;
+    }
+
+    return NULL;
+}
+
+void
+mustache_release(MUSTACHE_TEMPLATE* t)
+{
+    if(t == NULL)
+        return;
+
+    mustache_mem_free(t->allocator, t->allocator_data, t->insns, t->insns_alloc);
+    mustache_mem_free(t->allocator, t->allocator_data, t->indents, t->indents_alloc);
+    mustache_mem_free(t->allocator, t->allocator_data, t->insns_indent, t->insns_indent_alloc);
+    mustache_mem_free(t->allocator, t->allocator_data, t->symbols, t->symbols_alloc);
+    mustache_mem_free(t->allocator, t->allocator_data, (void*) t->paths, t->paths_alloc);
+    mustache_mem_free(t->allocator, t->allocator_data, t, sizeof(MUSTACHE_TEMPLATE));
+}
+
+
+/**************************************
+ *** Linking Partials into Template ***
+ **************************************/
+
+/* mustache_link() decodes the compiled template and feeds the instructions
+ * back into a new code generator (see MUSTACHE_COMPILER), so that the peephole
+ * optimizations and MUSTACHE_FLAG_CSE apply to the linked code as a whole.
+ * Whenever it reaches a partial which can be inlined, it descends recursively
+ * into the partial's code instead of emitting the PARTIAL instruction.
+ *
+ * The INDENT instructions of an inlined partial are followed by a literal with
+ * the indentation the partial would have got from the PARTIAL instructions
+ * (the standalone indentation), so only the indentation inherited from the
+ * processing of any remaining (dynamic) partials is left for the runtime.
+ *
+ * The same machinery (with no linker) strips the INDENT instructions from the
+ * code of each compiled or linked template, and builds the copy of the code
+ * with them put back (see MUSTACHE_TEMPLATE::indents). Note the names are fed
+ * to the code generator in the same order, so the symbol IDs (and the slots)
+ * in the copy are the same as in the original code.
+ */
+typedef struct MUSTACHE_LINK_NAME {
+    const char* name;
+    size_t size;
+} MUSTACHE_LINK_NAME;
+
+typedef struct MUSTACHE_LINK_STATE {
+    MUSTACHE_COMPILER compiler;
+    const MUSTACHE_LINKER* linker;  /* NULL when not inlining. */
+    void* linker_data;
+    size_t max_inline_size;
+    int strip_indent;
+    MUSTACHE_BUFFER indents;    /* Places of the stripped INDENT instructions. */
+    const MUSTACHE_ALLOCATOR* allocator;
+    void* allocator_data;
+    MUSTACHE_STACK chain;       /* Templates being inlined (to detect cycles). */
+    MUSTACHE_STACK strings;     /* Strings built during linking, as (ptr, size) pairs. */
+} MUSTACHE_LINK_STATE;
+
+static inline uint64_t
+mustache_decode_arg(const uint8_t* data, off_t off, off_t* p_off, int compact)
+{
+    return (compact ? mustache_decode_num(data, off, p_off)
+                    : mustache_decode_word(data, off, p_off));
+}
+
+/* Allocate a string which stays valid until the linking is done. (The code
+ * generator may keep pointers to names and literals until its very end.) */
+static char*
+mustache_link_alloc_str(MUSTACHE_LINK_STATE* state, size_t size)
+{
+    char* str;
+
+    str = (char*) state->allocator->mem_alloc(size, state->allocator_data);
+    if(str == NULL)
+        return NULL;
+
+    if(mustache_stack_push(&state->strings, (uintptr_t) str) != 0  ||
+       mustache_stack_push(&state->strings, size) != 0) {
+        mustache_mem_free(state->allocator, state->allocator_data, str, size);
+        return NULL;
+    }
+
+    return str;
+}
+
+/* Concatenate the two strings (for the indentation strings). */
+static int
+mustache_link_concat(MUSTACHE_LINK_STATE* state, const char* a, size_t a_len,
+                     const char* b, size_t b_len, MUSTACHE_LINK_NAME* result)
+{
+    char* str;
+
+    if(a_len == 0  ||  b_len == 0) {
+        result->name = (a_len > 0) ? a : b;
+        result->size = a_len + b_len;
+        return 0;
+    }
+
+    str = mustache_link_alloc_str(state, a_len + b_len);
+    if(str == NULL)
+        return -1;
+    memcpy(str, a, a_len);
+    memcpy(str + a_len, b, b_len);
+    result->name = str;
+    result->size = a_len + b_len;
+    return 0;
+}
+
+/* Decode the names argument back into the (dotted) name as written in the
+ * template. slot_names remembers the names stored into the slots so that
+ * MUSTACHE_NAMES_LOAD can be decoded too. */
+static int
+mustache_link_decode_names(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* t,
+                           off_t* p_pc, MUSTACHE_LINK_NAME* slot_names,
+                           MUSTACHE_LINK_NAME* result)
+{
+    const uint8_t* insns = t->insns;
+    int compact = ((t->flags & MUSTACHE_FLAG_COMPACT) != 0);
+    off_t pc = *p_pc;
+    unsigned header;
+    unsigned n_names;
+    unsigned slot = 0;
+    unsigned i;
+
+    header = (unsigned) mustache_decode_arg(insns, pc, &pc, compact);
+    n_names = (header >> 2);
+
+    if((header & 0x3) == MUSTACHE_NAMES_LOAD) {
+        *result = slot_names[n_names];
+        *p_pc = pc;
+        return 0;
+    }
+
+    if((header & 0x3) == MUSTACHE_NAMES_STORE)
+        slot = (unsigned) mustache_decode_arg(insns, pc, &pc, compact);
+
+    if(n_names == 0) {
+        /* Implicit iterator. */
+        result->name = ".";
+        result->size = 1;
+    } else if(n_names == 1) {
+        const MUSTACHE_SYMBOL* sym = &t->symbols[mustache_decode_arg(insns, pc, &pc, compact)];
+        result->name = sym->name;
+        result->size = sym->size;
+    } else {
+        off_t names_pc;
+        size_t size = n_names - 1;
+        char* str;
+
+        /* Skip the path index. */
+        mustache_decode_arg(insns, pc, &pc, compact);
+
+        names_pc = pc;
+        for(i = 0; i < n_names; i++)
+            size += t->symbols[mustache_decode_arg(insns, pc, &pc, compact)].size;
+
+        str = mustache_link_alloc_str(state, size);
+        if(str == NULL)
+            return -1;
+
+        result->name = str;
+        result->size = size;
+        pc = names_pc;
+        for(i = 0; i < n_names; i++) {
+            const MUSTACHE_SYMBOL* sym = &t->symbols[mustache_decode_arg(insns, pc, &pc, compact)];
+            if(i > 0)
+                *str++ = '.';
+            memcpy(str, sym->name, sym->size);
+            str += sym->size;
+        }
+    }
+
+    if((header & 0x3) == MUSTACHE_NAMES_STORE)
+        slot_names[slot] = *result;
+
+    *p_pc = pc;
+    return 0;
+}
+
+/* Check whether the partial is (directly or indirectly) recursive, i.e.
+ * whether it is being linked already. */
+static int
+mustache_link_is_recursive(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* partial)
+{
+    const MUSTACHE_TEMPLATE** chain = (const MUSTACHE_TEMPLATE**) state->chain.data;
+    size_t i, n = state->chain.n / sizeof(const MUSTACHE_TEMPLATE*);
+
+    for(i = 0; i < n; i++) {
+        if(chain[i] == partial)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Decide whether the partial may be inlined. */
+static int
+mustache_link_can_inline(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* partial)
+{
+    if(partial->insns_size > state->max_inline_size)
+        return 0;
+
+    /* A recursive partial is kept as a dynamic call; it would never stop
+     * expanding. */
+    if(mustache_link_is_recursive(state, partial))
+        return 0;
+
+    return 1;
+}
+
+/* Account the stacks a partial kept as a dynamic call needs when it is
+ * processed, so the processor reserves them up front. (The nesting of
+ * a recursive partial has no bound so it counts as a single level.) */
+static void
+mustache_link_account_partial(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* partial,
+                              size_t indent_len)
+{
+    MUSTACHE_COMPILER* compiler = &state->compiler;
+
+    if(partial == NULL  ||  mustache_link_is_recursive(state, partial))
+        return;
+
+    if(compiler->max_section_depth < compiler->section_depth + partial->max_section_depth)
+        compiler->max_section_depth = compiler->section_depth + partial->max_section_depth;
+    if(compiler->max_partial_depth < 1 + partial->max_partial_depth)
+        compiler->max_partial_depth = 1 + partial->max_partial_depth;
+    if(compiler->max_partial_indent < indent_len + partial->max_partial_indent)
+        compiler->max_partial_indent = indent_len + partial->max_partial_indent;
+}
+
+/* Emit INDENT at the current place, followed by the indentation of the inlined
+ * partial (if any). When stripping, only remember the place. */
+static int
+mustache_link_indent(MUSTACHE_LINK_STATE* state, const char* indent, size_t indent_len,
+                     size_t depth)
+{
+    MUSTACHE_COMPILER* compiler = &state->compiler;
+    MUSTACHE_INDENT_POS pos;
+
+    if(!state->strip_indent) {
+        if(mustache_emit_indent(compiler) != 0  ||
+           mustache_emit_literal(compiler, indent, indent_len) != 0)
+            return -1;
+        return 0;
+    }
+
+    /* Any pending literal goes to the current end of the code. */
+    if(compiler->insns.n > UINT32_MAX  ||  compiler->pending_len > UINT32_MAX)
+        return -1;
+    pos.pc = (uint32_t) compiler->insns.n;
+    pos.off = (uint32_t) compiler->pending_len;
+    pos.depth = (uint32_t) depth;
+    return mustache_buffer_append(&state->indents, &pos, sizeof(MUSTACHE_INDENT_POS));
+}
+
+/* Re-emit code of the template t. If the template is an inlined partial,
+ * the indent is its standalone indentation (including the one of all the
+ * partials it is inlined into). */
+static int
+mustache_link_template(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* t,
+                       const char* indent, size_t indent_len)
+{
+    MUSTACHE_COMPILER* compiler = &state->compiler;
+    const uint8_t* insns = t->insns;
+    int compact = ((t->flags & MUSTACHE_FLAG_COMPACT) != 0);
+    MUSTACHE_LINK_NAME slot_names[MUSTACHE_CSE_MAX_SLOTS];
+    MUSTACHE_STACK inv_end_stack;   /* Ends of the open inverted sections. */
+    MUSTACHE_LINK_NAME name;
+    const MUSTACHE_INDENT_POS* indents = t->indents;
+    unsigned i_indent = 0;          /* Next INDENT to put back (if stripped). */
+    off_t pc = 0;
+    off_t op_pc;
+    size_t depth;
+    unsigned opcode;
+    int ret = -1;
+
+    if(mustache_stack_push(&state->chain, (uintptr_t) t) != 0)
+        return -1;
+    mustache_buffer_init(&inv_end_stack, state->allocator, state->allocator_data);
+
+    while(1) {
+        /* Inverted sections have no closing instruction. They end where
+         * their opener jumps. Any INDENT stripped from the same place goes
+         * into the section it has been in. */
+        while(1) {
+            depth = inv_end_stack.n / sizeof(uintptr_t);
+            while(i_indent < t->n_indents  &&  indents[i_indent].pc == (uint32_t) pc  &&
+                  indents[i_indent].off == 0  &&  indents[i_indent].depth >= depth) {
+                if(mustache_link_indent(state, indent, indent_len, depth) != 0)
+                    goto err;
+                i_indent++;
+            }
+
+            if(mustache_stack_is_empty(&inv_end_stack)  ||
+               (off_t) mustache_stack_peek(&inv_end_stack) != pc)
+                break;
+            mustache_stack_pop(&inv_end_stack);
+            if(mustache_emit_close_section(compiler, 1) != 0)
+                goto err;
+        }
+
+        op_pc = pc;
+        opcode = (unsigned) mustache_decode_arg(insns, pc, &pc, compact);
+        switch(opcode) {
+            case MUSTACHE_OP_EXIT:
+                ret = 0;
+                goto err;
+
+            case MUSTACHE_OP_INDENT:
+            case MUSTACHE_OP_INDENT_LITERAL:
+                if(mustache_link_indent(state, indent, indent_len, depth) != 0)
+                    goto err;
+                if(opcode == MUSTACHE_OP_INDENT)
+                    break;
+                /* Pass through. */
+            case MUSTACHE_OP_LITERAL:
+            {
+                size_t len = (size_t) mustache_decode_arg(insns, pc, &pc, compact);
+                const char* str = mustache_decode_str(insns, pc, &pc, len, compact);
+                size_t done = 0;
+
+                /* Put back the INDENTs stripped from inside of the literal. */
+                while(i_indent < t->n_indents  &&  indents[i_indent].pc == (uint32_t) op_pc) {
+                    size_t off = indents[i_indent].off;
+
+                    if(off < done  ||  off > len)
+                        goto err;
+                    if(mustache_emit_literal(compiler, str + done, off - done) != 0  ||
+                       mustache_link_indent(state, indent, indent_len, depth) != 0)
+                        goto err;
+                    done = off;
+                    i_indent++;
+                }
+                if(mustache_emit_literal(compiler, str + done, len - done) != 0)
+                    goto err;
+                break;
+            }
+
+            case MUSTACHE_OP_RESOLVE:
+            case MUSTACHE_OP_RESOLVE_OUTVERBATIM:
+            case MUSTACHE_OP_RESOLVE_OUTESCAPED:
+            {
+                unsigned out_opcode = opcode;
+
+                if(mustache_link_decode_names(state, t, &pc, slot_names, &name) != 0)
+                    goto err;
+                if(opcode == MUSTACHE_OP_RESOLVE)
+                    out_opcode = (unsigned) mustache_decode_arg(insns, pc, &pc, compact);
+                if(mustache_emit_var(compiler, name.name, name.size,
+                            (out_opcode == MUSTACHE_OP_OUTESCAPED  ||
+                             out_opcode == MUSTACHE_OP_RESOLVE_OUTESCAPED)) != 0)
+                    goto err;
+                break;
+            }
+
+            case MUSTACHE_OP_RESOLVE_setjmp:
+            case MUSTACHE_OP_RESOLVE_ENTER:
+            case MUSTACHE_OP_RESOLVE_ENTERINV:
+            {
+                off_t jmp_end;
+                uint64_t jmp = mustache_decode_arg(insns, pc, &pc, compact);
+                unsigned enter_opcode = opcode;
+
+                jmp_end = compact ? pc + (off_t) jmp : (off_t) jmp;
+                if(mustache_link_decode_names(state, t, &pc, slot_names, &name) != 0)
+                    goto err;
+                if(opcode == MUSTACHE_OP_RESOLVE_setjmp)
+                    enter_opcode = (unsigned) mustache_decode_arg(insns, pc, &pc, compact);
+
+                if(enter_opcode == MUSTACHE_OP_ENTERINV  ||
+                   enter_opcode == MUSTACHE_OP_RESOLVE_ENTERINV) {
+                    if(mustache_stack_push(&inv_end_stack, jmp_end) != 0  ||
+                       mustache_emit_open_section(compiler, name.name, name.size, 1) != 0)
+                        goto err;
+                } else {
+                    if(mustache_emit_open_section(compiler, name.name, name.size, 0) != 0)
+                        goto err;
+                }
+                break;
+            }
+
+            case MUSTACHE_OP_LEAVE:
+                mustache_decode_arg(insns, pc, &pc, compact);
+                if(mustache_emit_close_section(compiler, 0) != 0)
+                    goto err;
+                break;
+
+            case MUSTACHE_OP_PARTIAL:
+            {
+                size_t name_len, partial_indent_len;
+                const char* partial_name;
+                const char* partial_indent;
+                MUSTACHE_TEMPLATE* partial;
+                MUSTACHE_LINK_NAME full_indent;
+
+                name_len = (size_t) mustache_decode_arg(insns, pc, &pc, compact);
+                partial_name = mustache_decode_str(insns, pc, &pc, name_len, compact);
+                partial_indent_len = (size_t) mustache_decode_arg(insns, pc, &pc, compact);
+                partial_indent = mustache_decode_str(insns, pc, &pc, partial_indent_len, compact);
+
+                if(mustache_link_concat(state, indent, indent_len,
+                            partial_indent, partial_indent_len, &full_indent) != 0)
+                    goto err;
+
+                partial = NULL;
+                if(state->linker != NULL)
+                    partial = state->linker->get_partial(partial_name, name_len, state->linker_data);
+                if(partial != NULL  &&  mustache_link_can_inline(state, partial)) {
+                    if(mustache_link_template(state, partial, full_indent.name, full_indent.size) != 0)
+                        goto err;
+                } else {
+                    if(mustache_emit_partial(compiler, partial_name, name_len,
+                                full_indent.name, full_indent.size) != 0)
+                        goto err;
+                    mustache_link_account_partial(state, partial, full_indent.size);
+                }
+                break;
+            }
+
+            default:
+                /* OUTVERBATIM, OUTESCAPED, ENTER and ENTERINV are consumed
+                 * together with the preceding instruction; anything else
+                 * means broken code. */
+                goto err;
+        }
+    }
+
+err:
+    mustache_stack_pop(&state->chain);
+    mustache_stack_free(&inv_end_stack);
+    return ret;
+}
+
+static void
+mustache_link_init(MUSTACHE_LINK_STATE* state, const MUSTACHE_TEMPLATE* t,
+                   const MUSTACHE_LINKER* linker, void* linker_data,
+                   size_t max_inline_size, int strip_indent)
+{
+    state->linker = linker;
+    state->linker_data = linker_data;
+    state->max_inline_size = max_inline_size;
+    state->strip_indent = strip_indent;
+    mustache_buffer_init(&state->indents, t->allocator, t->allocator_data);
+    state->allocator = t->allocator;
+    state->allocator_data = t->allocator_data;
+    mustache_compiler_init(&state->compiler, t->allocator, t->allocator_data, t->flags);
+    mustache_buffer_init(&state->chain, t->allocator, t->allocator_data);
+    mustache_buffer_init(&state->strings, t->allocator, t->allocator_data);
+}
+
+static void
+mustache_link_fini(MUSTACHE_LINK_STATE* state)
+{
+    while(!mustache_stack_is_empty(&state->strings)) {
+        size_t size = (size_t) mustache_stack_pop(&state->strings);
+        char* str = (char*) mustache_stack_pop(&state->strings);
+        mustache_mem_free(state->allocator, state->allocator_data, str, size);
+    }
+    mustache_stack_free(&state->strings);
+    mustache_stack_free(&state->chain);
+    mustache_buffer_free(&state->indents);
+    mustache_compiler_free(&state->compiler);
+}
+
+/* Strip the INDENT instructions from the code of the newly built template,
+ * keeping their places in the table (see MUSTACHE_TEMPLATE::indents). With
+ * MUSTACHE_FLAG_INDENTCOPY, the original code is kept as the copy with them. */
+static int
+mustache_strip_indents(MUSTACHE_TEMPLATE* t)
+{
+    MUSTACHE_LINK_STATE state;
+    int ret = -1;
+
+    /* Without the optimizations, the code stays as the compiler has emitted
+     * it. */
+    if(t->flags & MUSTACHE_FLAG_NOOPTIMIZE)
+        return 0;
+
+    mustache_link_init(&state, t, NULL, NULL, 0, 1);
+
+    if(mustache_link_template(&state, t, NULL, 0) != 0  ||
+       mustache_emit_exit(&state.compiler) != 0)
+        goto err;
+
+    /* Nothing to strip. */
+    if(state.indents.n == 0) {
+        ret = 0;
+        goto err;
+    }
+
+    if(t->flags & MUSTACHE_FLAG_INDENTCOPY) {
+        t->insns_indent = t->insns;
+        t->insns_indent_alloc = t->insns_alloc;
+        t->insns_indent_size = t->insns_size;
+    } else {
+        mustache_mem_free(t->allocator, t->allocator_data, t->insns, t->insns_alloc);
+    }
+
+    t->insns = state.compiler.insns.data;
+    t->insns_alloc = state.compiler.insns.alloc;
+    t->insns_size = state.compiler.insns.n;
+    t->n_insns_saved = t->n_insns + t->n_insns_saved - state.compiler.n_insns;
+    t->n_insns = state.compiler.n_insns;
+    state.compiler.insns.data = NULL;
+
+    t->indents = (MUSTACHE_INDENT_POS*) state.indents.data;
+    t->n_indents = (unsigned) (state.indents.n / sizeof(MUSTACHE_INDENT_POS));
+    t->indents_alloc = state.indents.alloc;
+    state.indents.data = NULL;
+    ret = 0;
+
+err:
+    mustache_link_fini(&state);
+    return ret;
+}
+
+/* Build the copy of the code with the INDENT instructions put back, for
+ * processing the template as an indented partial. */
+static int
+mustache_build_indent_copy(MUSTACHE_TEMPLATE* t)
+{
+    MUSTACHE_LINK_STATE state;
+    int ret = -1;
+
+    mustache_link_init(&state, t, NULL, NULL, 0, 0);
+
+    if(mustache_link_template(&state, t, NULL, 0) != 0  ||
+       mustache_emit_exit(&state.compiler) != 0)
+        goto err;
+
+    t->insns_indent = state.compiler.insns.data;
+    t->insns_indent_alloc = state.compiler.insns.alloc;
+    t->insns_indent_size = state.compiler.insns.n;
+    state.compiler.insns.data = NULL;
+    ret = 0;
+
+err:
+    mustache_link_fini(&state);
+    return ret;
+}
+
+MUSTACHE_TEMPLATE*
+mustache_link(const MUSTACHE_TEMPLATE* t, const MUSTACHE_LINKER* linker,
+              void* linker_data, size_t max_inline_size)
+{
+    MUSTACHE_LINK_STATE state;
+    MUSTACHE_TEMPLATE* linked = NULL;
+
+    mustache_link_init(&state, t, linker, linker_data, max_inline_size, 0);
+
+    if(mustache_link_template(&state, t, NULL, 0) != 0  ||
+       mustache_emit_exit(&state.compiler) != 0)
+        goto err;
+
+    linked = mustache_compiler_build_template(&state.compiler,
+                    t->allocator, t->allocator_data, t->flags);
+    if(linked != NULL  &&  mustache_strip_indents(linked) != 0) {
+        mustache_release(linked);
+        linked = NULL;
+    }
+
+err:
+    mustache_link_fini(&state);
+    return linked;
+}
+
+
+/**********************************
+ *** Applying Compiled Template ***
+ **********************************/
+
+/* State of a loop over a list, i.e. of a (non-inverted) section. */
+#define MUSTACHE_LOOP_WINDOW    64
+
+typedef struct MUSTACHE_LOOP {
+    void* list;
+    uintptr_t iter;         /* Iterator state, or index of the current item. */
+    size_t end;             /* Count of items (if known), or SIZE_MAX. */
+
+    /* Window of items fetched with get_children(). The current item is
+     * window[win_pos]. */
+    unsigned win_pos;
+    unsigned win_n;
+    void* window[MUSTACHE_LOOP_WINDOW];
+} MUSTACHE_LOOP;
+
+/* Entry of the name resolution memo (see MUSTACHE_PROCESSOR_FLAG_MEMO).
+ *
+ * It remembers the child (or its absence) of a frame of the lookup context for
+ * a symbol. Instead of the frame node pointer, the entry refers to the frame
+ * by a generation number, which is assigned anew whenever a frame is pushed
+ * or replaced. So an entry silently becomes stale when its frame goes away,
+ * and no explicit invalidation is needed. (Generation zero marks an unused
+ * entry.) */
+#define MUSTACHE_MEMO_SIZE      256     /* Must be power of 2. */
+
+typedef struct MUSTACHE_MEMO_ENTRY {
+    unsigned gen;
+    const MUSTACHE_SYMBOL* sym;
+    void* child;
+} MUSTACHE_MEMO_ENTRY;
+
+/* Entry of the inline cache (if the data provider implements get_shape()).
+ *
+ * It remembers the result of get_shape_slot() for a resolve site (i.e. the
+ * position of the symbol ID in the compiled template) and a shape. As several
+ * shapes may be seen at the same site (e.g. when walking up the lookup context
+ * or when the items of a list differ), the cache is keyed by both, so it is
+ * polymorphic. The entries are valid only during the call of
+ * mustache_process_ex() which has the same epoch. */
+#define MUSTACHE_PIC_SIZE       512     /* Must be power of 2. */
+
+typedef struct MUSTACHE_PIC_ENTRY {
+    unsigned epoch;
+    const uint8_t* site;
+    const void* shape;
+    int slot;
+} MUSTACHE_PIC_ENTRY;
+
+/* Entry of the cache of the partials. It remembers the result of get_partial()
+ * for a PARTIAL instruction (identified by its address). The entries are valid
+ * only while the processor's partial_gen stays the same. By default, it gets
+ * incremented for each call of mustache_process_ex(), but with
+ * MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS only by
+ * mustache_processor_invalidate_partials(). */
+#define MUSTACHE_PARTIAL_CACHE_SIZE     64      /* Must be power of 2. */
+
+typedef struct MUSTACHE_PARTIAL_CACHE_ENTRY {
+    unsigned gen;
+    const uint8_t* site;
+    MUSTACHE_TEMPLATE* partial;
+} MUSTACHE_PARTIAL_CACHE_ENTRY;
+
+/* The state of the virtual machine. It is 'running' also when suspended
+ * (i.e. between the calls of mustache_process_step()). */
+#define MUSTACHE_VM_IDLE            0
+#define MUSTACHE_VM_RUNNING         1
+
+typedef struct MUSTACHE_VM {
+    int state;
+    const MUSTACHE_TEMPLATE* t;
+    const MUSTACHE_RENDERER* renderer;
+    void* renderer_data;
+    const MUSTACHE_DATAPROVIDER* provider;
+    void* provider_data;
+    off_t reg_pc;
+    off_t reg_jmpaddr;
+    void* reg_node;
+    size_t reg_slot_base;
+} MUSTACHE_VM;
+
+struct MUSTACHE_PROCESSOR {
+    const MUSTACHE_ALLOCATOR* allocator;
+    void* allocator_data;
+    unsigned flags;
+
+    /* The stacks are kept between the calls of mustache_process_ex(), so once
+     * they grow big enough, the processing needs no memory allocations. */
+    MUSTACHE_STACK node_stack;      /* Lookup context: root and current items. */
+    MUSTACHE_BUFFER loop_stack;     /* MUSTACHE_LOOP of each open loop. */
+    MUSTACHE_STACK partial_stack;
+    MUSTACHE_BUFFER indent_buffer;
+    MUSTACHE_STACK slot_stack;      /* Slots of each active template. */
+
+    /* Name resolution memo (only if MUSTACHE_PROCESSOR_FLAG_MEMO). */
+    MUSTACHE_MEMO_ENTRY* memo;
+    MUSTACHE_BUFFER memo_gens;      /* Generation of each node_stack frame. */
+    unsigned memo_gen;              /* Last generation assigned. */
+    unsigned n_memo_hits;
+
+    /* Inline cache (allocated when first used with a provider implementing
+     * get_shape()). */
+    MUSTACHE_PIC_ENTRY* pic;
+    unsigned pic_epoch;
+    unsigned n_pic_hits;
+
+    /* Cache of the partials. (Generation zero marks an unused entry.) */
+    MUSTACHE_PARTIAL_CACHE_ENTRY partial_cache[MUSTACHE_PARTIAL_CACHE_SIZE];
+    unsigned partial_gen;
+    unsigned n_partial_hits;
+
+    /* Registers of the virtual machine, kept here when it is suspended. */
+    MUSTACHE_VM vm;
+
+    /* Output of the resumable processing (see mustache_process_step()):
+     * The buffer provided by the application, and the output which has not
+     * fit into it. That is either the rest of a literal (referred to in the
+     * template), or a copy of anything else (spill), or both (the literal
+     * goes first then). */
+    char* step_buf;
+    size_t step_size;
+    size_t step_n;
+    int step_full;                  /* Suspend the VM at the next instruction. */
+    unsigned step_escape;
+    const char* step_literal;
+    size_t step_literal_size;
+    MUSTACHE_BUFFER step_spill;
+    size_t step_spill_off;
+};
+
+static void
+mustache_processor_init(MUSTACHE_PROCESSOR* processor,
+                        const MUSTACHE_ALLOCATOR* allocator, void* allocator_data)
+{
+    memset(processor, 0, sizeof(MUSTACHE_PROCESSOR));
+    processor->allocator = allocator;
+    processor->allocator_data = allocator_data;
+    processor->partial_gen = 1;
+    mustache_buffer_init(&processor->node_stack, allocator, allocator_data);
+    mustache_buffer_init(&processor->loop_stack, allocator, allocator_data);
+    mustache_buffer_init(&processor->partial_stack, allocator, allocator_data);
+    mustache_buffer_init(&processor->indent_buffer, allocator, allocator_data);
+    mustache_buffer_init(&processor->slot_stack, allocator, allocator_data);
+    mustache_buffer_init(&processor->memo_gens, allocator, allocator_data);
+    mustache_buffer_init(&processor->step_spill, allocator, allocator_data);
+}
+
+static void mustache_vm_abort(MUSTACHE_PROCESSOR* processor);
+
+static void
+mustache_processor_free(MUSTACHE_PROCESSOR* processor)
+{
+    /* End the iterations of a suspended processing, if any. */
+    mustache_vm_abort(processor);
+
+    mustache_stack_free(&processor->node_stack);
+    mustache_buffer_free(&processor->loop_stack);
+    mustache_stack_free(&processor->partial_stack);
+    mustache_buffer_free(&processor->indent_buffer);
+    mustache_stack_free(&processor->slot_stack);
+    mustache_buffer_free(&processor->memo_gens);
+    mustache_buffer_free(&processor->step_spill);
+    mustache_mem_free(processor->allocator, processor->allocator_data,
+                processor->memo, MUSTACHE_MEMO_SIZE * sizeof(MUSTACHE_MEMO_ENTRY));
+    mustache_mem_free(processor->allocator, processor->allocator_data,
+                processor->pic, MUSTACHE_PIC_SIZE * sizeof(MUSTACHE_PIC_ENTRY));
+}
+
+/* Make all entries of the cache of the partials stale. */
+static void
+mustache_processor_next_partial_gen(MUSTACHE_PROCESSOR* processor)
+{
+    processor->partial_gen++;
+    if(processor->partial_gen == 0) {
+        memset(processor->partial_cache, 0, sizeof(processor->partial_cache));
+        processor->partial_gen = 1;
+    }
+}
+
+/* Each partial being processed has a frame of three words in partial_stack:
+ * the calling template, the return address, and the length of the
+ * indentation appended to indent_buffer. */
+#define MUSTACHE_PARTIAL_FRAME_SIZE     (3 * sizeof(uintptr_t))
+
+/* Reset the stacks (in case the previous call has been aborted) and make them
+ * big enough for the template, so that (unless some partials are involved)
+ * the processing itself does not need to grow them. */
+static int
+mustache_processor_reset(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                         const MUSTACHE_DATAPROVIDER* provider)
+{
+    processor->node_stack.n = 0;
+    processor->loop_stack.n = 0;
+    processor->partial_stack.n = 0;
+    processor->indent_buffer.n = 0;
+    processor->n_memo_hits = 0;
+    processor->n_pic_hits = 0;
+    processor->n_partial_hits = 0;
+
+    if(!(processor->flags & MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS))
+        mustache_processor_next_partial_gen(processor);
+
+    if(mustache_buffer_reserve(&processor->node_stack,
+                (1 + t->max_section_depth) * sizeof(uintptr_t)) != 0  ||
+       mustache_buffer_reserve(&processor->loop_stack,
+                t->max_section_depth * sizeof(MUSTACHE_LOOP)) != 0  ||
+       mustache_buffer_reserve(&processor->slot_stack,
+                t->n_slots * sizeof(void*)) != 0  ||
+       mustache_buffer_reserve(&processor->partial_stack,
+                t->max_partial_depth * MUSTACHE_PARTIAL_FRAME_SIZE) != 0  ||
+       mustache_buffer_reserve(&processor->indent_buffer,
+                t->max_partial_indent) != 0)
+        return -1;
+    processor->slot_stack.n = t->n_slots * sizeof(void*);
+
+    if(processor->memo != NULL) {
+        if(mustache_buffer_reserve(&processor->memo_gens,
+                    (1 + t->max_section_depth) * sizeof(unsigned)) != 0)
+            return -1;
+    }
+
+    if(provider->get_shape != NULL) {
+        if(processor->pic == NULL) {
+            processor->pic = (MUSTACHE_PIC_ENTRY*) processor->allocator->mem_alloc(
+                        MUSTACHE_PIC_SIZE * sizeof(MUSTACHE_PIC_ENTRY),
+                        processor->allocator_data);
+            if(processor->pic == NULL)
+                return -1;
+            memset(processor->pic, 0, MUSTACHE_PIC_SIZE * sizeof(MUSTACHE_PIC_ENTRY));
+            processor->pic_epoch = 0;
+        }
+
+        /* Start a new epoch so all the entries get stale. (Epoch zero marks
+         * an unused entry.) */
+        processor->pic_epoch++;
+        if(processor->pic_epoch == 0) {
+            memset(processor->pic, 0, MUSTACHE_PIC_SIZE * sizeof(MUSTACHE_PIC_ENTRY));
+            processor->pic_epoch = 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Make the stacks big enough for processing the partial (called with the
+ * given indentation) on top of their current contents, so that (unless the
+ * partial calls some other partials the template does not know) they do not
+ * have to grow during its processing. */
+static int
+mustache_processor_reserve_partial(MUSTACHE_PROCESSOR* processor,
+                                   const MUSTACHE_TEMPLATE* partial, size_t indent_len)
+{
+    size_t n_frames = processor->node_stack.n / sizeof(uintptr_t) + partial->max_section_depth;
+
+    if(mustache_buffer_reserve(&processor->node_stack,
+                n_frames * sizeof(uintptr_t)) != 0  ||
+       mustache_buffer_reserve(&processor->loop_stack,
+                processor->loop_stack.n + partial->max_section_depth * sizeof(MUSTACHE_LOOP)) != 0  ||
+       mustache_buffer_reserve(&processor->slot_stack,
+                processor->slot_stack.n + partial->n_slots * sizeof(void*)) != 0  ||
+       mustache_buffer_reserve(&processor->partial_stack,
+                processor->partial_stack.n +
+                (1 + partial->max_partial_depth) * MUSTACHE_PARTIAL_FRAME_SIZE) != 0  ||
+       mustache_buffer_reserve(&processor->indent_buffer,
+                processor->indent_buffer.n + indent_len + partial->max_partial_indent) != 0)
+        return -1;
+
+    if(processor->memo != NULL) {
+        if(mustache_buffer_reserve(&processor->memo_gens, n_frames * sizeof(unsigned)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Assign a new generation to the frame of node_stack at the given depth,
+ * so that all memo entries of any node previously at the depth get stale.
+ * (The caller has to reserve memo_gens big enough.) */
+static inline void
+mustache_memo_set_frame(MUSTACHE_PROCESSOR* processor, size_t depth)
+{
+    unsigned* gens = (unsigned*) processor->memo_gens.data;
+
+    processor->memo_gen++;
+    if(processor->memo_gen == 0) {
+        /* Wrapped around. Forget everything and renumber the live frames so
+         * that no generation may get reused. */
+        size_t i;
+
+        memset(processor->memo, 0, MUSTACHE_MEMO_SIZE * sizeof(MUSTACHE_MEMO_ENTRY));
+        for(i = 0; i < depth; i++)
+            gens[i] = ++processor->memo_gen;
+        processor->memo_gen++;
+    }
+
+    gens[depth] = processor->memo_gen;
+}
+
+MUSTACHE_PROCESSOR*
+mustache_processor_create_ex(const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                             unsigned flags)
+{
+    MUSTACHE_PROCESSOR* processor;
+
+    if(allocator == NULL)
+        allocator = &mustache_default_allocator;
+
+    processor = (MUSTACHE_PROCESSOR*) allocator->mem_alloc(sizeof(MUSTACHE_PROCESSOR),
+                    allocator_data);
+    if(processor == NULL)
+        return NULL;
+
+    mustache_processor_init(processor, allocator, allocator_data);
+    processor->flags = flags;
+
+    if(flags & MUSTACHE_PROCESSOR_FLAG_MEMO) {
+        processor->memo = (MUSTACHE_MEMO_ENTRY*) allocator->mem_alloc(
+                    MUSTACHE_MEMO_SIZE * sizeof(MUSTACHE_MEMO_ENTRY), allocator_data);
+        if(processor->memo == NULL) {
+            mustache_processor_release(processor);
+            return NULL;
+        }
+        memset(processor->memo, 0, MUSTACHE_MEMO_SIZE * sizeof(MUSTACHE_MEMO_ENTRY));
+    }
+
+    return processor;
+}
+
+MUSTACHE_PROCESSOR*
+mustache_processor_create(unsigned flags)
+{
+    return mustache_processor_create_ex(NULL, NULL, flags);
+}
+
+void
+mustache_processor_stats(const MUSTACHE_PROCESSOR* processor, MUSTACHE_PROCESSOR_STATS* stats)
+{
+    stats->n_memo_hits = processor->n_memo_hits;
+    stats->n_pic_hits = processor->n_pic_hits;
+    stats->n_partial_hits = processor->n_partial_hits;
+}
+
+void
+mustache_processor_invalidate_partials(MUSTACHE_PROCESSOR* processor)
+{
+    mustache_processor_next_partial_gen(processor);
+}
+
+void
+mustache_processor_release(MUSTACHE_PROCESSOR* processor)
+{
+    if(processor == NULL)
+        return;
+
+    mustache_processor_free(processor);
+    mustache_mem_free(processor->allocator, processor->allocator_data,
+                processor, sizeof(MUSTACHE_PROCESSOR));
+}
+
+/* Check whether the node is truthy, i.e. whether a section for it would be
+ * rendered at least once. */
+static inline int
+mustache_is_truthy(void* node,
+                   const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(provider->is_truthy != NULL)
+        return provider->is_truthy(node, provider_data);
+
+    if(provider->get_length != NULL)
+        return (provider->get_length(node, provider_data) > 0);
+
+    /* Even with the iterator callbacks, probing the first item by its index
+     * is cheaper than starting (and ending) a whole iteration. */
+    return (provider->get_child_by_index(node, 0, provider_data) != NULL);
+}
+
+/* Fetch next window of items, starting at loop->iter. */
+static void*
+mustache_loop_fetch(MUSTACHE_LOOP* loop,
+                    const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    unsigned max = MUSTACHE_LOOP_WINDOW;
+
+    if(loop->end - loop->iter < max)
+        max = (unsigned) (loop->end - loop->iter);
+
+    loop->win_pos = 0;
+    loop->win_n = provider->get_children(loop->list, (unsigned) loop->iter,
+                            loop->window, max, provider_data);
+    return (loop->win_n > 0) ? loop->window[0] : NULL;
+}
+
+/* Helpers for iterating over a list node. If the provider implements the
+ * iterator callbacks, they are used. Otherwise, the list is accessed by the
+ * index of the item (so the iterator is just the index), via get_children()
+ * if provided (fetching a window of items at once), or via
+ * get_child_by_index().
+ *
+ * mustache_loop_begin() returns the first item. If there is none, the loop
+ * is already finished. Otherwise, it is finished as soon as
+ * mustache_loop_next() returns NULL, or by calling mustache_loop_abort(). */
+static inline void*
+mustache_loop_begin(MUSTACHE_LOOP* loop, void* list,
+                    const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    void* item;
+
+    loop->list = list;
+    loop->iter = 0;
+    loop->end = SIZE_MAX;
+
+    if(provider->get_length != NULL) {
+        loop->end = provider->get_length(list, provider_data);
+        if(loop->end == 0)
+            return NULL;
+    } else if(provider->is_truthy != NULL) {
+        if(!provider->is_truthy(list, provider_data))
+            return NULL;
+    }
+
+    if(provider->iter_begin != NULL) {
+        void* iter = NULL;
+
+        item = provider->iter_begin(list, &iter, provider_data);
+        loop->iter = (uintptr_t) iter;
+        if(item == NULL  &&  provider->iter_end != NULL)
+            provider->iter_end(list, iter, provider_data);
+        return item;
+    }
+
+    if(provider->get_children != NULL)
+        return mustache_loop_fetch(loop, provider, provider_data);
+
+    return provider->get_child_by_index(list, 0, provider_data);
+}
+
+static inline void*
+mustache_loop_next(MUSTACHE_LOOP* loop,
+                   const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(provider->iter_begin != NULL) {
+        void* iter = (void*) loop->iter;
+        void* item = provider->iter_next(loop->list, &iter, provider_data);
+
+        loop->iter = (uintptr_t) iter;
+        if(item == NULL  &&  provider->iter_end != NULL)
+            provider->iter_end(loop->list, iter, provider_data);
+        return item;
+    }
+
+    loop->iter++;
+    if(loop->iter >= loop->end)
+        return NULL;
+
+    if(provider->get_children != NULL) {
+        loop->win_pos++;
+        if(loop->win_pos < loop->win_n)
+            return loop->window[loop->win_pos];
+        return mustache_loop_fetch(loop, provider, provider_data);
+    }
+
+    return provider->get_child_by_index(loop->list, (unsigned) loop->iter, provider_data);
+}
+
+static inline void
+mustache_loop_abort(MUSTACHE_LOOP* loop,
+                    const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(provider->iter_begin != NULL  &&  provider->iter_end != NULL)
+        provider->iter_end(loop->list, (void*) loop->iter, provider_data);
+}
+
+/* Get the partial for the PARTIAL instruction at the given address. */
+static inline MUSTACHE_TEMPLATE*
+mustache_get_partial(MUSTACHE_PROCESSOR* processor, const uint8_t* site,
+                     const char* name, size_t name_len,
+                     const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    MUSTACHE_PARTIAL_CACHE_ENTRY* entry;
+
+    entry = &processor->partial_cache[(((unsigned) (uintptr_t) site * 0x9e3779b1U) >> 16)
+                                      & (MUSTACHE_PARTIAL_CACHE_SIZE-1)];
+    if(entry->gen == processor->partial_gen  &&  entry->site == site) {
+        processor->n_partial_hits++;
+        return entry->partial;
+    }
+
+    entry->gen = processor->partial_gen;
+    entry->site = site;
+    entry->partial = provider->get_partial(name, name_len, provider_data);
+    return entry->partial;
+}
+
+/* Get the child of the node for the symbol at the given resolve site. */
+static inline void*
+mustache_get_child(MUSTACHE_PROCESSOR* processor, const uint8_t* site,
+                   void* node, const MUSTACHE_SYMBOL* sym,
+                   const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(provider->get_shape != NULL) {
+        const void* shape = provider->get_shape(node, provider_data);
+
+        if(shape != NULL) {
+            MUSTACHE_PIC_ENTRY* entry;
+            uintptr_t key = (uintptr_t) site ^ ((uintptr_t) shape >> 3);
+
+            entry = &processor->pic[(((unsigned) key * 0x9e3779b1U) >> 16) & (MUSTACHE_PIC_SIZE-1)];
+            if(entry->epoch == processor->pic_epoch  &&  entry->site == site  &&
+               entry->shape == shape) {
+                processor->n_pic_hits++;
+            } else {
+                entry->epoch = processor->pic_epoch;
+                entry->site = site;
+                entry->shape = shape;
+                entry->slot = provider->get_shape_slot(shape, sym, provider_data);
+            }
+
+            if(entry->slot < 0)
+                return NULL;
+            return provider->get_child_by_slot(node, entry->slot, provider_data);
+        }
+    }
+
+    if(provider->get_child_by_symbol != NULL)
+        return provider->get_child_by_symbol(node, sym, provider_data);
+    else
+        return provider->get_child_by_name(node, sym->name, sym->size, provider_data);
+}
+
+/* Same as mustache_get_child() for the frame of the given generation, but
+ * answered from the memo if possible. */
+static inline void*
+mustache_memo_get_child(MUSTACHE_PROCESSOR* processor, unsigned gen,
+                        const uint8_t* site, void* node, const MUSTACHE_SYMBOL* sym,
+                        const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    MUSTACHE_MEMO_ENTRY* entry;
+
+    entry = &processor->memo[((gen * 0x9e3779b1U) ^ sym->hash) & (MUSTACHE_MEMO_SIZE-1)];
+    if(entry->gen == gen  &&  entry->sym == sym) {
+        processor->n_memo_hits++;
+        return entry->child;
+    }
+
+    entry->gen = gen;
+    entry->sym = sym;
+    entry->child = mustache_get_child(processor, site, node, sym, provider, provider_data);
+    return entry->child;
+}
+
+/* Resolve the list of names (an argument of the RESOLVE instruction and its
+ * variants) at *p_pc and advance behind it. */
+static inline void*
+mustache_resolve(const MUSTACHE_TEMPLATE* t, const uint8_t* insns, off_t* p_pc, int compact,
+                 MUSTACHE_PROCESSOR* processor, size_t slot_base,
+                 const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    const MUSTACHE_SYMBOL* symbols = t->symbols;
+    MUSTACHE_STACK* node_stack = &processor->node_stack;
+    void** slots = (void**) processor->slot_stack.data;
+    off_t pc = *p_pc;
+    unsigned header;
+    unsigned n_names;
+    unsigned slot = 0;
+    unsigned path = 0;
+    unsigned i;
+    void* node = NULL;
+
+    header = (unsigned) (compact ? mustache_decode_num(insns, pc, &pc)
+                                 : mustache_decode_word(insns, pc, &pc));
+    n_names = (header >> 2);
+
+    if((header & 0x3) == MUSTACHE_NAMES_LOAD) {
+        *p_pc = pc;
+        return slots[slot_base + n_names];
+    }
+
+    if((header & 0x3) == MUSTACHE_NAMES_STORE) {
+        slot = (unsigned) (compact ? mustache_decode_num(insns, pc, &pc)
+                                   : mustache_decode_word(insns, pc, &pc));
+    }
+
+    if(n_names == 0) {
+        /* Implicit iterator. */
+        *p_pc = pc;
+        return (void*) mustache_stack_peek(node_stack);
+    }
+
+    if(n_names > 1) {
+        path = (unsigned) (compact ? mustache_decode_num(insns, pc, &pc)
+                                   : mustache_decode_word(insns, pc, &pc));
+    }
+
+    for(i = 0; i < n_names; i++) {
+        const uint8_t* site = insns + pc;
+        unsigned id = (unsigned) (compact ? mustache_decode_num(insns, pc, &pc)
+                                          : mustache_decode_word(insns, pc, &pc));
+        const MUSTACHE_SYMBOL* sym = &symbols[id];
+
+        if(i == 0) {
+            void** nodes = (void**) node_stack->data;
+            size_t n_nodes = node_stack->n / sizeof(void*);
+
+            if(processor->memo != NULL) {
+                const unsigned* gens = (const unsigned*) processor->memo_gens.data;
+
+                while(n_nodes-- > 0) {
+                    node = mustache_memo_get_child(processor, gens[n_nodes], site,
+                                nodes[n_nodes], sym, provider, provider_data);
+                    if(node != NULL)
+                        break;
                 }
-            } else if(current_tag.type == MUSTACHE_TAGTYPE_DELIM) {
-                /* Maybe we are not really the closer. Maybe the directive
-                 * does not change the closer so we are the "new closer" in
-                 * something like "{{=<something> }}=}}". */
-                if(templ_data[current_tag.name_end - 1] != '='  &&
-                   off + closer_len < templ_size  &&
-                   templ_data[off] == '='  &&
-                   memcmp(templ_data + off + 1, closer, closer_len) == 0)
-                {
-                    current_tag.name_end += closer_len + 1;
-                    off += closer_len + 1;
-                    col += closer_len + 1;
+            } else {
+                while(n_nodes-- > 0) {
+                    node = mustache_get_child(processor, site, nodes[n_nodes], sym,
+                                provider, provider_data);
+                    if(node != NULL)
+                        break;
                 }
+            }
+        } else if(node != NULL  &&  provider->get_child_by_path != NULL) {
+            /* Resolve the whole rest of the path at once when at its 2nd
+             * name. The remaining symbol IDs are then just skipped. */
+            if(i == 1) {
+                node = provider->get_child_by_path(node, &t->paths[path + 1],
+                            n_names - 1, provider_data);
+            }
+        } else if(node != NULL) {
+            node = mustache_get_child(processor, site, node, sym, provider, provider_data);
+        }
+    }
 
-                if(templ_data[current_tag.name_end - 1] != '=') {
-                    parser->parse_error(MUSTACHE_ERR_INCOMPATIBLETAGCLOSER,
-                            mustache_err_messages[MUSTACHE_ERR_INCOMPATIBLETAGCLOSER],
-                            (unsigned) line, (unsigned) col, parser_data);
-                    n_errors++;
-                } else if(current_tag.name_end > current_tag.name_beg) {
-                    current_tag.name_end--;     /* Consume the closer's '=' */
-                }
+    if((header & 0x3) == MUSTACHE_NAMES_STORE)
+        slots[slot_base + slot] = node;
+
+    *p_pc = pc;
+    return node;
+}
+
+/* Output the node, either via the renderer's out_fn (out_verbatim or
+ * out_escaped), or via dump() if the data provider cannot give us its string
+ * or scalar value. */
+static int
+mustache_output_node(void* node, int (*out_fn)(const char*, size_t, void*),
+                     const MUSTACHE_RENDERER* renderer, void* renderer_data,
+                     const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(provider->get_string != NULL) {
+        const char* str;
+        size_t size;
+        unsigned str_flags = 0;
+
+        if(provider->get_string(node, &str, &size, &str_flags, provider_data) == 0) {
+            if(str_flags & MUSTACHE_STRING_SAFE)
+                out_fn = renderer->out_verbatim;
+            return (size > 0) ? out_fn(str, size, renderer_data) : 0;
+        }
+    }
+
+    if(provider->get_scalar != NULL) {
+        MUSTACHE_SCALAR scalar;
+        char buf[MUSTACHE_SCALAR_BUFSIZE];
+        size_t n;
+
+        /* A scalar of an unknown type is left to dump(). */
+        if(provider->get_scalar(node, &scalar, provider_data) == 0) {
+            n = mustache_format_scalar(&scalar, buf);
+            if(n > 0)
+                return out_fn(buf, n, renderer_data);
+        }
+    }
+
+    return provider->dump(node, out_fn, renderer_data, provider_data);
+}
+
+/* End the iterations still in progress. */
+static void
+mustache_vm_abort_loops(MUSTACHE_PROCESSOR* processor)
+{
+    MUSTACHE_BUFFER* loop_stack = &processor->loop_stack;
+
+    while(loop_stack->n > 0) {
+        loop_stack->n -= sizeof(MUSTACHE_LOOP);
+        mustache_loop_abort((MUSTACHE_LOOP*) (loop_stack->data + loop_stack->n),
+                    processor->vm.provider, processor->vm.provider_data);
+    }
+}
+
+/* Abandon the processing suspended by mustache_vm_run(), if any. */
+static void
+mustache_vm_abort(MUSTACHE_PROCESSOR* processor)
+{
+    if(processor->vm.state == MUSTACHE_VM_RUNNING) {
+        mustache_vm_abort_loops(processor);
+        processor->vm.state = MUSTACHE_VM_IDLE;
+    }
+}
+
+/* Prepare the processor for running the template with mustache_vm_run(). */
+static int
+mustache_vm_start(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                  const MUSTACHE_RENDERER* renderer, void* renderer_data,
+                  const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    MUSTACHE_VM* vm = &processor->vm;
+
+    mustache_vm_abort(processor);
+    processor->step_full = 0;
+
+    if(mustache_processor_reset(processor, t, provider) != 0)
+        return -1;
+
+    vm->t = t;
+    vm->renderer = renderer;
+    vm->renderer_data = renderer_data;
+    vm->provider = provider;
+    vm->provider_data = provider_data;
+    vm->reg_pc = 0;
+    vm->reg_jmpaddr = 0;
+    vm->reg_slot_base = 0;
+
+    /* The root node is the bottom of the lookup context. */
+    vm->reg_node = provider->get_root(provider_data);
+    if(processor->memo != NULL)
+        mustache_memo_set_frame(processor, 0);
+    if(mustache_stack_push(&processor->node_stack, (uintptr_t) vm->reg_node) != 0)
+        return -1;
+
+    vm->state = MUSTACHE_VM_RUNNING;
+    return 0;
+}
+
+/* Run the virtual machine until the template is processed (then it returns
+ * zero), until it fails (-1), or until it is suspended because the output of
+ * mustache_process_step() is full (MUSTACHE_WOULDBLOCK). The suspension is
+ * checked only after the instructions which output something, so that all
+ * the state is in the registers and the stacks of the processor. */
+static int
+mustache_vm_run(MUSTACHE_PROCESSOR* processor)
+{
+    MUSTACHE_VM* vm = &processor->vm;
+    const MUSTACHE_TEMPLATE* t = vm->t;
+    const MUSTACHE_RENDERER* renderer = vm->renderer;
+    void* renderer_data = vm->renderer_data;
+    const MUSTACHE_DATAPROVIDER* provider = vm->provider;
+    void* provider_data = vm->provider_data;
+    const uint8_t* insns;
+    int compact;
+    off_t reg_pc = vm->reg_pc;              /* Program counter register. */
+    off_t reg_jmpaddr = vm->reg_jmpaddr;    /* Jump target address register. */
+    void* reg_node = vm->reg_node;          /* Working node register. */
+    size_t reg_slot_base = vm->reg_slot_base;   /* Index of the 1st slot of the template. */
+    MUSTACHE_STACK* node_stack = &processor->node_stack;
+    MUSTACHE_BUFFER* loop_stack = &processor->loop_stack;
+    MUSTACHE_STACK* partial_stack = &processor->partial_stack;
+    MUSTACHE_BUFFER* indent_buffer = &processor->indent_buffer;
+    MUSTACHE_STACK* slot_stack = &processor->slot_stack;
+    int (*out_literal)(const char*, size_t, void*) = (renderer->out_literal != NULL)
+                ? renderer->out_literal : renderer->out_verbatim;
+    int ret = -1;
+
+    /* (Pushing a node never fails when called after reserving the room for
+     * it, both in node_stack and memo_gens.) */
+#define PUSH_NODE()                                                         \
+        do {                                                                \
+            if(processor->memo != NULL)                                     \
+                mustache_memo_set_frame(processor, node_stack->n / sizeof(void*)); \
+            if(mustache_stack_push(node_stack, (uintptr_t) reg_node) != 0)  \
+                goto err;                                                   \
+        } while(0)
+
+#define POP_NODE()          ((void*) mustache_stack_pop(node_stack))
+
+#define PEEK_NODE()         ((void*) mustache_stack_peek(node_stack))
+
+#define TOP_LOOP()          (((MUSTACHE_LOOP*) (loop_stack->data + loop_stack->n)) - 1)
+
+    /* Used after each instruction which outputs something. */
+#define CHECK_SUSPEND()                                                     \
+        do {                                                                \
+            if(processor->step_full)                                        \
+                goto suspend;                                               \
+        } while(0)
+
+    /* Run the copy of the code with INDENT only when there is some
+     * indentation to insert. */
+#define SELECT_INSNS()                                                      \
+        do {                                                                \
+            insns = (indent_buffer->n > 0  &&  t->insns_indent != NULL)     \
+                        ? t->insns_indent : t->insns;                       \
+            compact = ((t->flags & MUSTACHE_FLAG_COMPACT) != 0);            \
+        } while(0)
+
+    /* Decoding of the instruction stream (see the comment about the two
+     * formats of the compiled template). In the compact format, all opcodes
+     * are below 0x80, i.e. a single byte in the NUM encoding. */
+#define FETCH_OPCODE()                                                      \
+        (compact ? insns[reg_pc++] : mustache_decode_word(insns, reg_pc, &reg_pc))
+
+#define FETCH_NUM()                                                         \
+        (compact ? mustache_decode_num(insns, reg_pc, &reg_pc)              \
+                 : mustache_decode_word(insns, reg_pc, &reg_pc))
+
+#define FETCH_STR(len)                                                      \
+        mustache_decode_str(insns, reg_pc, &reg_pc, (len), compact)
+
+    /* Fetch a forward jump target (i.e. of RESOLVE_setjmp and its variants). */
+#define FETCH_JMP()                                                         \
+        (compact ? (off_t) mustache_decode_num(insns, reg_pc, &reg_pc) + reg_pc \
+                 : (off_t) mustache_decode_word(insns, reg_pc, &reg_pc))
+
+#define RESOLVE()                                                           \
+        mustache_resolve(t, insns, &reg_pc, compact, processor, reg_slot_base,     \
+                    provider, provider_data)
+
+#ifdef MUSTACHE_COMPUTED_GOTO
+    static const void* const dispatch_table[] = {
+        &&vm_op_EXIT,
+        &&vm_op_LITERAL,
+        &&vm_op_RESOLVE_setjmp,
+        &&vm_op_RESOLVE,
+        &&vm_op_OUTVERBATIM,
+        &&vm_op_OUTESCAPED,
+        &&vm_op_ENTER,
+        &&vm_op_LEAVE,
+        &&vm_op_ENTERINV,
+        &&vm_op_PARTIAL,
+        &&vm_op_INDENT,
+        &&vm_op_RESOLVE_OUTVERBATIM,
+        &&vm_op_RESOLVE_OUTESCAPED,
+        &&vm_op_RESOLVE_ENTER,
+        &&vm_op_RESOLVE_ENTERINV,
+        &&vm_op_INDENT_LITERAL
+    };
+
+    #define VM_LOOP_BEGIN()     VM_NEXT();
+    #define VM_LOOP_END()
+    #define VM_CASE(op)         vm_op_##op
+    #define VM_NEXT()           goto *dispatch_table[FETCH_OPCODE()]
+#else
+    #define VM_LOOP_BEGIN()     while(1) { switch(FETCH_OPCODE()) {
+    #define VM_LOOP_END()       } }
+    #define VM_CASE(op)         case MUSTACHE_OP_##op
+    #define VM_NEXT()           continue
+#endif
+
+    SELECT_INSNS();
+
+    VM_LOOP_BEGIN()
+
+        VM_CASE(INDENT_LITERAL):
+            if(indent_buffer->n > 0) {
+                if(renderer->out_verbatim((const char*)(indent_buffer->data),
+                                    indent_buffer->n, renderer_data) != 0)
+                    goto err;
             }
+            /* Pass through */
 
-            current_tag.end = off;
+        VM_CASE(LITERAL):
+        {
+            size_t n = (size_t) FETCH_NUM();
+            const char* str = FETCH_STR(n);
+            if(out_literal(str, n, renderer_data) != 0)
+                goto err;
+            CHECK_SUSPEND();
+            VM_NEXT();
+        }
 
-            /* If the tag is standalone, expand it to consume also any
-             * preceding whitespace and also one new-line (before or after). */
-            if(current_tag.type != MUSTACHE_TAGTYPE_VAR &&
-               current_tag.type != MUSTACHE_TAGTYPE_VERBATIMVAR &&
-               current_tag.type != MUSTACHE_TAGTYPE_VERBATIMVAR2 &&
-               (current_tag.end >= templ_size || MUSTACHE_ISNEWLINE(templ_data[current_tag.end])))
-            {
-                off_t tmp_off = current_tag.beg;
-                while(tmp_off > 0 && MUSTACHE_ISWHITESPACE(templ_data[tmp_off-1]))
-                    tmp_off--;
-                if(tmp_off == 0 || MUSTACHE_ISNEWLINE(templ_data[tmp_off-1])) {
-                    current_tag.beg = tmp_off;
+        VM_CASE(RESOLVE_setjmp):
+            reg_jmpaddr = FETCH_JMP();
+            reg_node = RESOLVE();
+            VM_NEXT();
+
+        VM_CASE(RESOLVE):
+            reg_node = RESOLVE();
+            VM_NEXT();
+
+        VM_CASE(RESOLVE_OUTVERBATIM):
+            reg_node = RESOLVE();
+            /* Pass through */
+
+        VM_CASE(OUTVERBATIM):
+            if(reg_node != NULL) {
+                if(mustache_output_node(reg_node, renderer->out_verbatim,
+                            renderer, renderer_data, provider, provider_data) != 0)
+                    goto err;
+                CHECK_SUSPEND();
+            }
+            VM_NEXT();
+
+        VM_CASE(RESOLVE_OUTESCAPED):
+            reg_node = RESOLVE();
+            /* Pass through */
+
+        VM_CASE(OUTESCAPED):
+            if(reg_node != NULL) {
+                if(mustache_output_node(reg_node, renderer->out_escaped,
+                            renderer, renderer_data, provider, provider_data) != 0)
+                    goto err;
+                CHECK_SUSPEND();
+            }
+            VM_NEXT();
+
+        VM_CASE(RESOLVE_ENTER):
+            reg_jmpaddr = FETCH_JMP();
+            reg_node = RESOLVE();
+            /* Pass through */
+
+        VM_CASE(ENTER):
+            if(reg_node != NULL) {
+                void* list = reg_node;
+
+                /* Make room for the loop first, so nothing can fail once the
+                 * iteration is started. */
+                if(mustache_buffer_reserve(loop_stack, loop_stack->n + sizeof(MUSTACHE_LOOP)) != 0  ||
+                   mustache_buffer_reserve(node_stack, node_stack->n + sizeof(void*)) != 0)
+                    goto err;
+                if(processor->memo != NULL  &&
+                   mustache_buffer_reserve(&processor->memo_gens,
+                            (node_stack->n / sizeof(void*) + 1) * sizeof(unsigned)) != 0)
+                    goto err;
+
+                loop_stack->n += sizeof(MUSTACHE_LOOP);
+                reg_node = mustache_loop_begin(TOP_LOOP(), list, provider, provider_data);
+                if(reg_node != NULL)
+                    PUSH_NODE();
+                else
+                    loop_stack->n -= sizeof(MUSTACHE_LOOP);
+            }
+            if(reg_node == NULL)
+                reg_pc = reg_jmpaddr;
+            VM_NEXT();
+
+        VM_CASE(LEAVE):
+        {
+            off_t jmp_base = reg_pc;
+            off_t jmp = (off_t) FETCH_NUM();
+
+            reg_node = mustache_loop_next(TOP_LOOP(), provider, provider_data);
+            if(reg_node != NULL) {
+                if(processor->memo != NULL)
+                    mustache_memo_set_frame(processor, node_stack->n / sizeof(void*) - 1);
+                mustache_stack_set_top(node_stack, (uintptr_t) reg_node);
+                reg_pc = (compact ? jmp_base - jmp : jmp);
+            } else {
+                (void) POP_NODE();
+                loop_stack->n -= sizeof(MUSTACHE_LOOP);
+            }
+            VM_NEXT();
+        }
+
+        VM_CASE(RESOLVE_ENTERINV):
+            reg_jmpaddr = FETCH_JMP();
+            reg_node = RESOLVE();
+            /* Pass through */
+
+        VM_CASE(ENTERINV):
+            if(reg_node != NULL  &&  mustache_is_truthy(reg_node, provider, provider_data))
+                reg_pc = reg_jmpaddr;
+            /* Otherwise (resolve failed or empty list), continue normally. */
+            VM_NEXT();
+
+        VM_CASE(PARTIAL):
+        {
+            const uint8_t* site = insns + reg_pc;
+            size_t name_len;
+            const char* name;
+            size_t indent_len;
+            const char* indent;
+            MUSTACHE_TEMPLATE* partial;
 
-                    if(current_tag.end < templ_size && templ_data[current_tag.end] == '\r')
-                        current_tag.end++;
-                    if(current_tag.end < templ_size && templ_data[current_tag.end] == '\n')
-                        current_tag.end++;
+            name_len = (size_t) FETCH_NUM();
+            name = FETCH_STR(name_len);
+            indent_len = (size_t) FETCH_NUM();
+            indent = FETCH_STR(indent_len);
+
+            partial = mustache_get_partial(processor, site, name, name_len,
+                        provider, provider_data);
+            if(partial != NULL) {
+                if(mustache_processor_reserve_partial(processor, partial, indent_len) != 0)
+                    goto err;
+                if(mustache_stack_push(partial_stack, (uintptr_t) t) != 0)
+                    goto err;
+                if(mustache_stack_push(partial_stack, (uintptr_t) reg_pc) != 0)
+                    goto err;
+                if(mustache_stack_push(partial_stack, (uintptr_t) indent_len) != 0)
+                    goto err;
+                if(mustache_buffer_append(indent_buffer, indent, indent_len) != 0)
+                    goto err;
+                if(indent_buffer->n > 0  &&  partial->n_indents > 0  &&
+                   partial->insns_indent == NULL) {
+                    if(mustache_build_indent_copy(partial) != 0)
+                        goto err;
                 }
+                reg_slot_base = slot_stack->n / sizeof(void*);
+                slot_stack->n += partial->n_slots * sizeof(void*);
+                t = partial;
+                SELECT_INSNS();
+                reg_pc = 0;
             }
+            VM_NEXT();
+        }
 
-            while(current_tag.name_end > current_tag.name_beg  &&
-                        MUSTACHE_ISWHITESPACE(templ_data[current_tag.name_end-1]))
-                current_tag.name_end--;
+        VM_CASE(INDENT):
+            if(indent_buffer->n > 0) {
+                if(renderer->out_verbatim((const char*)(indent_buffer->data),
+                                    indent_buffer->n, renderer_data) != 0)
+                    goto err;
+                CHECK_SUSPEND();
+            }
+            VM_NEXT();
 
-            if(current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
-                if(current_tag.name_end <= current_tag.name_beg) {
-                    parser->parse_error(MUSTACHE_ERR_NOTAGNAME,
-                            mustache_err_messages[MUSTACHE_ERR_NOTAGNAME],
-                            (unsigned)current_tag.line, (unsigned)current_tag.col,
-                            parser_data);
-                    n_errors++;
-                }
+        VM_CASE(EXIT):
+            if(mustache_stack_is_empty(partial_stack)) {
+                /* Success. */
+                ret = 0;
+                goto err;
+            } else {
+                size_t indent_len = (size_t) mustache_stack_pop(partial_stack);
+                reg_pc = (off_t) mustache_stack_pop(partial_stack);
+                slot_stack->n -= t->n_slots * sizeof(void*);
+                t = (const MUSTACHE_TEMPLATE*) mustache_stack_pop(partial_stack);
+                reg_slot_base = slot_stack->n / sizeof(void*) - t->n_slots;
+                indent_buffer->n -= indent_len;
+                SELECT_INSNS();
             }
+            VM_NEXT();
 
-            if(current_tag.type == MUSTACHE_TAGTYPE_DELIM) {
-                if(mustache_parse_delimiters(templ_data + current_tag.name_beg,
-                        current_tag.name_end - current_tag.name_beg,
-                        opener, &opener_len, closer, &closer_len) != 0)
-                {
-                    parser->parse_error(MUSTACHE_ERR_INVALIDDELIMITERS,
-                            mustache_err_messages[MUSTACHE_ERR_INVALIDDELIMITERS],
-                            (unsigned)current_tag.line, (unsigned)current_tag.col,
-                            parser_data);
-                    n_errors++;
-                }
+    VM_LOOP_END()
 
-                /* From now on, ignore this tag. */
-                current_tag.type = MUSTACHE_TAGTYPE_COMMENT;
-            }
+suspend:
+    vm->t = t;
+    vm->reg_pc = reg_pc;
+    vm->reg_jmpaddr = reg_jmpaddr;
+    vm->reg_node = reg_node;
+    vm->reg_slot_base = reg_slot_base;
+    return MUSTACHE_WOULDBLOCK;
 
-            if(current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
-                if(mustache_validate_tagname(templ_data + current_tag.name_beg,
-                            current_tag.name_end - current_tag.name_beg) != 0) {
-                    parser->parse_error(MUSTACHE_ERR_INVALIDTAGNAME,
-                            mustache_err_messages[MUSTACHE_ERR_INVALIDTAGNAME],
-                            (unsigned)current_tag.line, (unsigned)current_tag.col,
-                            parser_data);
-                    n_errors++;
-                }
-            }
+err:
+    if(ret != 0)
+        mustache_vm_abort_loops(processor);
+    vm->state = MUSTACHE_VM_IDLE;
+    return ret;
+}
 
-            /* Remember the tag info. */
-            if(mustache_buffer_append(&tags, &current_tag, sizeof(MUSTACHE_TAGINFO)) != 0)
-                goto err;
+int
+mustache_process_ex(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                    const MUSTACHE_RENDERER* renderer, void* renderer_data,
+                    const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(mustache_vm_start(processor, t, renderer, renderer_data, provider, provider_data) != 0)
+        return -1;
 
-            current_tag.type = MUSTACHE_TAGTYPE_NONE;
-        } else if(MUSTACHE_ISNEWLINE(templ_data[off])) {
-            /* Handle end of line. */
+    /* With the renderer of the application, the VM is never suspended. */
+    return mustache_vm_run(processor);
+}
 
-            if(current_tag.type != MUSTACHE_TAGTYPE_NONE  &&  current_tag.type != MUSTACHE_TAGTYPE_COMMENT) {
-                parser->parse_error(MUSTACHE_ERR_DANGLINGTAGOPENER,
-                        mustache_err_messages[MUSTACHE_ERR_DANGLINGTAGOPENER],
-                        (unsigned)current_tag.line, (unsigned)current_tag.col,
-                        parser_data);
-                n_errors++;
-                current_tag.type = MUSTACHE_TAGTYPE_NONE;
-            }
+int
+mustache_process(const MUSTACHE_TEMPLATE* t,
+                 const MUSTACHE_RENDERER* renderer, void* renderer_data,
+                 const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    MUSTACHE_PROCESSOR processor;
+    int ret;
+
+    /* Use the template's allocator also for the processing. */
+    mustache_processor_init(&processor, t->allocator, t->allocator_data);
+    ret = mustache_process_ex(&processor, t, renderer, renderer_data,
+                    provider, provider_data);
+    mustache_processor_free(&processor);
+    return ret;
+}
 
-            /* New line may be formed by digraph "\r\n". */
-            if(templ_data[off] == '\r')
-                off++;
-            if(off < templ_size  &&  templ_data[off] == '\n')
-                off++;
 
-            if(current_tag.type == MUSTACHE_TAGTYPE_NONE  &&  off < templ_size) {
-                current_tag.type = MUSTACHE_TAGTYPE_INDENT;
-                current_tag.beg = off;
-                current_tag.end = off;
-                if(mustache_buffer_append(&tags, &current_tag, sizeof(MUSTACHE_TAGINFO)) != 0)
-                    goto err;
-                current_tag.type = MUSTACHE_TAGTYPE_NONE;
-            }
 
-            line++;
-            col = 1;
-        } else {
-            /* Handle any other character. */
-            off++;
-            col++;
+/****************************
+ *** Resumable Processing ***
+ ****************************/
+
+#define MUSTACHE_STEP_PENDING(processor)                                    \
+        ((processor)->step_literal != NULL  ||  (processor)->step_spill.n > 0)
+
+/* Copy as much as fits into the buffer of the current step. Returns the
+ * count of bytes copied. */
+static size_t
+mustache_step_copy(MUSTACHE_PROCESSOR* processor, const char* data, size_t size)
+{
+    size_t n = processor->step_size - processor->step_n;
+
+    if(n > size)
+        n = size;
+    memcpy(processor->step_buf + processor->step_n, data, n);
+    processor->step_n += n;
+    if(processor->step_n >= processor->step_size)
+        processor->step_full = 1;
+    return n;
+}
+
+static int
+mustache_step_verbatim(const char* data, size_t size, void* renderer_data)
+{
+    MUSTACHE_PROCESSOR* processor = (MUSTACHE_PROCESSOR*) renderer_data;
+    size_t n = 0;
+
+    /* Whatever does not fit (or would get ahead of the pending output) has
+     * to be copied aside. */
+    if(!MUSTACHE_STEP_PENDING(processor))
+        n = mustache_step_copy(processor, data, size);
+    if(n < size) {
+        if(mustache_buffer_append(&processor->step_spill, data + n, size - n) != 0)
+            return -1;
+        processor->step_full = 1;
+    }
+    return 0;
+}
+
+static int
+mustache_step_escaped(const char* data, size_t size, void* renderer_data)
+{
+    MUSTACHE_PROCESSOR* processor = (MUSTACHE_PROCESSOR*) renderer_data;
+
+    return mustache_escape(processor->step_escape, data, size,
+                mustache_step_verbatim, renderer_data);
+}
+
+static int
+mustache_step_literal(const char* data, size_t size, void* renderer_data)
+{
+    MUSTACHE_PROCESSOR* processor = (MUSTACHE_PROCESSOR*) renderer_data;
+    size_t n;
+
+    if(MUSTACHE_STEP_PENDING(processor))
+        return mustache_step_verbatim(data, size, renderer_data);
+
+    /* The literal stays valid in the template so just remember the rest
+     * which does not fit. (This is the last output of the instruction, so
+     * nothing else can get pending before the VM is suspended.) */
+    n = mustache_step_copy(processor, data, size);
+    if(n < size) {
+        processor->step_literal = data + n;
+        processor->step_literal_size = size - n;
+    }
+    return 0;
+}
+
+static const MUSTACHE_RENDERER mustache_step_renderer = {
+    mustache_step_verbatim,
+    mustache_step_escaped,
+    mustache_step_literal
+};
+
+/* Move as much of the pending output as possible into the buffer. */
+static void
+mustache_step_drain(MUSTACHE_PROCESSOR* processor)
+{
+    MUSTACHE_BUFFER* spill = &processor->step_spill;
+    size_t n;
+
+    if(processor->step_literal != NULL) {
+        n = mustache_step_copy(processor, processor->step_literal,
+                    processor->step_literal_size);
+        processor->step_literal += n;
+        processor->step_literal_size -= n;
+        if(processor->step_literal_size > 0)
+            return;
+        processor->step_literal = NULL;
+    }
+
+    if(spill->n > 0) {
+        n = mustache_step_copy(processor, (const char*) spill->data + processor->step_spill_off,
+                    spill->n - processor->step_spill_off);
+        processor->step_spill_off += n;
+        if(processor->step_spill_off >= spill->n) {
+            spill->n = 0;
+            processor->step_spill_off = 0;
         }
     }
+}
 
-    if(mustache_validate_sections(templ_data, &tags, parser, parser_data) != 0)
-        goto err;
+static void
+mustache_step_discard(MUSTACHE_PROCESSOR* processor)
+{
+    processor->step_literal = NULL;
+    processor->step_spill.n = 0;
+    processor->step_spill_off = 0;
+}
 
-    /* Add an extra dummy tag marking end of the template. */
-    current_tag.type = MUSTACHE_TAGTYPE_NONE;
-    current_tag.beg = templ_size;
-    current_tag.end = templ_size;
-    if(mustache_buffer_append(&tags, &current_tag, sizeof(MUSTACHE_TAGINFO)) != 0)
-        goto err;
+int
+mustache_process_begin(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                       unsigned escape,
+                       const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+{
+    if(escape > MUSTACHE_ESCAPE_URL)
+        return -1;
+
+    mustache_step_discard(processor);
+    processor->step_escape = escape;
+    return mustache_vm_start(processor, t, &mustache_step_renderer, (void*) processor,
+                provider, provider_data);
+}
 
-    /* Success? */
-    if(n_errors == 0) {
-        *p_tags = (MUSTACHE_TAGINFO*) tags.data;
-        *p_n_tags = tags.n / sizeof(MUSTACHE_TAGINFO);
+int
+mustache_process_step(MUSTACHE_PROCESSOR* processor, char* buf, size_t size,
+                      size_t* p_size)
+{
+    int ret;
+
+    *p_size = 0;
+    if(size == 0) {
+        mustache_process_abort(processor);
+        return -1;
+    }
+
+    processor->step_buf = buf;
+    processor->step_size = size;
+    processor->step_n = 0;
+    processor->step_full = 0;
+
+    /* First, the output which has not fit into the previous buffer. */
+    mustache_step_drain(processor);
+    if(processor->step_full) {
+        *p_size = processor->step_n;
+        return MUSTACHE_WOULDBLOCK;
+    }
+
+    if(processor->vm.state != MUSTACHE_VM_RUNNING) {
+        /* Nothing more to do. */
+        *p_size = processor->step_n;
         return 0;
     }
 
-    /* Error path. */
-err:
-    mustache_buffer_free(&tags);
-    *p_tags = NULL;
-    *p_n_tags = 0;
-    return -1;
+    ret = mustache_vm_run(processor);
+    *p_size = processor->step_n;
+    if(ret == -1) {
+        mustache_step_discard(processor);
+        return -1;
+    }
+
+    /* Even if the VM has finished, the caller has to take the rest. */
+    if(ret == 0  &&  MUSTACHE_STEP_PENDING(processor))
+        ret = MUSTACHE_WOULDBLOCK;
+    return ret;
 }
 
+void
+mustache_process_abort(MUSTACHE_PROCESSOR* processor)
+{
+    mustache_vm_abort(processor);
+    mustache_step_discard(processor);
+}
 
-/* The compiled template is a sequence of following instruction types.
- * The instructions have two types of arguments:
- *  -- NUM: a number encoded with mustache_buffer_[append|insert]_num().
- *  -- STR: a string (always preceded with a NUM denoting its length).
- */
+/**************************
+ *** Formatting Scalars ***
+ **************************/
+
+static const char mustache_digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+/* Format the unsigned integer backwards, two digits at a time, so that it
+ * ends just before the end. Returns pointer to its first digit. */
+static char*
+mustache_format_u64(uint64_t u, char* end)
+{
+    char* p = end;
+
+    while(u >= 100) {
+        unsigned i = (unsigned) (u % 100) * 2;
+        u /= 100;
+        p -= 2;
+        p[0] = mustache_digit_pairs[i];
+        p[1] = mustache_digit_pairs[i + 1];
+    }
 
-/* Instruction denoting end of template.
- */
-#define MUSTACHE_OP_EXIT            0
+    if(u >= 10) {
+        p -= 2;
+        p[0] = mustache_digit_pairs[u * 2];
+        p[1] = mustache_digit_pairs[u * 2 + 1];
+    } else {
+        *(--p) = (char) ('0' + u);
+    }
 
-/* Instruction for outputting a literal text.
- *
- *   Arg #1: Length of the literal string (NUM).
- *   Arg #2: The literal string (STR).
- */
-#define MUSTACHE_OP_LITERAL         1
+    return p;
+}
 
-/* Instruction to resolve a tag name.
- *
- *   Arg #1: (Relative) setjmp value (NUM).
- *   Arg #2: Count of names (NUM).
- *   Arg #3: Length of the 1st tag name (NUM).
- *   Arg #4: The tag name (STR).
- *   etc. (more names follow, up to the count in arg #2)
- *
- *   Registers: reg_node is set to the resolved node, or NULL.
- *              reg_jmpaddr is set to address where some next instruction may
- *              want to jump on some condition.
- */
-#define MUSTACHE_OP_RESOLVE_setjmp  2
+static size_t
+mustache_format_int(uint64_t u, int negative, char* buf)
+{
+    char tmp[24];
+    char* end = tmp + sizeof(tmp);
+    char* p;
+
+    p = mustache_format_u64(u, end);
+    if(negative)
+        *(--p) = '-';
+    memcpy(buf, p, end - p);
+    return end - p;
+}
 
-/* Instruction to resolve a tag name.
- *
- *   Arg #1: Count of names (NUM).
- *   Arg #2: Length of the tag name (NUM).
- *   Arg #3: The tag name (STR).
- *   etc. (more names follow, up to the count in arg #1)
- *
- *   Registers: reg_node is set to the resolved node, or NULL.
- */
-#define MUSTACHE_OP_RESOLVE         3
+/* Powers of ten, all exact as doubles. */
+static const double mustache_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
 
-/* Instructions to output a node.
- *
- * Registers: If it is not NULL, reg_node determines the node to output.
- *            Otherwise, it is noop.
- */
-#define MUSTACHE_OP_OUTVERBATIM     4
-#define MUSTACHE_OP_OUTESCAPED      5
+static size_t
+mustache_format_double(double d, char* buf)
+{
+    double a = (d < 0) ? -d : d;
+    int prec;
+    int n;
+    int k;
+
+    /* Fast path. Most of the real-world numbers (prices, percentages etc.)
+     * have only a few decimal digits: If the value equals m / 10^k for some
+     * integer m < 10^15, that decimal number is what "%.15g" yields, provided
+     * the value is in the range where "%g" uses the fixed notation.
+     *
+     * (Both m and 10^k are exact doubles, so their division is correctly
+     * rounded, i.e. it is exactly what reading the decimal number back
+     * yields. And no two decimal numbers of 15 significant digits read back
+     * as the same double.) */
+    if(a >= 1e-4  &&  a < 1e15) {
+        for(k = 0; k < (int) (sizeof(mustache_pow10) / sizeof(mustache_pow10[0])); k++) {
+            double x = a * mustache_pow10[k] + 0.5;
+            uint64_t m;
+
+            if(x >= 1e15)
+                break;
+            m = (uint64_t) x;
+
+            if((double) m / mustache_pow10[k] == a) {
+                char tmp[40];
+                char* end = tmp + sizeof(tmp);
+                char* p = end;
+                int i;
+
+                /* The decimal digits (without the trailing zeros). */
+                for(i = 0; i < k; i++) {
+                    if(p < end  ||  m % 10 != 0)
+                        *(--p) = (char) ('0' + m % 10);
+                    m /= 10;
+                }
+                if(p < end)
+                    *(--p) = '.';
+
+                p = mustache_format_u64(m, p);
+                if(d < 0)
+                    *(--p) = '-';
+                memcpy(buf, p, end - p);
+                return end - p;
+            }
+        }
+    }
 
-/* Instruction to enter a node in register reg_node, i.e. to change a lookup
- * context for resolve instructions.
- *
- * Registers: If it is not NULL, reg_node is pushed to the stack.
- *            Otherwise, program counter is changed to address in reg_jmpaddr.
- */
-#define MUSTACHE_OP_ENTER           6
+    /* General path: The shortest of the formats which reads back as the same
+     * value. */
+    for(prec = 15; prec <= 17; prec++) {
+        n = snprintf(buf, MUSTACHE_SCALAR_BUFSIZE, "%.*g", prec, d);
+        if(prec == 17  ||  strtod(buf, NULL) == d)
+            break;
+    }
 
-/* Instruction to leave a node. The top node in the lookup context stack is
- * popped out.
- *
- * Arg #1: (Relative) setjmp value (NUM) for jumping back for next loop iteration.
- */
-#define MUSTACHE_OP_LEAVE           7
+    /* Use '.' as the decimal point regardless of the locale. */
+    for(k = 0; k < n; k++) {
+        if(buf[k] == ',')
+            buf[k] = '.';
+    }
+
+    return (size_t) n;
+}
+
+size_t
+mustache_format_scalar(const MUSTACHE_SCALAR* scalar, char* buf)
+{
+    switch(scalar->type) {
+        case MUSTACHE_SCALAR_BOOL:
+            if(scalar->value.b) {
+                memcpy(buf, "true", 4);
+                return 4;
+            } else {
+                memcpy(buf, "false", 5);
+                return 5;
+            }
+
+        case MUSTACHE_SCALAR_INT64:
+            if(scalar->value.i64 < 0)
+                return mustache_format_int((uint64_t) 0 - (uint64_t) scalar->value.i64, 1, buf);
+            return mustache_format_int((uint64_t) scalar->value.i64, 0, buf);
+
+        case MUSTACHE_SCALAR_UINT64:
+            return mustache_format_int(scalar->value.u64, 0, buf);
+
+        case MUSTACHE_SCALAR_DOUBLE:
+            return mustache_format_double(scalar->value.d, buf);
+
+        default:
+            return 0;
+    }
+}
+
+
+/****************
+ *** Escaping ***
+ ****************/
+
+/* Vector primitives for scanning the text for the characters which need the
+ * escaping. All the comparisons produce 0xff in the lanes where they hold. */
+#if defined MUSTACHE_SCAN_AVX2
+    typedef __m256i mustache_vec_t;
+    #define MUSTACHE_VEC_SIZE           32
+    #define MUSTACHE_VEC_FULLMASK       0xffffffffU
+    #define MUSTACHE_VEC_LOAD(ptr)      _mm256_loadu_si256((const __m256i*)(ptr))
+    #define MUSTACHE_VEC_SET1(ch)       _mm256_set1_epi8((char)(ch))
+    #define MUSTACHE_VEC_OR(a, b)       _mm256_or_si256((a), (b))
+    #define MUSTACHE_VEC_SUB(a, b)      _mm256_sub_epi8((a), (b))
+    #define MUSTACHE_VEC_EQ(a, b)       _mm256_cmpeq_epi8((a), (b))
+    #define MUSTACHE_VEC_LE(a, b)       _mm256_cmpeq_epi8(_mm256_min_epu8((a), (b)), (a))
+    #define MUSTACHE_VEC_MASK(v)        ((uint32_t) _mm256_movemask_epi8(v))
+#elif defined MUSTACHE_SCAN_SSE2
+    typedef __m128i mustache_vec_t;
+    #define MUSTACHE_VEC_SIZE           16
+    #define MUSTACHE_VEC_FULLMASK       0xffffU
+    #define MUSTACHE_VEC_LOAD(ptr)      _mm_loadu_si128((const __m128i*)(ptr))
+    #define MUSTACHE_VEC_SET1(ch)       _mm_set1_epi8((char)(ch))
+    #define MUSTACHE_VEC_OR(a, b)       _mm_or_si128((a), (b))
+    #define MUSTACHE_VEC_SUB(a, b)      _mm_sub_epi8((a), (b))
+    #define MUSTACHE_VEC_EQ(a, b)       _mm_cmpeq_epi8((a), (b))
+    #define MUSTACHE_VEC_LE(a, b)       _mm_cmpeq_epi8(_mm_min_epu8((a), (b)), (a))
+    #define MUSTACHE_VEC_MASK(v)        ((uint32_t) _mm_movemask_epi8(v))
+#endif
+
+/* Unsigned lo <= v <= hi, lane by lane. */
+#define MUSTACHE_VEC_INRANGE(v, lo, hi)                                     \
+        MUSTACHE_VEC_LE(MUSTACHE_VEC_SUB((v), MUSTACHE_VEC_SET1(lo)),       \
+                        MUSTACHE_VEC_SET1((hi) - (lo)))
+
+/* Skip whole vectors with no hit. 'hits' is an expression evaluated for the
+ * vector 'v', yielding the mask of the bytes needing the escaping. */
+#define MUSTACHE_VEC_SCAN(data, size, off, hits)                            \
+        do {                                                                \
+            while((off) + MUSTACHE_VEC_SIZE <= (size)) {                    \
+                mustache_vec_t v = MUSTACHE_VEC_LOAD((data) + (off));       \
+                uint32_t mask = (hits);                                     \
+                if(mask != 0)                                               \
+                    return (off) + mustache_ctz(mask);                      \
+                (off) += MUSTACHE_VEC_SIZE;                                 \
+            }                                                               \
+        } while(0)
+
+/* All the characters needing the HTML escaping are below '?', so most of the
+ * text is ruled out by the first comparison. */
+#define MUSTACHE_HTML_NEEDS_ESCAPE(ch)                                      \
+        ((uint8_t)(ch) <= '>'  &&                                           \
+         ((ch) == '&'  ||  (ch) == '"'  ||  (ch) == '<'  ||  (ch) == '>'))
+
+#define MUSTACHE_XML_NEEDS_ESCAPE(ch)                                       \
+        ((uint8_t)(ch) <= '>'  &&                                           \
+         ((ch) == '&'  ||  (ch) == '"'  ||  (ch) == '<'  ||  (ch) == '>'  || \
+          (ch) == '\''))
+
+#define MUSTACHE_JSON_NEEDS_ESCAPE(ch)                                      \
+        ((uint8_t)(ch) < 0x20  ||  (ch) == '"'  ||  (ch) == '\\')
+
+#define MUSTACHE_URL_NEEDS_ESCAPE(ch)                                       \
+        (!(((uint8_t)(ch) | 0x20) >= 'a'  &&  ((uint8_t)(ch) | 0x20) <= 'z')  && \
+         !((ch) >= '0'  &&  (ch) <= '9')  &&                                \
+         (ch) != '-'  &&  (ch) != '.'  &&  (ch) != '_'  &&  (ch) != '~')
+
+/* Each of the scanners below returns the offset of the first byte needing the
+ * escaping, or size if there is none. */
+static size_t
+mustache_escape_scan_html(const char* data, size_t size)
+{
+    size_t off = 0;
+
+#ifdef MUSTACHE_VEC_SIZE
+    const mustache_vec_t v_amp = MUSTACHE_VEC_SET1('&');
+    const mustache_vec_t v_quot = MUSTACHE_VEC_SET1('"');
+    const mustache_vec_t v_lt = MUSTACHE_VEC_SET1('<');
+    const mustache_vec_t v_gt = MUSTACHE_VEC_SET1('>');
+
+    MUSTACHE_VEC_SCAN(data, size, off, MUSTACHE_VEC_MASK(
+                MUSTACHE_VEC_OR(
+                    MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_amp), MUSTACHE_VEC_EQ(v, v_quot)),
+                    MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_lt), MUSTACHE_VEC_EQ(v, v_gt)))));
+#endif
+
+    while(off < size  &&  !MUSTACHE_HTML_NEEDS_ESCAPE(data[off]))
+        off++;
+    return off;
+}
+
+static size_t
+mustache_escape_scan_xml(const char* data, size_t size)
+{
+    size_t off = 0;
+
+#ifdef MUSTACHE_VEC_SIZE
+    const mustache_vec_t v_amp = MUSTACHE_VEC_SET1('&');
+    const mustache_vec_t v_quot = MUSTACHE_VEC_SET1('"');
+    const mustache_vec_t v_apos = MUSTACHE_VEC_SET1('\'');
+    const mustache_vec_t v_lt = MUSTACHE_VEC_SET1('<');
+    const mustache_vec_t v_gt = MUSTACHE_VEC_SET1('>');
+
+    MUSTACHE_VEC_SCAN(data, size, off, MUSTACHE_VEC_MASK(
+                MUSTACHE_VEC_OR(
+                    MUSTACHE_VEC_OR(
+                        MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_amp), MUSTACHE_VEC_EQ(v, v_quot)),
+                        MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_lt), MUSTACHE_VEC_EQ(v, v_gt))),
+                    MUSTACHE_VEC_EQ(v, v_apos))));
+#endif
+
+    while(off < size  &&  !MUSTACHE_XML_NEEDS_ESCAPE(data[off]))
+        off++;
+    return off;
+}
 
-/* Instruction to open inverted section.
- * Note there is no MUSTACHE_OP_LEAVEINV instruction as it is noop.
- *
- * Registers: If reg_node is NULL, continues normally.
- *            Otherwise, program counter is changed to address in reg_jmpaddr.
- */
-#define MUSTACHE_OP_ENTERINV        8
+static size_t
+mustache_escape_scan_json(const char* data, size_t size)
+{
+    size_t off = 0;
 
-/* Instruction to enter a partial.
- *
- * Arg #1: Length of the partial name (NUM).
- * Arg #2: The partial name (STR).
- * Arg #3: Length of the indentation string (NUM).
- * Arg #4: Indentation, i.e. string composed of whitespace characters (STR).
- */
-#define MUSTACHE_OP_PARTIAL         9
+#ifdef MUSTACHE_VEC_SIZE
+    const mustache_vec_t v_quot = MUSTACHE_VEC_SET1('"');
+    const mustache_vec_t v_backslash = MUSTACHE_VEC_SET1('\\');
+    const mustache_vec_t v_ctrl = MUSTACHE_VEC_SET1(0x1f);
 
-/* Instruction to insert extra indentation (inherited from parent templates).
- */
-#define MUSTACHE_OP_INDENT          10
+    MUSTACHE_VEC_SCAN(data, size, off, MUSTACHE_VEC_MASK(
+                MUSTACHE_VEC_OR(
+                    MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_quot), MUSTACHE_VEC_EQ(v, v_backslash)),
+                    MUSTACHE_VEC_LE(v, v_ctrl))));
+#endif
 
+    while(off < size  &&  !MUSTACHE_JSON_NEEDS_ESCAPE(data[off]))
+        off++;
+    return off;
+}
 
-static int
-mustache_compile_tagname(MUSTACHE_BUFFER* insns, const char* name, size_t size)
+static size_t
+mustache_escape_scan_url(const char* data, size_t size)
 {
-    unsigned n_tokens = 1;
-    unsigned i;
-    off_t tok_beg, tok_end;
+    size_t off = 0;
+
+#ifdef MUSTACHE_VEC_SIZE
+    const mustache_vec_t v_case = MUSTACHE_VEC_SET1(0x20);
+    const mustache_vec_t v_dash = MUSTACHE_VEC_SET1('-');
+    const mustache_vec_t v_dot = MUSTACHE_VEC_SET1('.');
+    const mustache_vec_t v_underscore = MUSTACHE_VEC_SET1('_');
+    const mustache_vec_t v_tilde = MUSTACHE_VEC_SET1('~');
+
+    /* Here we look for the bytes which may stay, and negate the mask. */
+    MUSTACHE_VEC_SCAN(data, size, off, MUSTACHE_VEC_MASK(
+                MUSTACHE_VEC_OR(
+                    MUSTACHE_VEC_OR(
+                        MUSTACHE_VEC_INRANGE(MUSTACHE_VEC_OR(v, v_case), 'a', 'z'),
+                        MUSTACHE_VEC_INRANGE(v, '0', '9')),
+                    MUSTACHE_VEC_OR(
+                        MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_dash), MUSTACHE_VEC_EQ(v, v_dot)),
+                        MUSTACHE_VEC_OR(MUSTACHE_VEC_EQ(v, v_underscore), MUSTACHE_VEC_EQ(v, v_tilde)))))
+                ^ MUSTACHE_VEC_FULLMASK);
+#endif
 
-    if(size == 1  &&  name[0] == '.') {
-        /* Implicit iterator. */
-        n_tokens = 0;
-    } else {
-        for(i = 0; i < size; i++) {
-            if(name[i] == '.')
-                n_tokens++;
-        }
-    }
+    while(off < size  &&  !MUSTACHE_URL_NEEDS_ESCAPE(data[off]))
+        off++;
+    return off;
+}
 
-    if(mustache_buffer_append_num(insns, n_tokens) != 0)
-        return -1;
+/* Longest replacement of a single byte ("&quot;", "\u001f"). */
+#define MUSTACHE_ESCAPE_MAX_REPL        6
 
-    tok_beg = 0;
-    for(i = 0; i < n_tokens; i++) {
-        tok_end = tok_beg;
-        while(tok_end < size  &&  name[tok_end] != '.')
-            tok_end++;
+/* Write the replacement of the byte (which needs the escaping) into buf.
+ * Returns its length. */
+static size_t
+mustache_escape_char(unsigned escape, char ch, char* buf)
+{
+    static const char xdigits[] = "0123456789ABCDEF";
+    const char* repl;
+
+    switch(escape) {
+        case MUSTACHE_ESCAPE_HTML:
+        case MUSTACHE_ESCAPE_XML:
+            switch(ch) {
+                case '&':   repl = "&amp;"; break;
+                case '"':   repl = "&quot;"; break;
+                case '\'':  repl = "&apos;"; break;
+                case '<':   repl = "&lt;"; break;
+                default:    repl = "&gt;"; break;
+            }
+            break;
 
-        if(mustache_buffer_append_num(insns, tok_end - tok_beg) != 0)
-            return -1;
-        if(mustache_buffer_append(insns, name + tok_beg, tok_end - tok_beg) != 0)
-            return -1;
+        case MUSTACHE_ESCAPE_JSON:
+            switch(ch) {
+                case '"':   repl = "\\\""; break;
+                case '\\':  repl = "\\\\"; break;
+                case '\b':  repl = "\\b"; break;
+                case '\f':  repl = "\\f"; break;
+                case '\n':  repl = "\\n"; break;
+                case '\r':  repl = "\\r"; break;
+                case '\t':  repl = "\\t"; break;
+                default:
+                    memcpy(buf, "\\u00", 4);
+                    buf[4] = xdigits[((uint8_t) ch) >> 4];
+                    buf[5] = xdigits[((uint8_t) ch) & 0xf];
+                    return 6;
+            }
+            break;
 
-        tok_beg = tok_end + 1;
+        default:    /* MUSTACHE_ESCAPE_URL */
+            buf[0] = '%';
+            buf[1] = xdigits[((uint8_t) ch) >> 4];
+            buf[2] = xdigits[((uint8_t) ch) & 0xf];
+            return 3;
     }
 
-    return 0;
+    memcpy(buf, repl, strlen(repl));
+    return strlen(repl);
 }
 
-MUSTACHE_TEMPLATE*
-mustache_compile(const char* templ_data, size_t templ_size,
-                 const MUSTACHE_PARSER* parser, void* parser_data,
-                 unsigned flags)
+int
+mustache_escape(unsigned escape, const char* data, size_t size,
+                int (*out)(const char*, size_t, void*), void* out_data)
 {
-    static const MUSTACHE_PARSER default_parser = { mustache_parse_error };
-    MUSTACHE_TAGINFO* tags = NULL;
-    unsigned n_tags;
-    off_t off;
-    off_t jmp_pos;
-    MUSTACHE_TAGINFO* tag;
-    MUSTACHE_BUFFER insns = { 0 };
-    MUSTACHE_STACK jmp_pos_stack = { 0 };
-    int done = 0;
-    int success = 0;
-    size_t indent_len;
+    size_t (*scan)(const char*, size_t);
+    const char* end = data + size;
+    char buf[64];
+    size_t n;
 
-    if(parser == NULL)
-        parser = &default_parser;
+    switch(escape) {
+        case MUSTACHE_ESCAPE_HTML:  scan = mustache_escape_scan_html; break;
+        case MUSTACHE_ESCAPE_XML:   scan = mustache_escape_scan_xml; break;
+        case MUSTACHE_ESCAPE_JSON:  scan = mustache_escape_scan_json; break;
+        case MUSTACHE_ESCAPE_URL:   scan = mustache_escape_scan_url; break;
+        default:                    return -1;
+    }
 
-    /* Collect all tags from the template. */
-    if(mustache_parse(templ_data, templ_size, parser, parser_data, &tags, &n_tags) != 0)
-        goto err;
+    while(data < end) {
+        /* Pass the run of bytes which need no escaping at once. */
+        n = scan(data, end - data);
+        if(n > 0  &&  out(data, n, out_data) != 0)
+            return -1;
+        data += n;
+        if(data >= end)
+            break;
 
-    /* Build the template */
-#define APPEND(data, n)                                                                 \
-        do {                                                                            \
-            if(mustache_buffer_append(&insns, (data), (n)) != 0)                        \
-                goto err;                                                               \
-        } while(0)
+        /* Collect the replacements of the bytes which do need it. We are
+         * here only for such a byte, and for the following ones we ask the
+         * scanner: It returns zero if the byte needs the escaping. */
+        n = 0;
+        do {
+            n += mustache_escape_char(escape, *data, buf + n);
+            data++;
+        } while(data < end  &&  n + MUSTACHE_ESCAPE_MAX_REPL <= sizeof(buf)  &&
+                scan(data, 1) == 0);
+        if(out(buf, n, out_data) != 0)
+            return -1;
+    }
 
-#define APPEND_NUM(num)                                                                 \
-        do {                                                                            \
-            if(mustache_buffer_append_num(&insns, (uint64_t)(num)) != 0)                \
-                goto err;                                                               \
-        } while(0)
+    return 0;
+}
 
-#define APPEND_TAGNAME(tag)                                                             \
-        do {                                                                            \
-            if(mustache_compile_tagname(&insns, templ_data + (tag)->name_beg,           \
-                                        (tag)->name_end - (tag)->name_beg) != 0)        \
-                goto err;                                                               \
-        } while(0)
 
-#define INSERT_NUM(pos, num)                                                            \
-        do {                                                                            \
-            if(mustache_buffer_insert_num(&insns, (pos), (uint64_t)(num)) != 0)         \
-                goto err;                                                               \
-        } while(0)
+/***********************
+ *** Buffered Output ***
+ ***********************/
 
-#define PUSH_JMP_POS()                                                                  \
-        do {                                                                            \
-            if(mustache_stack_push(&jmp_pos_stack, insns.n) != 0)                       \
-                goto err;                                                               \
-        } while(0)
+/* Minimal size of the buffer. */
+#define MUSTACHE_OUTPUT_MIN_CHUNK       64
 
-#define POP_JMP_POS()       ((off_t) mustache_stack_pop(&jmp_pos_stack))
+/* The output works in one of two modes:
+ *
+ *  -- Buffered (mustache_output_create()): Everything is copied into the
+ *     buffer, which is passed to the write callback when full.
+ *
+ *  -- Gathering (mustache_output_create_gather()): The output is collected as
+ *     a list of pieces (iov). The literals of the template are referred to in
+ *     place, and only the other output (which may be gone when the callback
+ *     returns) is copied into the buffer (the arena). The list is passed to the
+ *     callback when it gets long, when it refers to too much data, or when the
+ *     arena gets full.
+ */
+struct MUSTACHE_OUTPUT {
+    const MUSTACHE_ALLOCATOR* allocator;
+    void* allocator_data;
+    int (*write)(const char*, size_t, void*);
+    int (*write_gather)(const MUSTACHE_IOVEC*, unsigned, void*);
+    void* write_data;
+
+    char* buf;
+    size_t size;
+    size_t n;
 
-    off = 0;
-    tag = &tags[0];
-    while(1) {
-        if(off < tag->beg) {
-            /* Handle literal text before the next tag. */
-            APPEND_NUM(MUSTACHE_OP_LITERAL);
-            APPEND_NUM(tag->beg - off);
-            APPEND(templ_data + off, tag->beg - off);
-            off = tag->beg;
-        }
+    MUSTACHE_IOVEC* iov;        /* NULL unless gathering. */
+    unsigned n_iov;
+    size_t iov_bytes;
+};
 
-        switch(tag->type) {
-        case MUSTACHE_TAGTYPE_VAR:
-        case MUSTACHE_TAGTYPE_VERBATIMVAR:
-        case MUSTACHE_TAGTYPE_VERBATIMVAR2:
-            APPEND_NUM(MUSTACHE_OP_RESOLVE);
-            APPEND_TAGNAME(tag);
-            APPEND_NUM((tag->type == MUSTACHE_TAGTYPE_VAR) ?
-                        MUSTACHE_OP_OUTESCAPED : MUSTACHE_OP_OUTVERBATIM);
-            break;
+#define MUSTACHE_OUTPUT_IOV_BYTES       MUSTACHE_OUTPUT_DEFAULT_CHUNK
 
-        case MUSTACHE_TAGTYPE_OPENSECTION:
-            APPEND_NUM(MUSTACHE_OP_RESOLVE_setjmp);
-            PUSH_JMP_POS();
-            APPEND_TAGNAME(tag);
-            APPEND_NUM(MUSTACHE_OP_ENTER);
-            PUSH_JMP_POS();
-            break;
+static int
+mustache_output_flush_buffer(MUSTACHE_OUTPUT* output)
+{
+    size_t n = output->n;
 
-        case MUSTACHE_TAGTYPE_CLOSESECTION:
-            APPEND_NUM(MUSTACHE_OP_LEAVE);
-            APPEND_NUM(insns.n - POP_JMP_POS());
-            jmp_pos = POP_JMP_POS();
-            INSERT_NUM(jmp_pos, insns.n - jmp_pos);
-            break;
+    if(output->iov != NULL) {
+        unsigned n_iov = output->n_iov;
 
-        case MUSTACHE_TAGTYPE_OPENSECTIONINV:
-            APPEND_NUM(MUSTACHE_OP_RESOLVE_setjmp);
-            PUSH_JMP_POS();
-            APPEND_TAGNAME(tag);
-            APPEND_NUM(MUSTACHE_OP_ENTERINV);
-            break;
+        if(n_iov == 0)
+            return 0;
 
-        case MUSTACHE_TAGTYPE_CLOSESECTIONINV:
-            jmp_pos = POP_JMP_POS();
-            INSERT_NUM(jmp_pos, insns.n - jmp_pos);
-            break;
+        output->n = 0;
+        output->n_iov = 0;
+        output->iov_bytes = 0;
+        return (output->write_gather(output->iov, n_iov, output->write_data) != 0) ? -1 : 0;
+    }
 
-        case MUSTACHE_TAGTYPE_PARTIAL:
-            APPEND_NUM(MUSTACHE_OP_PARTIAL);
-            APPEND_NUM(tag->name_end - tag->name_beg);
-            APPEND(templ_data + tag->name_beg, tag->name_end - tag->name_beg);
-            indent_len = 0;
-            while(MUSTACHE_ISWHITESPACE(templ_data[tag->beg + indent_len]))
-                indent_len++;
-            APPEND_NUM(indent_len);
-            APPEND(templ_data + tag->beg, indent_len);
-            break;
+    if(n == 0)
+        return 0;
 
-        case MUSTACHE_TAGTYPE_INDENT:
-            APPEND_NUM(MUSTACHE_OP_INDENT);
-            break;
+    output->n = 0;
+    return (output->write(output->buf, n, output->write_data) != 0) ? -1 : 0;
+}
 
-        case MUSTACHE_TAGTYPE_NONE:
-            APPEND_NUM(MUSTACHE_OP_EXIT);
-            done = 1;
-            break;
+/* Append a piece to the list of pieces to write. */
+static int
+mustache_output_add_iov(MUSTACHE_OUTPUT* output, const char* data, size_t size)
+{
+    MUSTACHE_IOVEC* last = (output->n_iov > 0) ? &output->iov[output->n_iov - 1] : NULL;
 
-        default:
-            break;
+    if(last != NULL  &&  last->data + last->size == data) {
+        last->size += size;
+    } else {
+        if(output->n_iov >= MUSTACHE_OUTPUT_MAX_IOV) {
+            if(mustache_output_flush_buffer(output) != 0)
+                return -1;
         }
+        output->iov[output->n_iov].data = data;
+        output->iov[output->n_iov].size = size;
+        output->n_iov++;
+    }
 
-        if(done)
-            break;
+    output->iov_bytes += size;
+    if(output->iov_bytes >= MUSTACHE_OUTPUT_IOV_BYTES)
+        return mustache_output_flush_buffer(output);
+    return 0;
+}
+
+static int
+mustache_output_verbatim(const char* data, size_t size, void* renderer_data)
+{
+    MUSTACHE_OUTPUT* output = (MUSTACHE_OUTPUT*) renderer_data;
 
-        off = tag->end;
-        tag++;
+    /* When gathering, make sure adding the piece below cannot flush (and so
+     * reset the arena) when the data are already copied into it. */
+    if(output->iov != NULL  &&  output->n_iov >= MUSTACHE_OUTPUT_MAX_IOV) {
+        if(mustache_output_flush_buffer(output) != 0)
+            return -1;
     }
 
-    success = 1;
+    if(size > output->size - output->n) {
+        if(mustache_output_flush_buffer(output) != 0)
+            return -1;
 
-err:
-    free(tags);
-    mustache_buffer_free(&jmp_pos_stack);
-    if(success) {
-        return (MUSTACHE_TEMPLATE*) insns.data;
-    } else {
-        mustache_buffer_free(&insns);
-        return NULL;
+        /* Do not copy what would not fit into the buffer anyway. (When
+         * gathering, the data have to be written before we return.) */
+        if(size >= output->size) {
+            if(output->iov != NULL) {
+                if(mustache_output_add_iov(output, data, size) != 0)
+                    return -1;
+                return mustache_output_flush_buffer(output);
+            }
+            return (output->write(data, size, output->write_data) != 0) ? -1 : 0;
+        }
     }
+
+    memcpy(output->buf + output->n, data, size);
+    output->n += size;
+    if(output->iov != NULL)
+        return mustache_output_add_iov(output, output->buf + output->n - size, size);
+    return 0;
 }
 
-void
-mustache_release(MUSTACHE_TEMPLATE* t)
+static int
+mustache_output_literal(const char* data, size_t size, void* renderer_data)
 {
-    if(t == NULL)
-        return;
+    MUSTACHE_OUTPUT* output = (MUSTACHE_OUTPUT*) renderer_data;
 
-    free(t);
-}
+    if(output->iov == NULL)
+        return mustache_output_verbatim(data, size, renderer_data);
 
+    /* The literal stays valid for the lifetime of the template so refer to
+     * it in place. */
+    return mustache_output_add_iov(output, data, size);
+}
 
-/**********************************
- *** Applying Compiled Template ***
- **********************************/
+static int
+mustache_output_escaped_html(const char* data, size_t size, void* renderer_data)
+{
+    return mustache_escape(MUSTACHE_ESCAPE_HTML, data, size,
+                mustache_output_verbatim, renderer_data);
+}
 
-int
-mustache_process(const MUSTACHE_TEMPLATE* t,
-                 const MUSTACHE_RENDERER* renderer, void* renderer_data,
-                 const MUSTACHE_DATAPROVIDER* provider, void* provider_data)
+static int
+mustache_output_escaped_xml(const char* data, size_t size, void* renderer_data)
 {
-    const uint8_t* insns = (const uint8_t*) t;
-    off_t reg_pc = 0;       /* Program counter register. */
-    off_t reg_jmpaddr;      /* Jump target address register. */
-    void* reg_node = NULL;  /* Working node register. */
-    int done = 0;
-    MUSTACHE_STACK node_stack = { 0 };
-    MUSTACHE_STACK index_stack = { 0 };
-    MUSTACHE_STACK partial_stack = { 0 };
-    MUSTACHE_BUFFER indent_buffer = { 0 };
-    int ret = -1;
+    return mustache_escape(MUSTACHE_ESCAPE_XML, data, size,
+                mustache_output_verbatim, renderer_data);
+}
 
-#define PUSH_NODE()                                                         \
-        do {                                                                \
-            if(mustache_stack_push(&node_stack, (uintptr_t) reg_node) != 0) \
-                goto err;                                                   \
-        } while(0)
+static int
+mustache_output_escaped_json(const char* data, size_t size, void* renderer_data)
+{
+    return mustache_escape(MUSTACHE_ESCAPE_JSON, data, size,
+                mustache_output_verbatim, renderer_data);
+}
 
-#define POP_NODE()          ((void*) mustache_stack_pop(&node_stack))
+static int
+mustache_output_escaped_url(const char* data, size_t size, void* renderer_data)
+{
+    return mustache_escape(MUSTACHE_ESCAPE_URL, data, size,
+                mustache_output_verbatim, renderer_data);
+}
 
-#define PEEK_NODE()         ((void*) mustache_stack_peek(&node_stack))
+/* Indexed by MUSTACHE_ESCAPE_xxx. */
+static const MUSTACHE_RENDERER mustache_output_renderers[] = {
+    { mustache_output_verbatim, mustache_output_escaped_html, mustache_output_literal },
+    { mustache_output_verbatim, mustache_output_escaped_xml, mustache_output_literal },
+    { mustache_output_verbatim, mustache_output_escaped_json, mustache_output_literal },
+    { mustache_output_verbatim, mustache_output_escaped_url, mustache_output_literal }
+};
 
-#define PUSH_INDEX(index)                                                   \
-        do {                                                                \
-            if(mustache_stack_push(&index_stack, (uintptr_t) (index)) != 0) \
-                goto err;                                                   \
-        } while(0)
+static MUSTACHE_OUTPUT*
+mustache_output_new(size_t chunk_size, int gather,
+                    const MUSTACHE_ALLOCATOR* allocator, void* allocator_data)
+{
+    MUSTACHE_OUTPUT* output;
 
-#define POP_INDEX()         ((unsigned) mustache_stack_pop(&index_stack))
+    if(allocator == NULL)
+        allocator = &mustache_default_allocator;
+    if(chunk_size < MUSTACHE_OUTPUT_MIN_CHUNK)
+        chunk_size = MUSTACHE_OUTPUT_MIN_CHUNK;
 
-    reg_node = provider->get_root(provider_data);
-    PUSH_NODE();
+    output = (MUSTACHE_OUTPUT*) allocator->mem_alloc(sizeof(MUSTACHE_OUTPUT), allocator_data);
+    if(output == NULL)
+        return NULL;
+    memset(output, 0, sizeof(MUSTACHE_OUTPUT));
+    output->allocator = allocator;
+    output->allocator_data = allocator_data;
+    output->size = chunk_size;
 
-    while(!done) {
-        unsigned opcode = (unsigned) mustache_decode_num(insns, reg_pc, &reg_pc);
+    output->buf = (char*) allocator->mem_alloc(chunk_size, allocator_data);
+    if(output->buf == NULL)
+        goto err;
 
-        switch(opcode) {
-        case MUSTACHE_OP_LITERAL:
-        {
-            size_t n = (size_t) mustache_decode_num(insns, reg_pc, &reg_pc);
-            if(renderer->out_verbatim((const char*)(insns + reg_pc), n, renderer_data) != 0)
-                goto err;
-            reg_pc += n;
-            break;
-        }
+    if(gather) {
+        output->iov = (MUSTACHE_IOVEC*) allocator->mem_alloc(
+                    MUSTACHE_OUTPUT_MAX_IOV * sizeof(MUSTACHE_IOVEC), allocator_data);
+        if(output->iov == NULL)
+            goto err;
+    }
 
-        case MUSTACHE_OP_RESOLVE_setjmp:
-        {
-            size_t jmp_len = (size_t) mustache_decode_num(insns, reg_pc, &reg_pc);
-            reg_jmpaddr = reg_pc + jmp_len;
-            /* Pass through */
-        }
+    return output;
 
-        case MUSTACHE_OP_RESOLVE:
-        {
-            unsigned n_names = (unsigned) mustache_decode_num(insns, reg_pc, &reg_pc);
-            unsigned i;
+err:
+    mustache_output_release(output);
+    return NULL;
+}
 
-            if(n_names == 0) {
-                /* Implicit iterator. */
-                reg_node = PEEK_NODE();
-                break;
-            }
+MUSTACHE_OUTPUT*
+mustache_output_create_ex(size_t chunk_size,
+                          int (*write)(const char*, size_t, void*), void* write_data,
+                          const MUSTACHE_ALLOCATOR* allocator, void* allocator_data)
+{
+    MUSTACHE_OUTPUT* output;
 
-            for(i = 0; i < n_names; i++) {
-                size_t name_len = (size_t) mustache_decode_num(insns, reg_pc, &reg_pc);
-                const char* name = (const char*)(insns + reg_pc);
-                reg_pc += name_len;
-
-                if(i == 0) {
-                    void** nodes = (void**) node_stack.data;
-                    size_t n_nodes = node_stack.n / sizeof(void*);
-
-                    while(n_nodes-- > 0) {
-                        reg_node = provider->get_child_by_name(nodes[n_nodes], 
-                                        name, name_len, provider_data);
-                        if(reg_node != NULL)
-                            break;
-                    }
-                } else if(reg_node != NULL) {
-                    reg_node = provider->get_child_by_name(reg_node,
-                                        name, name_len, provider_data);
-                }
-            }
-            break;
-        }
+    if(chunk_size == 0)
+        chunk_size = MUSTACHE_OUTPUT_DEFAULT_CHUNK;
 
-        case MUSTACHE_OP_OUTVERBATIM:
-        case MUSTACHE_OP_OUTESCAPED:
-            if(reg_node != NULL) {
-                int (*out)(const char*, size_t, void*);
+    output = mustache_output_new(chunk_size, 0, allocator, allocator_data);
+    if(output == NULL)
+        return NULL;
 
-                out = (opcode == MUSTACHE_OP_OUTVERBATIM) ?
-                            renderer->out_verbatim : renderer->out_escaped;
-                if(provider->dump(reg_node, out, renderer_data, provider_data) != 0)
-                    goto err;
-            }
-            break;
+    output->write = write;
+    output->write_data = write_data;
+    return output;
+}
 
-        case MUSTACHE_OP_ENTER:
-            if(reg_node != NULL) {
-                PUSH_NODE();
-                reg_node = provider->get_child_by_index(reg_node, 0, provider_data);
-                if(reg_node != NULL) {
-                    PUSH_NODE();
-                    PUSH_INDEX(0);
-                } else {
-                    (void) POP_NODE();
-                }
-            }
-            if(reg_node == NULL)
-                reg_pc = reg_jmpaddr;
-            break;
+MUSTACHE_OUTPUT*
+mustache_output_create(size_t chunk_size,
+                       int (*write)(const char*, size_t, void*), void* write_data)
+{
+    return mustache_output_create_ex(chunk_size, write, write_data, NULL, NULL);
+}
 
-        case MUSTACHE_OP_LEAVE:
-        {
-            off_t jmp_base = reg_pc;
-            size_t jmp_len = (size_t) mustache_decode_num(insns, reg_pc, &reg_pc);
-            unsigned index = POP_INDEX();
+MUSTACHE_OUTPUT*
+mustache_output_create_gather_ex(size_t arena_size,
+                                 int (*write_gather)(const MUSTACHE_IOVEC*, unsigned, void*),
+                                 void* write_data,
+                                 const MUSTACHE_ALLOCATOR* allocator, void* allocator_data)
+{
+    MUSTACHE_OUTPUT* output;
 
-            (void) POP_NODE();
-            reg_node = provider->get_child_by_index(PEEK_NODE(), ++index, provider_data);
-            if(reg_node != NULL) {
-                PUSH_NODE();
-                PUSH_INDEX(index);
-                reg_pc = jmp_base - jmp_len;
-            } else {
-                (void) POP_NODE();
-            }
-            break;
-        }
+    if(arena_size == 0)
+        arena_size = MUSTACHE_OUTPUT_DEFAULT_ARENA;
 
-        case MUSTACHE_OP_ENTERINV:
-            if(reg_node == NULL  ||  provider->get_child_by_index(reg_node,
-                                                0, provider_data) == NULL) {
-                /* Resolve failed: Noop, continue normally. */
-            } else {
-                reg_pc = reg_jmpaddr;
-            }
-            break;
+    output = mustache_output_new(arena_size, 1, allocator, allocator_data);
+    if(output == NULL)
+        return NULL;
 
-        case MUSTACHE_OP_PARTIAL:
-        {
-            size_t name_len;
-            const char* name;
-            size_t indent_len;
-            const char* indent;
-            MUSTACHE_TEMPLATE* partial;
+    output->write_gather = write_gather;
+    output->write_data = write_data;
+    return output;
+}
 
-            name_len = mustache_decode_num(insns, reg_pc, &reg_pc);
-            name = (const char*) (insns + reg_pc);
-            reg_pc += name_len;
+MUSTACHE_OUTPUT*
+mustache_output_create_gather(size_t arena_size,
+                              int (*write_gather)(const MUSTACHE_IOVEC*, unsigned, void*),
+                              void* write_data)
+{
+    return mustache_output_create_gather_ex(arena_size, write_gather, write_data, NULL, NULL);
+}
 
-            indent_len = mustache_decode_num(insns, reg_pc, &reg_pc);
-            indent = (const char*) (insns + reg_pc);
-            reg_pc += indent_len;
+#ifndef _WIN32
+/* MUSTACHE_IOVEC is passed to writev() as it is, so it has to match the
+ * struct iovec. */
+typedef char mustache_iovec_check[(sizeof(MUSTACHE_IOVEC) == sizeof(struct iovec)  &&
+            offsetof(MUSTACHE_IOVEC, data) == offsetof(struct iovec, iov_base)  &&
+            offsetof(MUSTACHE_IOVEC, size) == offsetof(struct iovec, iov_len)) ? 1 : -1];
+
+#if defined IOV_MAX  &&  IOV_MAX < MUSTACHE_OUTPUT_MAX_IOV
+    #define MUSTACHE_WRITEV_MAX     IOV_MAX
+#else
+    #define MUSTACHE_WRITEV_MAX     MUSTACHE_OUTPUT_MAX_IOV
+#endif
 
-            partial = provider->get_partial(name, name_len, provider_data);
-            if(partial != NULL) {
-                if(mustache_stack_push(&partial_stack, (uintptr_t) insns) != 0)
-                    goto err;
-                if(mustache_stack_push(&partial_stack, (uintptr_t) reg_pc) != 0)
-                    goto err;
-                if(mustache_stack_push(&partial_stack, (uintptr_t) indent_len) != 0)
-                    goto err;
-                if(mustache_buffer_append(&indent_buffer, indent, indent_len) != 0)
-                    goto err;
-                reg_pc = 0;
-                insns = (uint8_t*) partial;
-            }
-            break;
+static int
+mustache_output_writev(const MUSTACHE_IOVEC* iov, unsigned n_iov, void* write_data)
+{
+    int fd = (int) (intptr_t) write_data;
+    ssize_t n;
+
+    while(n_iov > 0) {
+        n = writev(fd, (const struct iovec*) iov,
+                   (n_iov < MUSTACHE_WRITEV_MAX) ? (int) n_iov : MUSTACHE_WRITEV_MAX);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
         }
 
-        case MUSTACHE_OP_INDENT:
-            if(renderer->out_verbatim((const char*)(indent_buffer.data),
-                                indent_buffer.n, renderer_data) != 0)
-                goto err;
-            break;
-
-        case MUSTACHE_OP_EXIT:
-            if(mustache_stack_is_empty(&partial_stack)) {
-                done = 1;
-            } else {
-                size_t indent_len = (size_t) mustache_stack_pop(&partial_stack);
-                reg_pc = (off_t) mustache_stack_pop(&partial_stack);
-                insns = (uint8_t*) mustache_stack_pop(&partial_stack);
+        /* Skip what has been written. */
+        while(n_iov > 0  &&  (size_t) n >= iov->size) {
+            n -= iov->size;
+            iov++;
+            n_iov--;
+        }
 
-                indent_buffer.n -= indent_len;
+        /* Finish a partially written piece with write(). */
+        if(n > 0) {
+            const char* data = iov->data + n;
+            size_t size = iov->size - n;
+
+            while(size > 0) {
+                n = write(fd, data, size);
+                if(n < 0) {
+                    if(errno == EINTR)
+                        continue;
+                    return -1;
+                }
+                data += n;
+                size -= n;
             }
-            break;
+            iov++;
+            n_iov--;
         }
     }
 
-    /* Success. */
-    ret = 0;
+    return 0;
+}
 
-err:
-    mustache_stack_free(&node_stack);
-    mustache_stack_free(&index_stack);
-    mustache_stack_free(&partial_stack);
-    mustache_buffer_free(&indent_buffer);
-    return ret;
+MUSTACHE_OUTPUT*
+mustache_output_create_fd(int fd, size_t arena_size)
+{
+    return mustache_output_create_gather(arena_size, mustache_output_writev,
+                (void*) (intptr_t) fd);
+}
+#endif  /* !_WIN32 */
+
+const MUSTACHE_RENDERER*
+mustache_output_renderer(void)
+{
+    return &mustache_output_renderers[MUSTACHE_ESCAPE_HTML];
+}
+
+const MUSTACHE_RENDERER*
+mustache_output_renderer_ex(unsigned escape)
+{
+    if(escape >= sizeof(mustache_output_renderers) / sizeof(mustache_output_renderers[0]))
+        return NULL;
+    return &mustache_output_renderers[escape];
+}
+
+int
+mustache_output_flush(MUSTACHE_OUTPUT* output)
+{
+    return mustache_output_flush_buffer(output);
+}
+
+void
+mustache_output_release(MUSTACHE_OUTPUT* output)
+{
+    if(output == NULL)
+        return;
+
+    mustache_mem_free(output->allocator, output->allocator_data, output->iov,
+                MUSTACHE_OUTPUT_MAX_IOV * sizeof(MUSTACHE_IOVEC));
+    mustache_mem_free(output->allocator, output->allocator_data, output->buf, output->size);
+    mustache_mem_free(output->allocator, output->allocator_data, output, sizeof(MUSTACHE_OUTPUT));
 }
@@ -26,6 +26,7 @@
 #ifndef MUSTACHE4C_H
 #define MUSTACHE4C_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -34,6 +35,8 @@ extern "C" {
 
 
 typedef struct MUSTACHE_TEMPLATE MUSTACHE_TEMPLATE;
+typedef struct MUSTACHE_PROCESSOR MUSTACHE_PROCESSOR;
+typedef struct MUSTACHE_OUTPUT MUSTACHE_OUTPUT;
 
 
 #define MUSTACHE_ERR_SUCCESS                (0)
@@ -49,6 +52,68 @@ typedef struct MUSTACHE_TEMPLATE MUSTACHE_TEMPLATE;
 #define MUSTACHE_ERR_INVALIDDELIMITERS      (10)
 
 
+/**
+ * Flags for mustache_compile().
+ *
+ * MUSTACHE_FLAG_COMPACT: Produce the compact form of the compiled template,
+ * which needs less memory (typically about a half of the default form for
+ * tag-heavy templates), but which is slower to process.
+ *
+ * MUSTACHE_FLAG_NOOPTIMIZE: Disable the optimizations of the compiled
+ * template (fusing of common instruction sequences, merging of adjacent
+ * literals, and stripping of the instructions indenting each line).
+ * Mainly useful for debugging Mustache4C itself.
+ *
+ * MUSTACHE_FLAG_CSE: When a name is used multiple times within the same
+ * lookup context (e.g. `{{user.name}}` at several places of a section body),
+ * resolve it only once and reuse the result. Use it only if the data provider
+ * guarantees the data stay immutable during mustache_process() and that its
+ * callbacks resolving names have no side effects. Note the compiler cannot
+ * reuse a name resolved outside of a section inside of it, because the items
+ * of the section may shadow it (see MUSTACHE_PROCESSOR_FLAG_MEMO for that).
+ * Storing the results for the reuse has a small cost too, so the flag pays off
+ * only for templates which repeat the names.
+ *
+ * MUSTACHE_FLAG_INDENTCOPY: The compiled code has no instructions indenting
+ * each line, as there is nothing to indent unless the template is processed
+ * as a partial indented by its standalone tag. Only when it is so for the
+ * first time, mustache_process() builds (and keeps in the template) a copy of
+ * the code which indents the lines. With this flag, the copy is built already
+ * by mustache_compile() (or mustache_link()). Use it for templates which are
+ * processed by multiple threads at the same time and may be indented
+ * partials, as building the copy modifies the template.
+ */
+#define MUSTACHE_FLAG_COMPACT               0x0001
+#define MUSTACHE_FLAG_NOOPTIMIZE            0x0002
+#define MUSTACHE_FLAG_CSE                   0x0004
+#define MUSTACHE_FLAG_INDENTCOPY            0x0008
+
+
+/**
+ * Flags for mustache_processor_create().
+ *
+ * MUSTACHE_PROCESSOR_FLAG_MEMO: Memoize the name lookups in the lookup context.
+ * When a name is not a member of the current item of a section, the lookup
+ * asks each outer context in turn and, without the flag, it does so again for
+ * every item of the section. With the flag, the processor remembers the
+ * results of MUSTACHE_DATAPROVIDER::get_child_by_name() (or of
+ * get_child_by_symbol()) for the nodes forming the context, as long as they
+ * stay in the context. This relies on the data tree being immutable during
+ * the processing.
+ *
+ * MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS: Keep the partials, as returned by
+ * MUSTACHE_DATAPROVIDER::get_partial(), cached across the calls of
+ * mustache_process_ex(). (By default, the processor remembers the partials
+ * only during each call of mustache_process_ex().) With the
+ * flag, the application has to call mustache_processor_invalidate_partials()
+ * whenever get_partial() might return a different template than before for
+ * any partial tag, and also before releasing any template the processor has
+ * processed.
+ */
+#define MUSTACHE_PROCESSOR_FLAG_MEMO        0x0001
+#define MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS 0x0002
+
+
 typedef struct MUSTACHE_PARSER {
     void (*parse_error)(int /*err_code*/, const char* /*msg*/,
                         unsigned /*line*/, unsigned /*column*/, void* /*parser_data*/);
@@ -78,9 +143,78 @@ typedef struct MUSTACHE_RENDERER {
      * as out_verbatim.
      */
     int (*out_escaped)(const char* /*output*/, size_t /*size*/, void* /*renderer_data*/);
+
+    /**
+     * Optional. If not NULL, it is called instead of out_verbatim() to output
+     * the literal text of the template. Unlike with out_verbatim(), the
+     * output stays valid for the lifetime of the template (it points into
+     * the compiled template), so the implementation may keep just the
+     * pointer instead of copying the text.
+     *
+     * Non-zero return value aborts mustache_process().
+     */
+    int (*out_literal)(const char* /*output*/, size_t /*size*/, void* /*renderer_data*/);
 } MUSTACHE_RENDERER;
 
 
+/**
+ * A symbol, i.e. a name used in a compiled template.
+ *
+ * When compiling a template, all names it uses (i.e. all the tokens of the
+ * dotted names like "a.b.c") are interned into a symbol table of the template.
+ * The data provider may then get the symbol (see
+ * MUSTACHE_DATAPROVIDER::get_child_by_symbol()) instead of just the name, so it
+ * may switch on the symbol ID, or use the precomputed hash for its lookup
+ * instead of hashing the name again and again.
+ *
+ * The symbol IDs are dense (from zero to the count of symbols minus one) but
+ * each template (including the partials) has its own symbol table. Use
+ * mustache_template_symbol() to get the ID of a name in a given template.
+ */
+typedef struct MUSTACHE_SYMBOL {
+    const char* name;           /**< The name (also zero-terminated). */
+    size_t size;                /**< Length of the name. */
+    unsigned hash;              /**< Hash of the name, as per mustache_hash(). */
+    unsigned id;                /**< ID of the symbol. */
+} MUSTACHE_SYMBOL;
+
+
+/**
+ * Types of the scalar values (see MUSTACHE_SCALAR).
+ */
+#define MUSTACHE_SCALAR_BOOL                1
+#define MUSTACHE_SCALAR_INT64               2
+#define MUSTACHE_SCALAR_UINT64              3
+#define MUSTACHE_SCALAR_DOUBLE              4
+
+/**
+ * A typed scalar value, as reported by MUSTACHE_DATAPROVIDER::get_scalar().
+ *
+ * When output, booleans are formatted as "true" or "false", integers in the
+ * decimal notation, and doubles as the shortest string (of the "%.15g",
+ * "%.16g" and "%.17g" formats) which reads back as the same value.
+ */
+typedef struct MUSTACHE_SCALAR {
+    unsigned type;      /* MUSTACHE_SCALAR_xxx */
+    union {
+        int b;
+        int64_t i64;
+        uint64_t u64;
+        double d;
+    } value;
+} MUSTACHE_SCALAR;
+
+
+/**
+ * Flags for MUSTACHE_DATAPROVIDER::get_string().
+ *
+ * MUSTACHE_STRING_SAFE: The string needs no escaping (e.g. it has been
+ * escaped already when stored into the data), so it is output verbatim even
+ * by `{{...}}`.
+ */
+#define MUSTACHE_STRING_SAFE                0x0001
+
+
 /**
  * An interface the application has to implement, in order to feed
  * mustache_process() with data the template asks for.
@@ -153,9 +287,204 @@ typedef struct MUSTACHE_DATAPROVIDER {
      */
     MUSTACHE_TEMPLATE* (*get_partial)(const char* /*name*/, size_t /*size*/,
                                       void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called instead of get_child_by_name().
+     *
+     * Same as get_child_by_name(), except that the name is provided as
+     * a symbol of the template being processed (see MUSTACHE_SYMBOL).
+     */
+    void* (*get_child_by_symbol)(void* /*node*/, const MUSTACHE_SYMBOL* /*sym*/,
+                                 void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, mustache_process() iterates over the lists via
+     * iter_begin(), iter_next() and iter_end() instead of calling
+     * get_child_by_index() with growing index. This is useful if the data
+     * are not random-access (e.g. linked lists, database cursors or
+     * generators) and getting an item by its index would be slow.
+     *
+     * iter_begin() is called to start iterating over the given node. It may
+     * store any iterator state into *p_iter, and it returns the first item,
+     * or NULL if there is none.
+     *
+     * Accordingly to the mustache specification, single values (except
+     * FALSE, NULL, or empty lists) have to be iterable too (see
+     * get_child_by_index()).
+     *
+     * Note the iterator is not used to decide whether the node is truthy:
+     * Unless is_truthy() or get_length() is provided, get_child_by_index()
+     * is still asked for the item at index 0.
+     */
+    void* (*iter_begin)(void* /*node*/, void** /*p_iter*/, void* /*provider_data*/);
+
+    /**
+     * Required if iter_begin is set. Called to get the next item of the
+     * iteration, or NULL if there is none. It may update the iterator state.
+     */
+    void* (*iter_next)(void* /*node*/, void** /*p_iter*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called exactly once for each call of
+     * iter_begin(), when the iteration finishes (including when the items
+     * are exhausted, or when mustache_process() fails), so that any resources
+     * held by the iterator state may be released.
+     */
+    void (*iter_end)(void* /*node*/, void* /*iter*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called to decide whether an inverted
+     * section `{{^name}}` is skipped, and whether a section `{{#name}}` is
+     * rendered at all, instead of probing for the first item of the node
+     * with get_child_by_index().
+     *
+     * Returns non-zero if the node is truthy, i.e. if it is neither FALSE,
+     * NULL nor an empty list.
+     */
+    int (*is_truthy)(void* /*node*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called to get the count of items a section
+     * for the node iterates over: For lists, it is their length; for other
+     * truthy values 1; for falsy values 0.
+     *
+     * Unless is_truthy() is provided too, it is then used to decide whether
+     * the node is truthy. When iterating with get_child_by_index(), the
+     * iteration stops after the given count of items, without asking for
+     * the item past the end.
+     */
+    size_t (*get_length)(void* /*node*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL (and if the iterator callbacks are not provided),
+     * mustache_process() iterates over the lists by fetching a window of
+     * items at once with this callback, instead of calling
+     * get_child_by_index() for each item.
+     *
+     * The callback stores up to max items, starting with the item of the
+     * given index, into the array out, and returns the count of the stored
+     * items. It may store less items than asked for (e.g. to fetch rows of
+     * a database in its own batches), but zero is understood as the end of
+     * the list.
+     *
+     * Single values are iterable the same way as with get_child_by_index().
+     */
+    unsigned (*get_children)(void* /*node*/, unsigned /*start*/, void** /*out*/,
+                             unsigned /*max*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, mustache_process() caches how the names are
+     * looked up in the nodes of the same "shape", i.e. of the same layout
+     * (e.g. instances of the same C structure, or JSON objects with the same
+     * keys in the same order).
+     *
+     * get_shape() is called to get an opaque identifier of the node's shape.
+     * It may return NULL for nodes without any fixed layout; get_child_by_name()
+     * (or get_child_by_symbol()) is then used for them as usual.
+     *
+     * The shape identifier has to stay valid (and refer to the same layout)
+     * at least for the duration of the mustache_process() call.
+     */
+    const void* (*get_shape)(void* /*node*/, void* /*provider_data*/);
+
+    /**
+     * Required if get_shape is set. Called (once per each place in the
+     * template where the name is used, and per each shape seen there) to get
+     * the index of the child for the symbol in all nodes of the shape, or -1
+     * if such nodes have no such child.
+     */
+    int (*get_shape_slot)(const void* /*shape*/, const MUSTACHE_SYMBOL* /*sym*/,
+                          void* /*provider_data*/);
+
+    /**
+     * Required if get_shape is set. Called to get the child of the node at
+     * the index as returned by get_shape_slot(). The same as with
+     * get_child_by_name(), it may return NULL.
+     */
+    void* (*get_child_by_slot)(void* /*node*/, int /*slot*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called to resolve the rest of a dotted name
+     * (e.g. "b.c.d" of `{{a.b.c.d}}`) at once, once the node for the first name
+     * has been found in the lookup context, instead of calling
+     * get_child_by_name() (or get_child_by_symbol()) for each of the names.
+     *
+     * The path is an array of n symbols (see MUSTACHE_SYMBOL). It stays valid
+     * for the lifetime of the template.
+     *
+     * Returns the node, or NULL if there is no such node.
+     */
+    void* (*get_child_by_path)(void* /*node*/, const MUSTACHE_SYMBOL* const* /*path*/,
+                               unsigned /*n*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called instead of dump() to get the string
+     * value of the node, which mustache_process() then passes to the renderer
+     * (and escapes it, if desired) on its own.
+     *
+     * The callback stores the pointer to the string into *p_str and its size
+     * into *p_size. The string has to stay valid until the next call of any
+     * callback of the data provider. It may also set *p_flags (which is zero
+     * on the entry) to a combination of the MUSTACHE_STRING_xxx flags.
+     *
+     * Returns zero on success. Non-zero return value means the node has no
+     * such string value and dump() is called for it as usual.
+     */
+    int (*get_string)(void* /*node*/, const char** /*p_str*/, size_t* /*p_size*/,
+                      unsigned* /*p_flags*/, void* /*provider_data*/);
+
+    /**
+     * Optional. If not NULL, it is called (after get_string(), if that one is
+     * provided too and fails) to get the node as a typed scalar value, which
+     * mustache_process() then formats and outputs on its own (see
+     * MUSTACHE_SCALAR). This saves the data provider from formatting numbers
+     * in dump().
+     *
+     * Returns zero on success. Non-zero return value means the node is not
+     * a scalar and dump() is called for it as usual. (So it is also for
+     * a scalar of an unknown type.)
+     */
+    int (*get_scalar)(void* /*node*/, MUSTACHE_SCALAR* /*scalar*/,
+                      void* /*provider_data*/);
 } MUSTACHE_DATAPROVIDER;
 
 
+/**
+ * An interface the application may implement, in order to provide its own
+ * memory management (e.g. an arena or a per-tenant heap) to Mustache4C.
+ *
+ * When used, all memory Mustache4C allocates for the given template (or for
+ * the given processor) is managed via these callbacks.
+ *
+ * The structure has to stay valid for whole lifetime of all templates and
+ * processors using it.
+ */
+typedef struct MUSTACHE_ALLOCATOR {
+    /**
+     * Called to allocate a memory block of the given size. Returns NULL
+     * on failure.
+     */
+    void* (*mem_alloc)(size_t /*size*/, void* /*allocator_data*/);
+
+    /**
+     * Called to resize the memory block previously allocated with mem_alloc()
+     * or mem_realloc(). Returns NULL on failure (and the original block then
+     * stays valid).
+     *
+     * Unlike the standard realloc(), the pointer is never NULL, and the old
+     * size is provided so that also simple bump allocators can implement it.
+     */
+    void* (*mem_realloc)(void* /*ptr*/, size_t /*old_size*/, size_t /*new_size*/,
+                         void* /*allocator_data*/);
+
+    /**
+     * Called to free the memory block. The pointer is never NULL. The size of
+     * the block is provided for allocators which can take advantage of it.
+     */
+    void (*mem_free)(void* /*ptr*/, size_t /*size*/, void* /*allocator_data*/);
+} MUSTACHE_ALLOCATOR;
+
+
 /**
  * Compile template text into a form suitable for mustache_process().
  *
@@ -167,13 +496,131 @@ typedef struct MUSTACHE_DATAPROVIDER {
  * @param templ_size Length of the template text.
  * @param parser Pointer to structure with parser callbacks. May be @c NULL.
  * @param parser_data Pointer just propagated into the parser callbacks.
- * @param flags Unused, use zero.
+ * @param flags Bitmask of @c MUSTACHE_FLAG_xxx flags, or zero.
  * @return Pointer to the compiled template, or @c NULL on an error.
  */
 MUSTACHE_TEMPLATE* mustache_compile(const char* templ_data, size_t templ_size,
                                     const MUSTACHE_PARSER* parser, void* parser_data,
                                     unsigned flags);
 
+/**
+ * Same as @c mustache_compile(), but with custom memory management.
+ *
+ * The allocator is used also for releasing the template, and for processing
+ * it with @c mustache_process().
+ *
+ * @param templ_data Text of the template.
+ * @param templ_size Length of the template text.
+ * @param parser Pointer to structure with parser callbacks. May be @c NULL.
+ * @param parser_data Pointer just propagated into the parser callbacks.
+ * @param allocator Pointer to structure with allocator callbacks. May be
+ * @c NULL (then the standard malloc(), realloc() and free() are used).
+ * @param allocator_data Pointer just propagated into the allocator callbacks.
+ * @param flags Bitmask of @c MUSTACHE_FLAG_xxx flags, or zero.
+ * @return Pointer to the compiled template, or @c NULL on an error.
+ */
+MUSTACHE_TEMPLATE* mustache_compile_ex(const char* templ_data, size_t templ_size,
+                                       const MUSTACHE_PARSER* parser, void* parser_data,
+                                       const MUSTACHE_ALLOCATOR* allocator, void* allocator_data,
+                                       unsigned flags);
+
+/**
+ * An interface the application has to implement, in order to provide
+ * partials to @c mustache_link().
+ */
+typedef struct MUSTACHE_LINKER {
+    /**
+     * Called to get a partial template of the given name. The same as
+     * MUSTACHE_DATAPROVIDER::get_partial(), it returns the template handle,
+     * or NULL if there is no such partial. The template has to stay valid
+     * until @c mustache_link() returns.
+     */
+    MUSTACHE_TEMPLATE* (*get_partial)(const char* /*name*/, size_t /*size*/,
+                                      void* /*linker_data*/);
+} MUSTACHE_LINKER;
+
+/**
+ * Link the partials into the template, i.e. create a new template with the
+ * partials' code inlined in place of the partial tags, so that processing it
+ * does not need to look up and switch to the partials. The partials included
+ * by the inlined partials are linked recursively, and the standalone
+ * indentation of the partials is baked into the inlined code.
+ *
+ * A partial tag stays a dynamic one (i.e. @c mustache_process() asks
+ * MUSTACHE_DATAPROVIDER::get_partial() for it as usual) if the linker does
+ * not know the partial, if the partial is recursive (directly or via other
+ * partials), or if it is bigger than @c max_inline_size.
+ *
+ * The new template has the same flags and allocator as @c t, and it does not
+ * refer to @c t or to any of the partials: All of them may be released once
+ * the function returns.
+ *
+ * @param t The template.
+ * @param linker Pointer to structure with linker callbacks.
+ * @param linker_data Pointer just propagated into the linker callbacks.
+ * @param max_inline_size Maximal size of a partial's compiled code (in bytes,
+ * see MUSTACHE_TEMPLATE_INFO::insns_size) to inline. Use @c SIZE_MAX to inline
+ * all partials but the recursive ones.
+ * @return Pointer to the linked template (to be released with
+ * @c mustache_release()), or @c NULL on an error.
+ */
+MUSTACHE_TEMPLATE* mustache_link(const MUSTACHE_TEMPLATE* t,
+                                 const MUSTACHE_LINKER* linker, void* linker_data,
+                                 size_t max_inline_size);
+
+/**
+ * Information about a compiled template, as provided by
+ * @c mustache_template_info().
+ */
+typedef struct MUSTACHE_TEMPLATE_INFO {
+    size_t insns_size;          /**< Size of the compiled code (in bytes). */
+    size_t insns_indent_size;   /**< Size of the copy of the code for processing
+                                     as an indented partial (in bytes; zero if
+                                     it has not been built, or if it is not
+                                     needed). */
+    unsigned n_insns;           /**< Count of the compiled instructions. */
+    unsigned n_insns_saved;     /**< Count of instructions saved by the optimizer. */
+    unsigned n_symbols;         /**< Count of symbols, i.e. of distinct names. */
+    unsigned n_resolves_reused; /**< Count of name resolutions replaced with
+                                     reusing an earlier result (see
+                                     @c MUSTACHE_FLAG_CSE). */
+} MUSTACHE_TEMPLATE_INFO;
+
+/**
+ * Get information about the compiled template.
+ *
+ * @param t The template.
+ * @param info Pointer to a structure to fill.
+ */
+void mustache_template_info(const MUSTACHE_TEMPLATE* t, MUSTACHE_TEMPLATE_INFO* info);
+
+/**
+ * Find the symbol of the given name in the template's symbol table.
+ *
+ * Note the function does a linear search. It is meant for an application
+ * which wants to prepare some mapping from the symbol IDs of the template
+ * to its own data, not to be called during the processing.
+ *
+ * @param t The template.
+ * @param name The name.
+ * @param size Length of the name.
+ * @return Pointer to the symbol, or @c NULL if the template does not use
+ * the name. The pointer stays valid for the lifetime of the template.
+ */
+const MUSTACHE_SYMBOL* mustache_template_symbol(const MUSTACHE_TEMPLATE* t,
+                                                const char* name, size_t size);
+
+/**
+ * Compute the hash of the name, the same way as the compiler computes
+ * MUSTACHE_SYMBOL::hash. An application may use it e.g. to precompute the
+ * hashes of its own keys.
+ *
+ * @param name The name.
+ * @param size Length of the name.
+ * @return The hash.
+ */
+unsigned mustache_hash(const char* name, size_t size);
+
 /**
  * Release the template compiled with @c mustache_compile().
  *
@@ -204,6 +651,383 @@ int mustache_process(const MUSTACHE_TEMPLATE* t,
                      const MUSTACHE_RENDERER* renderer, void* renderer_data,
                      const MUSTACHE_DATAPROVIDER* provider, void* provider_data);
 
+/**
+ * Create a processor, i.e. a reusable context for @c mustache_process_ex().
+ *
+ * The processor keeps its internal stacks between the calls so, once it is
+ * warmed up, processing templates without partials does not allocate any
+ * memory. Typically, an application creates one processor per thread and
+ * uses it for all its processing.
+ *
+ * The processor must not be used by multiple threads at the same time.
+ *
+ * @param flags Bitmask of @c MUSTACHE_PROCESSOR_FLAG_xxx flags, or zero.
+ * @return Pointer to the processor, or @c NULL on an error.
+ */
+MUSTACHE_PROCESSOR* mustache_processor_create(unsigned flags);
+
+/**
+ * Same as @c mustache_processor_create(), but with custom memory management.
+ *
+ * All memory the processor needs, including its stacks, is then allocated
+ * via the allocator. E.g. an application may create the processor on top of
+ * an arena, process a template, and then drop all the memory in one step.
+ *
+ * @param allocator Pointer to structure with allocator callbacks. May be
+ * @c NULL.
+ * @param allocator_data Pointer just propagated into the allocator callbacks.
+ * @param flags Bitmask of @c MUSTACHE_PROCESSOR_FLAG_xxx flags, or zero.
+ * @return Pointer to the processor, or @c NULL on an error.
+ */
+MUSTACHE_PROCESSOR* mustache_processor_create_ex(const MUSTACHE_ALLOCATOR* allocator,
+                                                 void* allocator_data, unsigned flags);
+
+/**
+ * Statistics of the last processing, as provided by
+ * @c mustache_processor_stats().
+ */
+typedef struct MUSTACHE_PROCESSOR_STATS {
+    unsigned n_memo_hits;       /**< Count of data provider calls avoided
+                                     thanks to @c MUSTACHE_PROCESSOR_FLAG_MEMO. */
+    unsigned n_pic_hits;        /**< Count of name lookups answered from the
+                                     cache of the node shapes (see
+                                     MUSTACHE_DATAPROVIDER::get_shape()). */
+    unsigned n_partial_hits;    /**< Count of partials taken from the cache
+                                     instead of calling
+                                     MUSTACHE_DATAPROVIDER::get_partial(). */
+} MUSTACHE_PROCESSOR_STATS;
+
+/**
+ * Get statistics of the last call of @c mustache_process_ex() with the
+ * processor.
+ *
+ * @param processor The processor.
+ * @param stats Pointer to a structure to fill.
+ */
+void mustache_processor_stats(const MUSTACHE_PROCESSOR* processor,
+                              MUSTACHE_PROCESSOR_STATS* stats);
+
+/**
+ * Forget all the partials cached by the processor. This is needed only if the
+ * processor has been created with @c MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS.
+ *
+ * @param processor The processor.
+ */
+void mustache_processor_invalidate_partials(MUSTACHE_PROCESSOR* processor);
+
+/**
+ * Release the processor created with @c mustache_processor_create().
+ *
+ * @param processor The processor.
+ */
+void mustache_processor_release(MUSTACHE_PROCESSOR* processor);
+
+/**
+ * Process the template, using the given processor.
+ *
+ * Same as @c mustache_process(), except that memory held by the processor
+ * is reused instead of allocating (and freeing) new one.
+ *
+ * @param processor The processor.
+ * @param t The template.
+ * @param renderer Pointer to structure with output callbacks.
+ * @param renderer_data Pointer just propagated to the output callbacks.
+ * @param provider Pointer to structure with data-providing callbacks.
+ * @param provider_data Pointer just propagated to the data-providing callbacks.
+ * @return Zero on success, non-zero on failure.
+ */
+int mustache_process_ex(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                        const MUSTACHE_RENDERER* renderer, void* renderer_data,
+                        const MUSTACHE_DATAPROVIDER* provider, void* provider_data);
+
+/**
+ * Return value of @c mustache_process_step() when the buffer is full and the
+ * processing is to be resumed with another call.
+ */
+#define MUSTACHE_WOULDBLOCK                 1
+
+/**
+ * Start processing of the template step by step, i.e. in a resumable way.
+ * Instead of passing the output to a renderer, each call of
+ * @c mustache_process_step() then fills a buffer provided by the application,
+ * and the processing is suspended whenever the buffer gets full. This allows
+ * to stream the output e.g. into a non-blocking socket from an event loop,
+ * with no thread dedicated to the processing and with bounded memory.
+ *
+ * Between the steps, the whole state of the processing lives in the
+ * processor, so it cannot be used for anything else until the processing
+ * finishes (or until @c mustache_process_abort() is called). The template
+ * (including the partials) and the data have to stay alive and unchanged
+ * until then.
+ *
+ * @param processor The processor.
+ * @param t The template.
+ * @param escape Escaping of the escaped output (@c MUSTACHE_ESCAPE_xxx).
+ * @param provider Pointer to structure with data-providing callbacks.
+ * @param provider_data Pointer just propagated to the data-providing callbacks.
+ * @return Zero on success, non-zero on failure.
+ */
+int mustache_process_begin(MUSTACHE_PROCESSOR* processor, const MUSTACHE_TEMPLATE* t,
+                           unsigned escape,
+                           const MUSTACHE_DATAPROVIDER* provider, void* provider_data);
+
+/**
+ * Continue the processing started with @c mustache_process_begin() until the
+ * buffer gets full.
+ *
+ * The processing is suspended only between the instructions of the compiled
+ * template. If an output does not fit into the buffer, the rest of a literal
+ * text is remembered as a reference into the template; the rest of anything
+ * else (e.g. of a value) is kept in a side buffer of the processor. Either is
+ * written at the start of the next step.
+ *
+ * @param processor The processor.
+ * @param buf The buffer.
+ * @param size Size of the buffer. Must not be zero (the call then fails).
+ * @param p_size Receives the count of bytes stored into the buffer.
+ * @return Zero if the processing has finished (and all its output has been
+ * stored), @c MUSTACHE_WOULDBLOCK if the buffer is full and this is to be
+ * called again, or -1 on failure (the processing is then aborted).
+ */
+int mustache_process_step(MUSTACHE_PROCESSOR* processor, char* buf, size_t size,
+                          size_t* p_size);
+
+/**
+ * Abort the processing started with @c mustache_process_begin() before it has
+ * finished. (Any iterations in progress are ended, see
+ * MUSTACHE_DATAPROVIDER::iter_end().) It is not needed after
+ * @c mustache_process_step() has returned zero or -1.
+ *
+ * Starting another processing with the processor, or releasing it, aborts the
+ * unfinished one as well.
+ *
+ * @param processor The processor.
+ */
+void mustache_process_abort(MUSTACHE_PROCESSOR* processor);
+
+
+/**
+ * Escaping flavors for @c mustache_escape() and @c mustache_output_renderer_ex().
+ *
+ * MUSTACHE_ESCAPE_HTML: '&', '"', '<' and '>' are replaced with their entities
+ * (as the {{mustache}} specification mandates).
+ *
+ * MUSTACHE_ESCAPE_XML: Same as MUSTACHE_ESCAPE_HTML, and "'" is replaced with
+ * "&apos;".
+ *
+ * MUSTACHE_ESCAPE_JSON: '"', '\\' and the control characters are escaped as
+ * for a JSON string literal (e.g. "\n" or "\u001f").
+ *
+ * MUSTACHE_ESCAPE_URL: Percent-encoding (RFC 3986), i.e. all bytes except
+ * letters, digits, '-', '.', '_' and '~' are replaced with "%XX".
+ */
+#define MUSTACHE_ESCAPE_HTML                0
+#define MUSTACHE_ESCAPE_XML                 1
+#define MUSTACHE_ESCAPE_JSON                2
+#define MUSTACHE_ESCAPE_URL                 3
+
+/**
+ * Escape the given text and pass the result to the callback. The text which
+ * needs no escaping is passed through in runs as long as possible (the text
+ * is scanned with SIMD instructions when available), so it may serve as a
+ * building block for MUSTACHE_RENDERER::out_escaped() of the application:
+ *
+ * @code
+ * static int my_out_escaped(const char* output, size_t size, void* data)
+ * {
+ *     return mustache_escape(MUSTACHE_ESCAPE_HTML, output, size, my_out_verbatim, data);
+ * }
+ * @endcode
+ *
+ * @param escape The escaping flavor (@c MUSTACHE_ESCAPE_xxx).
+ * @param data The text to escape.
+ * @param size Size of the text.
+ * @param out The callback.
+ * @param out_data Pointer just propagated to the callback.
+ * @return Zero on success, non-zero if the callback has failed or if
+ * the @c escape is not known.
+ */
+int mustache_escape(unsigned escape, const char* data, size_t size,
+                    int (*out)(const char*, size_t, void*), void* out_data);
+
+
+/**
+ * Size of a buffer large enough for any formatted scalar value.
+ */
+#define MUSTACHE_SCALAR_BUFSIZE             32
+
+/**
+ * Format the scalar value the same way as @c mustache_process() does when
+ * it outputs it (see MUSTACHE_SCALAR).
+ *
+ * @param scalar The scalar value.
+ * @param buf Buffer of at least @c MUSTACHE_SCALAR_BUFSIZE bytes. The string
+ * is not zero-terminated.
+ * @return Length of the string, or zero if the type of the scalar is not
+ * known.
+ */
+size_t mustache_format_scalar(const MUSTACHE_SCALAR* scalar, char* buf);
+
+
+/**
+ * Default size of the buffer of @c MUSTACHE_OUTPUT.
+ */
+#define MUSTACHE_OUTPUT_DEFAULT_CHUNK       (64 * 1024)
+
+/**
+ * Default size of the arena of the gathering @c MUSTACHE_OUTPUT (see
+ * @c mustache_output_create_gather()).
+ */
+#define MUSTACHE_OUTPUT_DEFAULT_ARENA       (16 * 1024)
+
+/**
+ * Maximal count of pieces the gathering @c MUSTACHE_OUTPUT passes to its
+ * write callback at once.
+ */
+#define MUSTACHE_OUTPUT_MAX_IOV             1024
+
+/**
+ * A piece of the output, as collected by the gathering @c MUSTACHE_OUTPUT.
+ * (On POSIX systems, the layout is the same as of struct iovec.)
+ */
+typedef struct MUSTACHE_IOVEC {
+    const char* data;
+    size_t size;
+} MUSTACHE_IOVEC;
+
+/**
+ * Create a buffered output, i.e. a ready-made implementation of
+ * MUSTACHE_RENDERER (see @c mustache_output_renderer()) which accumulates the
+ * output of @c mustache_process() in a buffer and passes it to the
+ * application's write callback only when the buffer gets full (or when
+ * @c mustache_output_flush() is called). So instead of a callback for each
+ * piece of the template and each value, the application gets one for a whole
+ * chunk of the output.
+ *
+ * The escaped output is HTML-escaped (i.e. '&', '"', '<' and '>' are replaced
+ * with their entities) directly into the buffer, unless other escaping is
+ * selected with @c mustache_output_renderer_ex().
+ *
+ * @param chunk_size Size of the buffer, or zero for the default size
+ * (@c MUSTACHE_OUTPUT_DEFAULT_CHUNK).
+ * @param write The write callback. It gets the data, their size and the
+ * @c write_data. Non-zero return value aborts @c mustache_process().
+ * @param write_data Pointer just propagated to the write callback.
+ * @return Pointer to the output, or @c NULL on an error.
+ */
+MUSTACHE_OUTPUT* mustache_output_create(size_t chunk_size,
+                                        int (*write)(const char*, size_t, void*),
+                                        void* write_data);
+
+/**
+ * Same as @c mustache_output_create(), but with custom memory management.
+ *
+ * @param chunk_size Size of the buffer, or zero for the default size.
+ * @param write The write callback.
+ * @param write_data Pointer just propagated to the write callback.
+ * @param allocator Pointer to structure with allocator callbacks. May be
+ * @c NULL (then the standard malloc(), realloc() and free() are used).
+ * @param allocator_data Pointer just propagated into the allocator callbacks.
+ * @return Pointer to the output, or @c NULL on an error.
+ */
+MUSTACHE_OUTPUT* mustache_output_create_ex(size_t chunk_size,
+                                           int (*write)(const char*, size_t, void*),
+                                           void* write_data,
+                                           const MUSTACHE_ALLOCATOR* allocator,
+                                           void* allocator_data);
+
+/**
+ * Create a gathering output, i.e. a variant of the buffered output (see
+ * @c mustache_output_create()) which avoids copying the literal text of the
+ * template.
+ *
+ * The output is collected as a list of pieces. The literals are referred to
+ * in place, i.e. in the memory of the compiled template, and only the other
+ * output (the dumped values, the escaped output and the indentation) is
+ * copied into a side buffer, the arena. The list is passed to the write
+ * callback when it has @c MUSTACHE_OUTPUT_MAX_IOV pieces, when the pieces
+ * amount to @c MUSTACHE_OUTPUT_DEFAULT_CHUNK bytes, when the arena gets full,
+ * or when @c mustache_output_flush() is called.
+ *
+ * Note the templates (including the partials) have to stay alive until the
+ * output is flushed.
+ *
+ * @param arena_size Size of the arena, or zero for the default size
+ * (@c MUSTACHE_OUTPUT_DEFAULT_ARENA).
+ * @param write_gather The write callback. It gets the array of the pieces,
+ * their count and the @c write_data. Non-zero return value aborts
+ * @c mustache_process().
+ * @param write_data Pointer just propagated to the write callback.
+ * @return Pointer to the output, or @c NULL on an error.
+ */
+MUSTACHE_OUTPUT* mustache_output_create_gather(size_t arena_size,
+                        int (*write_gather)(const MUSTACHE_IOVEC*, unsigned, void*),
+                        void* write_data);
+
+/**
+ * Same as @c mustache_output_create_gather(), but with custom memory
+ * management.
+ *
+ * @param arena_size Size of the arena, or zero for the default size.
+ * @param write_gather The write callback.
+ * @param write_data Pointer just propagated to the write callback.
+ * @param allocator Pointer to structure with allocator callbacks. May be
+ * @c NULL (then the standard malloc(), realloc() and free() are used).
+ * @param allocator_data Pointer just propagated into the allocator callbacks.
+ * @return Pointer to the output, or @c NULL on an error.
+ */
+MUSTACHE_OUTPUT* mustache_output_create_gather_ex(size_t arena_size,
+                        int (*write_gather)(const MUSTACHE_IOVEC*, unsigned, void*),
+                        void* write_data,
+                        const MUSTACHE_ALLOCATOR* allocator, void* allocator_data);
+
+#ifndef _WIN32
+/**
+ * Create a gathering output (see @c mustache_output_create_gather()) writing
+ * into the file descriptor with writev(). The file descriptor should be in
+ * the blocking mode.
+ *
+ * @param fd The file descriptor.
+ * @param arena_size Size of the arena, or zero for the default size.
+ * @return Pointer to the output, or @c NULL on an error.
+ */
+MUSTACHE_OUTPUT* mustache_output_create_fd(int fd, size_t arena_size);
+#endif
+
+/**
+ * Get the renderer writing into a buffered output. Pass it to
+ * @c mustache_process() together with the output as the @c renderer_data.
+ *
+ * @return Pointer to the renderer.
+ */
+const MUSTACHE_RENDERER* mustache_output_renderer(void);
+
+/**
+ * Same as @c mustache_output_renderer(), but with the given escaping of the
+ * escaped output. Different renders may use different renderers with the
+ * same output.
+ *
+ * @param escape The escaping flavor (@c MUSTACHE_ESCAPE_xxx).
+ * @return Pointer to the renderer, or @c NULL if the @c escape is not known.
+ */
+const MUSTACHE_RENDERER* mustache_output_renderer_ex(unsigned escape);
+
+/**
+ * Pass all the buffered data to the write callback. Call it after the last
+ * @c mustache_process() using the output.
+ *
+ * @param output The output.
+ * @return Zero on success, non-zero if the write callback has failed.
+ */
+int mustache_output_flush(MUSTACHE_OUTPUT* output);
+
+/**
+ * Release the output created with @c mustache_output_create(). Note any
+ * data still in the buffer are discarded.
+ *
+ * @param output The output.
+ */
+void mustache_output_release(MUSTACHE_OUTPUT* output);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1406 @@
+#include "mustache.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+    #include <sys/uio.h>    /* for writev() */
+#endif
+
+
+/************************
+ *** Helper utilities ***
+ ************************/
+
+typedef struct TEXT {
+    char* data;
+    size_t n;
+    size_t alloc;
+} TEXT;
+
+static void
+text_append(TEXT* text, const char* str, size_t n)
+{
+    if(text->n + n > text->alloc) {
+        text->alloc = (text->n + n) * 2;
+        text->data = (char*) realloc(text->data, text->alloc);
+        if(text->data == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    memcpy(text->data + text->n, str, n);
+    text->n += n;
+}
+
+static void
+text_append_str(TEXT* text, const char* str)
+{
+    text_append(text, str, strlen(str));
+}
+
+static void
+text_free(TEXT* text)
+{
+    free(text->data);
+}
+
+static double
+now(void)
+{
+    return (double) clock() / (double) CLOCKS_PER_SEC;
+}
+
+static void
+parse_error(int err_code, const char* msg, unsigned line, unsigned col, void* data)
+{
+    fprintf(stderr, "Error: %u:%u: %s\n", line, col, msg);
+}
+
+static const MUSTACHE_PARSER parser = {
+    parse_error
+};
+
+
+
+/*****************************
+ *** Simple data hierarchy ***
+ *****************************/
+
+typedef struct NODE NODE;
+struct NODE {
+    const char* key;        /* Name of the node in its parent object. */
+    unsigned key_hash;      /* mustache_hash() of the key. */
+    const char* str;        /* Value of a string (for other nodes NULL). */
+    int is_array;
+    NODE** children;
+    unsigned n_children;
+    NODE* shape;            /* Node with the same keys in the same order, or NULL. */
+};
+
+static NODE*
+node_new(NODE* parent, const char* key, const char* str, int is_array)
+{
+    NODE* node = (NODE*) calloc(1, sizeof(NODE));
+
+    node->key = key;
+    if(key != NULL)
+        node->key_hash = mustache_hash(key, strlen(key));
+    node->str = str;
+    node->is_array = is_array;
+
+    if(parent != NULL) {
+        parent->children = (NODE**) realloc(parent->children,
+                    (parent->n_children + 1) * sizeof(NODE*));
+        parent->children[parent->n_children++] = node;
+    }
+    return node;
+}
+
+static void
+node_free(NODE* node)
+{
+    unsigned i;
+
+    for(i = 0; i < node->n_children; i++)
+        node_free(node->children[i]);
+    free(node->children);
+    free(node);
+}
+
+static int
+dump(void* node, int (*out_fn)(const char*, size_t, void*), void* renderer_data, void* data)
+{
+    NODE* n = (NODE*) node;
+
+    if(n->str != NULL)
+        return out_fn(n->str, strlen(n->str), renderer_data);
+    return 0;
+}
+
+static void*
+get_root(void* data)
+{
+    return data;
+}
+
+static void*
+get_named(void* node, const char* name, size_t size, void* data)
+{
+    NODE* n = (NODE*) node;
+    unsigned i;
+
+    if(n->is_array)
+        return NULL;
+
+    for(i = 0; i < n->n_children; i++) {
+        if(strncmp(n->children[i]->key, name, size) == 0  &&  n->children[i]->key[size] == '\0')
+            return n->children[i];
+    }
+    return NULL;
+}
+
+static void*
+get_indexed(void* node, unsigned index, void* data)
+{
+    NODE* n = (NODE*) node;
+
+    if(!n->is_array)
+        return (index == 0) ? n : NULL;
+    return (index < n->n_children) ? n->children[index] : NULL;
+}
+
+static MUSTACHE_TEMPLATE*
+get_partial(const char* name, size_t size, void* data)
+{
+    return NULL;
+}
+
+static void*
+get_by_symbol(void* node, const MUSTACHE_SYMBOL* sym, void* data)
+{
+    NODE* n = (NODE*) node;
+    unsigned i;
+
+    if(n->is_array)
+        return NULL;
+
+    for(i = 0; i < n->n_children; i++) {
+        if(n->children[i]->key_hash == sym->hash  &&  strcmp(n->children[i]->key, sym->name) == 0)
+            return n->children[i];
+    }
+    return NULL;
+}
+
+/* Provider of the same data as if stored in linked lists: Getting an item by
+ * its index has to walk the list from its head, but an iterator can just
+ * remember where it is. */
+static void*
+get_indexed_linked(void* node, unsigned index, void* data)
+{
+    NODE* n = (NODE*) node;
+    NODE* item = NULL;
+    unsigned i;
+
+    if(!n->is_array)
+        return (index == 0) ? n : NULL;
+
+    for(i = 0; i <= index  &&  i < n->n_children; i++)
+        item = *(NODE* volatile*) &n->children[i];
+    return (index < n->n_children) ? item : NULL;
+}
+
+static void*
+iter_begin_linked(void* node, void** p_iter, void* data)
+{
+    NODE* n = (NODE*) node;
+
+    *p_iter = NULL;
+    if(!n->is_array)
+        return n;
+    *p_iter = n->children;
+    return (n->n_children > 0) ? n->children[0] : NULL;
+}
+
+static void*
+iter_next_linked(void* node, void** p_iter, void* data)
+{
+    NODE* n = (NODE*) node;
+    NODE** pos = (NODE**) *p_iter;
+
+    if(pos == NULL  ||  pos + 1 >= n->children + n->n_children)
+        return NULL;
+    *p_iter = pos + 1;
+    return pos[1];
+}
+
+static const MUSTACHE_DATAPROVIDER provider_linked = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed_linked,
+    get_partial
+};
+
+static const MUSTACHE_DATAPROVIDER provider_linked_iter = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed_linked,
+    get_partial,
+    NULL,
+    iter_begin_linked,
+    iter_next_linked,
+    NULL
+};
+
+static unsigned
+get_children(void* node, unsigned start, void** out, unsigned max, void* data)
+{
+    NODE* n = (NODE*) node;
+    unsigned i;
+
+    if(!n->is_array) {
+        if(start > 0  ||  max == 0)
+            return 0;
+        out[0] = n;
+        return 1;
+    }
+
+    for(i = 0; i < max  &&  start + i < n->n_children; i++)
+        out[i] = n->children[start + i];
+    return i;
+}
+
+static const MUSTACHE_DATAPROVIDER provider_batch = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    get_children
+};
+
+/* Provider of the same data, which exposes the shapes of the nodes. */
+static const void*
+get_shape(void* node, void* data)
+{
+    return ((NODE*) node)->shape;
+}
+
+static int
+get_shape_slot(const void* shape, const MUSTACHE_SYMBOL* sym, void* data)
+{
+    const NODE* n = (const NODE*) shape;
+    unsigned i;
+
+    for(i = 0; i < n->n_children; i++) {
+        if(n->children[i]->key_hash == sym->hash  &&  strcmp(n->children[i]->key, sym->name) == 0)
+            return (int) i;
+    }
+    return -1;
+}
+
+static void*
+get_child_by_slot(void* node, int slot, void* data)
+{
+    return ((NODE*) node)->children[slot];
+}
+
+static const MUSTACHE_DATAPROVIDER provider_shape = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    get_shape,
+    get_shape_slot,
+    get_child_by_slot
+};
+
+/* Provider resolving the dotted names at once. */
+static void*
+get_child_by_path(void* node, const MUSTACHE_SYMBOL* const* path, unsigned n, void* data)
+{
+    unsigned i;
+
+    for(i = 0; i < n  &&  node != NULL; i++)
+        node = get_by_symbol(node, path[i], data);
+    return node;
+}
+
+static const MUSTACHE_DATAPROVIDER provider_path = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    get_by_symbol,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    get_child_by_path
+};
+
+/* Provider with some partials, looked up by their names. */
+#define N_PARTIALS      16
+
+static char partial_names[N_PARTIALS][16];
+static MUSTACHE_TEMPLATE* partial_templates[N_PARTIALS];
+
+static MUSTACHE_TEMPLATE*
+get_partial_by_name(const char* name, size_t size, void* data)
+{
+    int i;
+
+    for(i = 0; i < N_PARTIALS; i++) {
+        if(strncmp(partial_names[i], name, size) == 0  &&  partial_names[i][size] == '\0')
+            return partial_templates[i];
+    }
+    return NULL;
+}
+
+static const MUSTACHE_DATAPROVIDER provider_partials = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial_by_name
+};
+
+static const MUSTACHE_LINKER linker_partials = {
+    get_partial_by_name
+};
+
+static const MUSTACHE_DATAPROVIDER provider = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial
+};
+
+static const MUSTACHE_DATAPROVIDER provider_sym = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    get_by_symbol
+};
+
+/* Provider passing the strings to the processor via get_string(). */
+static int
+get_string(void* node, const char** p_str, size_t* p_size, unsigned* p_flags, void* data)
+{
+    NODE* n = (NODE*) node;
+
+    if(n->str == NULL)
+        return -1;
+    *p_str = n->str;
+    *p_size = strlen(n->str);
+    return 0;
+}
+
+static const MUSTACHE_DATAPROVIDER provider_string = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    get_string
+};
+
+static int
+out(const char* output, size_t size, void* data)
+{
+    size_t* p_n = (size_t*) data;
+    *p_n += size;
+    return 0;
+}
+
+static const MUSTACHE_RENDERER renderer = {
+    out,
+    out
+};
+
+
+/* Compile the template repeatedly and report the throughput. */
+static void
+bench_compile(const char* desc, const TEXT* templ, int iterations)
+{
+    double t0, t1;
+    int i;
+
+    t0 = now();
+    for(i = 0; i < iterations; i++) {
+        MUSTACHE_TEMPLATE* t = mustache_compile(templ->data, templ->n, &parser, NULL, 0);
+        if(t == NULL) {
+            fprintf(stderr, "%s: Compilation failed.\n", desc);
+            exit(1);
+        }
+        mustache_release(t);
+    }
+    t1 = now();
+
+    printf("%-40s %8.2f MB  %8.3f ms/compile  %6.3f GB/s\n", desc,
+           (double) templ->n / (1024.0 * 1024.0),
+           (t1 - t0) * 1000.0 / iterations,
+           ((double) templ->n * iterations) / ((t1 - t0) * 1024.0 * 1024.0 * 1024.0));
+}
+
+/* Render the template repeatedly and report the time per render. If the
+ * processor is not NULL, it is used for all the renders. */
+static void
+bench_render_ex(const char* desc, const MUSTACHE_TEMPLATE* t,
+                const MUSTACHE_DATAPROVIDER* provider, NODE* root,
+                MUSTACHE_PROCESSOR* processor, int iterations)
+{
+    double t0, t1;
+    size_t n = 0;
+    int i, ret;
+
+    t0 = now();
+    for(i = 0; i < iterations; i++) {
+        if(processor != NULL)
+            ret = mustache_process_ex(processor, t, &renderer, &n, provider, root);
+        else
+            ret = mustache_process(t, &renderer, &n, provider, root);
+        if(ret != 0) {
+            fprintf(stderr, "%s: Processing failed.\n", desc);
+            exit(1);
+        }
+    }
+    t1 = now();
+
+    printf("%-40s %8.3f us/render  %8.1f MB/s\n", desc,
+           (t1 - t0) * 1000000.0 / iterations,
+           (double) n / ((t1 - t0) * 1024.0 * 1024.0));
+}
+
+static void
+bench_render(const char* desc, const MUSTACHE_TEMPLATE* t, NODE* root,
+             MUSTACHE_PROCESSOR* processor, int iterations)
+{
+    bench_render_ex(desc, t, &provider, root, processor, iterations);
+}
+
+/* Compile the template in all its variants and render each of them. */
+static void
+bench_render_variants(const char* desc, const char* templ, size_t size,
+                      NODE* root, int iterations)
+{
+    static const struct {
+        const char* name;
+        unsigned flags;
+    } variants[] = {
+        { "", 0 },
+        { " (compact)", MUSTACHE_FLAG_COMPACT },
+        { " (not optimized)", MUSTACHE_FLAG_NOOPTIMIZE },
+        { " (CSE)", MUSTACHE_FLAG_CSE },
+        { " (indent copy)", MUSTACHE_FLAG_INDENTCOPY }
+    };
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_TEMPLATE* t;
+    char buffer[256];
+    int i;
+
+    processor = mustache_processor_create(0);
+
+    for(i = 0; i < (int) (sizeof(variants) / sizeof(variants[0])); i++) {
+        MUSTACHE_TEMPLATE_INFO info;
+
+        t = mustache_compile(templ, size, &parser, NULL, variants[i].flags);
+        mustache_template_info(t, &info);
+
+        sprintf(buffer, "%s%s", desc, variants[i].name);
+        bench_render(buffer, t, root, processor, iterations);
+        printf("    %u instructions (%u saved), %u bytes (%u with indentation), %u resolves reused\n",
+               info.n_insns, info.n_insns_saved, (unsigned) info.insns_size,
+               (unsigned) info.insns_indent_size, info.n_resolves_reused);
+        mustache_release(t);
+    }
+
+    t = mustache_compile(templ, size, &parser, NULL, 0);
+    sprintf(buffer, "%s (get_child_by_symbol)", desc);
+    bench_render_ex(buffer, t, &provider_sym, root, processor, iterations);
+    mustache_release(t);
+
+    mustache_processor_release(processor);
+}
+
+
+/******************
+ *** Benchmarks ***
+ ******************/
+
+static const char lorem[] =
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor\n"
+    "incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis\n"
+    "nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.\n";
+
+/* Text-heavy template resembling a long e-mail or a report: mostly literal
+ * text sparsely interleaved with tags. */
+static void
+make_report_template(TEXT* templ, size_t size, const char* opener, const char* closer)
+{
+    char tag[128];
+
+    while(templ->n < size) {
+        text_append_str(templ, "<p>\n");
+        text_append_str(templ, lorem);
+        text_append_str(templ, lorem);
+        sprintf(tag, "Dear %sname%s, your balance is %s{balance}%s.\n", opener, closer, opener, closer);
+        text_append_str(templ, tag);
+        sprintf(tag, "%s#items%s\n  <li>%stitle%s: %s&price%s</li>\n%s/items%s\n",
+                opener, closer, opener, closer, opener, closer, opener, closer);
+        text_append_str(templ, tag);
+        text_append_str(templ, lorem);
+        sprintf(tag, "%s! This is a comment. %s\n", opener, closer);
+        text_append_str(templ, tag);
+        text_append_str(templ, "</p>\n");
+    }
+}
+
+static void
+bench_compile_report(void)
+{
+    TEXT templ = { 0 };
+
+    make_report_template(&templ, 8 * 1024 * 1024, "{{", "}}");
+    bench_compile("compile: report (default delimiters)", &templ, 20);
+    text_free(&templ);
+}
+
+static void
+bench_compile_report_delim(void)
+{
+    TEXT templ = { 0 };
+
+    /* Braces are no longer delimiters here, but '<' (the opener's first
+     * character) is very frequent in the HTML-like text. */
+    text_append_str(&templ, "{{=<% %>=}}\n");
+    make_report_template(&templ, 8 * 1024 * 1024, "<%", "%>");
+    bench_compile("compile: report (custom delimiters)", &templ, 20);
+    text_free(&templ);
+}
+
+static void
+bench_compile_tags(void)
+{
+    TEXT templ = { 0 };
+
+    /* Tag-dense template. */
+    while(templ.n < 4 * 1024 * 1024)
+        text_append_str(&templ, "<td>{{a}}</td><td>{{b.c}}</td><td>{{{d}}}</td>\n");
+    bench_compile("compile: tag-dense", &templ, 20);
+    text_free(&templ);
+}
+
+static void
+bench_compile_sibling_sections(void)
+{
+    TEXT templ = { 0 };
+    int i;
+
+    for(i = 0; i < 100000; i++)
+        text_append_str(&templ, "{{#a}}x{{/a}}{{^b}}y{{/b}}");
+    bench_compile("compile: 100k sibling sections", &templ, 5);
+    text_free(&templ);
+}
+
+static void
+bench_compile_nested_sections(void)
+{
+    TEXT templ = { 0 };
+    int i, j;
+
+    for(i = 0; i < 1000; i++) {
+        text_append_str(&templ, (i % 2) ? "{{#a}}" : "{{^b}}");
+        for(j = 0; j < 10; j++)
+            text_append_str(&templ, "<td>{{x}}</td>\n");
+    }
+    for(i = 999; i >= 0; i--)
+        text_append_str(&templ, (i % 2) ? "{{/a}}" : "{{/b}}");
+    bench_compile("compile: 1k nested sections", &templ, 5);
+    text_free(&templ);
+}
+
+/* A small page with a short list, typical for a high-rate web service. */
+static void
+bench_render_small(void)
+{
+    static const char templ[] =
+        "<h1>{{title}}</h1>\n"
+        "<ul>\n"
+        "{{#items}}\n"
+        "  <li><a href=\"{{url}}\">{{name}}</a>{{#tags}} <i>{{.}}</i>{{/tags}}</li>\n"
+        "{{/items}}\n"
+        "</ul>\n"
+        "{{^items}}<p>No items.</p>{{/items}}\n"
+        "<footer>{{site.name}}</footer>\n";
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    NODE* root;
+    NODE* items;
+    NODE* site;
+    int i;
+
+    root = node_new(NULL, NULL, NULL, 0);
+    node_new(root, "title", "Hello world", 0);
+    items = node_new(root, "items", NULL, 1);
+    for(i = 0; i < 5; i++) {
+        NODE* item = node_new(items, NULL, NULL, 0);
+        NODE* tags = node_new(item, "tags", NULL, 1);
+        node_new(item, "url", "http://example.com/", 0);
+        node_new(item, "name", "Example", 0);
+        node_new(tags, NULL, "new", 0);
+        node_new(tags, NULL, "hot", 0);
+    }
+    site = node_new(root, "site", NULL, 0);
+    node_new(site, "name", "example.com", 0);
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+
+    bench_render("render: small page (mustache_process)", t, root, NULL, 500000);
+    bench_render("render: small page (reused processor)", t, root, processor, 500000);
+
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+}
+
+/* Literal-heavy template: many lines of text with only a few tags, so most
+ * executed instructions are LITERAL. */
+static void
+bench_render_literals(void)
+{
+    TEXT templ = { 0 };
+    NODE* root;
+    int i;
+
+    for(i = 0; i < 200; i++) {
+        text_append_str(&templ, "<tr><td class=\"cell\">Lorem ipsum</td></tr>\n");
+        if(i % 20 == 0)
+            text_append_str(&templ, "<tr><td>{{a}}</td></tr>\n");
+    }
+
+    root = node_new(NULL, NULL, NULL, 0);
+    node_new(root, "a", "Hello world", 0);
+
+    bench_render_variants("render: literal-heavy", templ.data, templ.n, root, 200000);
+    node_free(root);
+    text_free(&templ);
+}
+
+/* Tag-heavy template: a loop over a list with many short variable tags per
+ * iteration, so the run time is dominated by RESOLVE and OUT* instructions. */
+static void
+bench_render_tags(void)
+{
+    static const char templ[] =
+        "{{#rows}}<tr><td>{{a}}</td><td>{{b}}</td><td>{{&c}}</td><td>{{d}}</td>"
+        "<td>{{e}}</td><td>{{x.y}}</td><td>{{{f}}}</td><td>{{missing}}</td></tr>{{/rows}}";
+    NODE* root;
+    NODE* rows;
+    int i;
+
+    root = node_new(NULL, NULL, NULL, 0);
+    rows = node_new(root, "rows", NULL, 1);
+    for(i = 0; i < 100; i++) {
+        NODE* row = node_new(rows, NULL, NULL, 0);
+        NODE* x;
+        node_new(row, "a", "1", 0);
+        node_new(row, "b", "22", 0);
+        node_new(row, "c", "333", 0);
+        node_new(row, "d", "4444", 0);
+        node_new(row, "e", "5", 0);
+        node_new(row, "f", "6", 0);
+        x = node_new(row, "x", NULL, 0);
+        node_new(x, "y", "7", 0);
+    }
+
+    bench_render_variants("render: tag-heavy", templ, strlen(templ), root, 20000);
+    node_free(root);
+}
+
+/* A long list from a provider where random access is slow. */
+static void
+bench_render_list(void)
+{
+    static const char templ[] = "<ul>{{#items}}<li>{{name}}</li>{{/items}}</ul>";
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    NODE* root;
+    NODE* items;
+    int i;
+
+    root = node_new(NULL, NULL, NULL, 0);
+    items = node_new(root, "items", NULL, 1);
+    for(i = 0; i < 10000; i++) {
+        NODE* item = node_new(items, NULL, NULL, 0);
+        node_new(item, "name", "Example", 0);
+    }
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+
+    bench_render_ex("render: 10k linked list (by index)", t, &provider_linked, root, processor, 20);
+    bench_render_ex("render: 10k linked list (iterator)", t, &provider_linked_iter, root, processor, 20);
+    bench_render_ex("render: 10k array (by index)", t, &provider, root, processor, 200);
+    bench_render_ex("render: 10k array (get_children)", t, &provider_batch, root, processor, 200);
+
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+}
+
+/* A list whose items refer to names from the outer context (which the items
+ * themselves do not have). */
+static void
+bench_render_outer_names(void)
+{
+    static const char templ[] =
+        "<table>{{#rows}}<tr><td>{{name}}</td><td>{{price}} {{currency}}</td>"
+        "<td><a href=\"{{base_url}}/{{name}}\">{{label}}</a></td></tr>{{/rows}}</table>";
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_PROCESSOR* processor_memo;
+    MUSTACHE_PROCESSOR_STATS stats;
+    char key[32];
+    NODE* root;
+    NODE* rows;
+    int i;
+
+    root = node_new(NULL, NULL, NULL, 0);
+    for(i = 0; i < 20; i++) {
+        sprintf(key, "setting%d", i);
+        node_new(root, key, "x", 0);
+    }
+    node_new(root, "currency", "EUR", 0);
+    node_new(root, "base_url", "https://example.com/items", 0);
+    node_new(root, "label", "Details", 0);
+    rows = node_new(root, "rows", NULL, 1);
+    for(i = 0; i < 1000; i++) {
+        NODE* row = node_new(rows, NULL, NULL, 0);
+        node_new(row, "name", "Example", 0);
+        node_new(row, "price", "42", 0);
+        row->shape = rows->children[0];
+    }
+    root->shape = root;
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+    processor_memo = mustache_processor_create(MUSTACHE_PROCESSOR_FLAG_MEMO);
+
+    bench_render("render: 1k rows, outer names", t, root, processor, 2000);
+    bench_render("render: 1k rows, outer names (memo)", t, root, processor_memo, 2000);
+    mustache_processor_stats(processor_memo, &stats);
+    printf("    %u provider calls avoided per render\n", stats.n_memo_hits);
+    mustache_release(t);
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, MUSTACHE_FLAG_CSE);
+    bench_render("render: 1k rows, outer names (CSE)", t, root, processor, 2000);
+    bench_render("render: 1k rows, outer names (CSE+memo)", t, root, processor_memo, 2000);
+    mustache_release(t);
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    bench_render_ex("render: 1k rows, outer names (shapes)", t, &provider_shape, root, processor, 2000);
+    mustache_processor_stats(processor, &stats);
+    printf("    %u lookups answered from the inline cache per render\n", stats.n_pic_hits);
+
+    mustache_processor_release(processor_memo);
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+}
+
+/* Deeply nested names. */
+static void
+bench_render_paths(void)
+{
+    static const char templ[] =
+        "{{#rows}}<p style=\"color: {{site.config.theme.color}}\">{{site.config.theme.title}}"
+        " ({{site.config.locale.name}})</p>{{/rows}}";
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    NODE* root;
+    NODE* config;
+    NODE* theme;
+    NODE* locale;
+    NODE* rows;
+    int i;
+
+    root = node_new(NULL, NULL, NULL, 0);
+    config = node_new(node_new(root, "site", NULL, 0), "config", NULL, 0);
+    theme = node_new(config, "theme", NULL, 0);
+    node_new(theme, "color", "#333", 0);
+    node_new(theme, "title", "Example", 0);
+    locale = node_new(config, "locale", NULL, 0);
+    node_new(locale, "name", "en_US", 0);
+    rows = node_new(root, "rows", NULL, 1);
+    for(i = 0; i < 1000; i++)
+        node_new(rows, NULL, NULL, 0);
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+
+    bench_render_ex("render: 1k rows, dotted names", t, &provider_sym, root, processor, 2000);
+    bench_render_ex("render: 1k rows, dotted names (path)", t, &provider_path, root, processor, 2000);
+
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+}
+
+/* A partial used for each item of a list. */
+static void
+bench_render_partials(void)
+{
+    static const char templ[] = "<ul>{{#items}}{{>item}}{{/items}}</ul>";
+    static const char item_templ[] = "<li>{{name}}</li>";
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_TEMPLATE* linked;
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_PROCESSOR* processor_keep;
+    MUSTACHE_PROCESSOR_STATS stats;
+    NODE* root;
+    NODE* items;
+    int i;
+
+    for(i = 0; i < N_PARTIALS; i++) {
+        sprintf(partial_names[i], "partial%d", i);
+        partial_templates[i] = mustache_compile(item_templ, strlen(item_templ), &parser, NULL, 0);
+    }
+    strcpy(partial_names[N_PARTIALS-1], "item");
+
+    root = node_new(NULL, NULL, NULL, 0);
+    items = node_new(root, "items", NULL, 1);
+    for(i = 0; i < 1000; i++) {
+        NODE* item = node_new(items, NULL, NULL, 0);
+        node_new(item, "name", "Example", 0);
+    }
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+    processor_keep = mustache_processor_create(MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS);
+
+    bench_render_ex("render: 1k partials (mustache_process)", t, &provider_partials, root, NULL, 2000);
+    bench_render_ex("render: 1k partials (reused processor)", t, &provider_partials, root, processor, 2000);
+    mustache_processor_stats(processor, &stats);
+    printf("    %u partials taken from the cache per render\n", stats.n_partial_hits);
+    bench_render_ex("render: 1k partials (kept partials)", t, &provider_partials, root, processor_keep, 2000);
+
+    linked = mustache_link(t, &linker_partials, NULL, SIZE_MAX);
+    bench_render_ex("render: 1k partials (linked)", linked, &provider_partials, root, processor, 2000);
+
+    mustache_release(linked);
+    mustache_processor_release(processor_keep);
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+    for(i = 0; i < N_PARTIALS; i++)
+        mustache_release(partial_templates[i]);
+}
+
+
+/* A sink typical for an application: Each piece of the output is written to
+ * a stdio stream (to the null device), and the escaping is done character by
+ * character. */
+#ifdef _WIN32
+    #define NULL_DEVICE     "NUL"
+#else
+    #define NULL_DEVICE     "/dev/null"
+#endif
+
+typedef struct SINK {
+    FILE* f;
+    size_t n;
+    unsigned n_calls;
+} SINK;
+
+static int
+sink_write(const char* output, size_t size, void* data)
+{
+    SINK* sink = (SINK*) data;
+
+    if(fwrite(output, 1, size, sink->f) != size)
+        return -1;
+    sink->n += size;
+    sink->n_calls++;
+    return 0;
+}
+
+static int
+sink_write_escaped(const char* output, size_t size, void* data)
+{
+    size_t i;
+
+    for(i = 0; i < size; i++) {
+        switch(output[i]) {
+            case '&':   sink_write("&amp;", 5, data); break;
+            case '"':   sink_write("&quot;", 6, data); break;
+            case '<':   sink_write("&lt;", 4, data); break;
+            case '>':   sink_write("&gt;", 4, data); break;
+            default:    sink_write(output + i, 1, data); break;
+        }
+    }
+    return 0;
+}
+
+static const MUSTACHE_RENDERER renderer_sink = {
+    sink_write,
+    sink_write_escaped
+};
+
+#ifndef _WIN32
+static int
+sink_writev(const MUSTACHE_IOVEC* iov, unsigned n_iov, void* data)
+{
+    SINK* sink = (SINK*) data;
+    ssize_t n;
+
+    n = writev(fileno(sink->f), (const struct iovec*) iov, (int) n_iov);
+    if(n < 0)
+        return -1;
+    sink->n += (size_t) n;
+    sink->n_calls++;
+    return 0;
+}
+#endif
+
+/* Render a tag-dense template into the sink, directly, via the buffered
+ * output, via the gathering output, and step by step into a fixed buffer. */
+static void
+bench_render_output(void)
+{
+    static const char templ[] =
+        "{{#rows}}<tr><td>{{a}}</td><td>{{b}}</td><td>{{c}}</td><td>{{d}}</td>"
+        "<td>{{&e}}</td></tr>\n{{/rows}}";
+    static const struct {
+        const char* desc;
+        size_t chunk_size;
+        int gather;
+        size_t step_size;
+        const MUSTACHE_DATAPROVIDER* provider;
+    } variants[] = {
+        { "render: output (renderer callbacks)", 0, 0, 0, &provider },
+        { "render: output (buffered, 4 KiB)", 4 * 1024, 0, 0, &provider },
+        { "render: output (buffered, 64 KiB)", 64 * 1024, 0, 0, &provider },
+        { "render: output (buffered, get_string())", 64 * 1024, 0, 0, &provider_string },
+        { "render: output (steps, 4 KiB)", 0, 0, 4 * 1024, &provider },
+#ifndef _WIN32
+        { "render: output (gathering, writev())", 0, 1, 0, &provider }
+#endif
+    };
+    static char step_buf[4 * 1024];
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    SINK sink = { 0 };
+    NODE* root;
+    NODE* rows;
+    double t0, t1;
+    int i, j;
+
+    sink.f = fopen(NULL_DEVICE, "wb");
+    if(sink.f == NULL) {
+        fprintf(stderr, "render-output: Cannot open %s.\n", NULL_DEVICE);
+        return;
+    }
+
+    root = node_new(NULL, NULL, NULL, 0);
+    rows = node_new(root, "rows", NULL, 1);
+    for(i = 0; i < 1000; i++) {
+        NODE* row = node_new(rows, NULL, NULL, 0);
+        node_new(row, "a", "12345", 0);
+        node_new(row, "b", "Tom & Jerry", 0);
+        node_new(row, "c", "<b>bold</b>", 0);
+        node_new(row, "d", "plain text value", 0);
+        node_new(row, "e", "<i>verbatim</i>", 0);
+    }
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+
+    for(i = 0; i < (int) (sizeof(variants) / sizeof(variants[0])); i++) {
+        MUSTACHE_OUTPUT* output = NULL;
+        const int iterations = 500;
+
+        if(variants[i].chunk_size > 0)
+            output = mustache_output_create(variants[i].chunk_size, sink_write, &sink);
+#ifndef _WIN32
+        if(variants[i].gather)
+            output = mustache_output_create_gather(0, sink_writev, &sink);
+#endif
+
+        sink.n_calls = 0;
+        t0 = now();
+        for(j = 0; j < iterations; j++) {
+            sink.n = 0;
+            if(variants[i].step_size > 0) {
+                size_t n;
+                int ret;
+
+                /* (Each filled buffer is written as the event loop would do
+                 * when the socket gets writable.) */
+                ret = mustache_process_begin(processor, t, MUSTACHE_ESCAPE_HTML,
+                            variants[i].provider, root);
+                while(ret == 0) {
+                    ret = mustache_process_step(processor, step_buf,
+                                variants[i].step_size, &n);
+                    sink_write(step_buf, n, &sink);
+                    if(ret != MUSTACHE_WOULDBLOCK)
+                        break;
+                    ret = 0;
+                }
+            } else if(output != NULL) {
+                mustache_process_ex(processor, t, mustache_output_renderer(), output,
+                            variants[i].provider, root);
+                mustache_output_flush(output);
+            } else {
+                mustache_process_ex(processor, t, &renderer_sink, &sink,
+                            variants[i].provider, root);
+            }
+        }
+        t1 = now();
+
+        printf("%-40s %8.3f us/render  %8.1f MB/s\n", variants[i].desc,
+               (t1 - t0) * 1000000.0 / iterations,
+               (double) sink.n * iterations / ((t1 - t0) * 1024.0 * 1024.0));
+        printf("    %u callbacks per render\n", sink.n_calls / iterations);
+        mustache_output_release(output);
+    }
+
+    mustache_processor_release(processor);
+    mustache_release(t);
+    node_free(root);
+    fclose(sink.f);
+}
+
+/* A number-heavy report: Each row has an integer ID, a price and a quantity.
+ * The numbers are formatted either by the provider in dump() with snprintf(),
+ * or by the library (via get_scalar()). */
+#define N_NUM_ROWS      1000
+
+typedef struct NUM_NODE {
+    int kind;           /* 0 = root, 1 = list, 2 = row, 3 = id, 4 = price, 5 = qty */
+    unsigned row;
+} NUM_NODE;
+
+static NUM_NODE num_nodes[2 + 4 * N_NUM_ROWS];
+
+static NUM_NODE*
+num_node(int kind, unsigned row)
+{
+    return (kind < 2) ? &num_nodes[kind] : &num_nodes[2 + row * 4 + (kind - 2)];
+}
+
+static int64_t num_id(unsigned row) { return 1000000 + row * 7; }
+static double num_price(unsigned row) { return (double) ((row * 1237) % 100000) / 100.0; }
+static int64_t num_qty(unsigned row) { return row % 50; }
+
+static int
+num_dump(void* node, int (*out_fn)(const char*, size_t, void*), void* renderer_data, void* data)
+{
+    NUM_NODE* n = (NUM_NODE*) node;
+    char buf[32];
+    int len;
+
+    switch(n->kind) {
+        case 3:     len = snprintf(buf, sizeof(buf), "%lld", (long long) num_id(n->row)); break;
+        case 4:     len = snprintf(buf, sizeof(buf), "%.15g", num_price(n->row)); break;
+        case 5:     len = snprintf(buf, sizeof(buf), "%lld", (long long) num_qty(n->row)); break;
+        default:    return 0;
+    }
+    return out_fn(buf, len, renderer_data);
+}
+
+static int
+num_get_scalar(void* node, MUSTACHE_SCALAR* scalar, void* data)
+{
+    NUM_NODE* n = (NUM_NODE*) node;
+
+    switch(n->kind) {
+        case 3:     scalar->type = MUSTACHE_SCALAR_INT64; scalar->value.i64 = num_id(n->row); return 0;
+        case 4:     scalar->type = MUSTACHE_SCALAR_DOUBLE; scalar->value.d = num_price(n->row); return 0;
+        case 5:     scalar->type = MUSTACHE_SCALAR_INT64; scalar->value.i64 = num_qty(n->row); return 0;
+        default:    return -1;
+    }
+}
+
+static void*
+num_get_root(void* data)
+{
+    return num_node(0, 0);
+}
+
+static void*
+num_get_named(void* node, const char* name, size_t size, void* data)
+{
+    NUM_NODE* n = (NUM_NODE*) node;
+
+    if(n->kind == 0  &&  size == 4  &&  memcmp(name, "rows", 4) == 0)
+        return num_node(1, 0);
+    if(n->kind == 2) {
+        if(size == 2  &&  memcmp(name, "id", 2) == 0)
+            return num_node(3, n->row);
+        if(size == 5  &&  memcmp(name, "price", 5) == 0)
+            return num_node(4, n->row);
+        if(size == 3  &&  memcmp(name, "qty", 3) == 0)
+            return num_node(5, n->row);
+    }
+    return NULL;
+}
+
+static void*
+num_get_indexed(void* node, unsigned index, void* data)
+{
+    NUM_NODE* n = (NUM_NODE*) node;
+
+    if(n->kind == 1)
+        return (index < N_NUM_ROWS) ? num_node(2, index) : NULL;
+    return (index == 0) ? node : NULL;
+}
+
+static const MUSTACHE_DATAPROVIDER provider_num_dump = {
+    num_dump,
+    num_get_root,
+    num_get_named,
+    num_get_indexed,
+    get_partial
+};
+
+static const MUSTACHE_DATAPROVIDER provider_num_scalar = {
+    num_dump,
+    num_get_root,
+    num_get_named,
+    num_get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    num_get_scalar
+};
+
+static void
+bench_render_numbers(void)
+{
+    static const char templ[] =
+        "{{#rows}}<tr><td>{{id}}</td><td>{{price}}</td><td>{{qty}}</td></tr>\n{{/rows}}";
+    static const struct {
+        const char* desc;
+        const MUSTACHE_DATAPROVIDER* provider;
+    } variants[] = {
+        { "render: numbers (snprintf() in dump())", &provider_num_dump },
+        { "render: numbers (get_scalar())", &provider_num_scalar }
+    };
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_OUTPUT* output;
+    SINK sink = { 0 };
+    double t0, t1;
+    unsigned i;
+    int j;
+
+    sink.f = fopen(NULL_DEVICE, "wb");
+    if(sink.f == NULL) {
+        fprintf(stderr, "render-numbers: Cannot open %s.\n", NULL_DEVICE);
+        return;
+    }
+
+    for(i = 0; i < sizeof(num_nodes) / sizeof(num_nodes[0]); i++) {
+        num_nodes[i].kind = (i < 2) ? (int) i : 2 + (int) ((i - 2) % 4);
+        num_nodes[i].row = (i < 2) ? 0 : (i - 2) / 4;
+    }
+
+    t = mustache_compile(templ, strlen(templ), &parser, NULL, 0);
+    processor = mustache_processor_create(0);
+    output = mustache_output_create(0, sink_write, &sink);
+
+    for(i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        const int iterations = 500;
+
+        t0 = now();
+        for(j = 0; j < iterations; j++) {
+            sink.n = 0;
+            mustache_process_ex(processor, t, mustache_output_renderer(), output,
+                        variants[i].provider, NULL);
+            mustache_output_flush(output);
+        }
+        t1 = now();
+
+        printf("%-40s %8.3f us/render  %8.1f MB/s\n", variants[i].desc,
+               (t1 - t0) * 1000000.0 / iterations,
+               (double) sink.n * iterations / ((t1 - t0) * 1024.0 * 1024.0));
+    }
+
+    mustache_output_release(output);
+    mustache_processor_release(processor);
+    mustache_release(t);
+    fclose(sink.f);
+}
+
+/* Escape user-generated-like text (mostly plain, with occasional characters
+ * needing the escaping) character by character, and with mustache_escape(). */
+static int
+sink_write_escaped_json(const char* output, size_t size, void* data)
+{
+    size_t i;
+    char tmp[8];
+
+    for(i = 0; i < size; i++) {
+        switch(output[i]) {
+            case '"':   sink_write("\\\"", 2, data); break;
+            case '\\':  sink_write("\\\\", 2, data); break;
+            case '\n':  sink_write("\\n", 2, data); break;
+            default:
+                if((unsigned char) output[i] < 0x20) {
+                    snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned char) output[i]);
+                    sink_write(tmp, 6, data);
+                } else {
+                    sink_write(output + i, 1, data);
+                }
+                break;
+        }
+    }
+    return 0;
+}
+
+static void
+bench_escape(void)
+{
+    static const char* words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet,", "consectetur", "adipiscing",
+        "elit.", "Tom & Jerry", "\"quoted\"", "<b>", "a\nb"
+    };
+    static const struct {
+        const char* desc;
+        unsigned escape;
+        int (*naive)(const char*, size_t, void*);
+    } variants[] = {
+        { "escape: HTML (char by char)", MUSTACHE_ESCAPE_HTML, sink_write_escaped },
+        { "escape: HTML", MUSTACHE_ESCAPE_HTML, NULL },
+        { "escape: XML", MUSTACHE_ESCAPE_XML, NULL },
+        { "escape: JSON (char by char)", MUSTACHE_ESCAPE_JSON, sink_write_escaped_json },
+        { "escape: JSON", MUSTACHE_ESCAPE_JSON, NULL },
+        { "escape: URL", MUSTACHE_ESCAPE_URL, NULL }
+    };
+    MUSTACHE_OUTPUT* output;
+    SINK sink = { 0 };
+    TEXT text = { 0 };
+    double t0, t1;
+    int i, j;
+
+    sink.f = fopen(NULL_DEVICE, "wb");
+    if(sink.f == NULL) {
+        fprintf(stderr, "escape: Cannot open %s.\n", NULL_DEVICE);
+        return;
+    }
+
+    /* The common words are more frequent. */
+    srand(1);
+    while(text.n < 64 * 1024) {
+        int w = rand() % 32;
+        if(w >= (int) (sizeof(words) / sizeof(words[0])))
+            w = w % 8;
+        text_append(&text, words[w], strlen(words[w]));
+        text_append(&text, " ", 1);
+    }
+
+    /* The library escapers are used via the buffered output, the naive ones
+     * write directly into the sink. */
+    output = mustache_output_create(0, sink_write, &sink);
+
+    for(i = 0; i < (int) (sizeof(variants) / sizeof(variants[0])); i++) {
+        const int iterations = 200;
+
+        t0 = now();
+        for(j = 0; j < iterations; j++) {
+            if(variants[i].naive != NULL) {
+                variants[i].naive(text.data, text.n, &sink);
+            } else {
+                mustache_output_renderer_ex(variants[i].escape)->out_escaped(
+                        text.data, text.n, output);
+                mustache_output_flush(output);
+            }
+        }
+        t1 = now();
+
+        printf("%-40s %8.3f us/64KiB  %8.1f MB/s\n", variants[i].desc,
+               (t1 - t0) * 1000000.0 / iterations,
+               (double) text.n * iterations / ((t1 - t0) * 1024.0 * 1024.0));
+    }
+
+    mustache_output_release(output);
+    free(text.data);
+    fclose(sink.f);
+}
+
+typedef struct BENCH {
+    const char* name;
+    void (*func)(void);
+} BENCH;
+
+static const BENCH bench_list[] = {
+    { "compile-report", bench_compile_report },
+    { "compile-report-delim", bench_compile_report_delim },
+    { "compile-tags", bench_compile_tags },
+    { "compile-sibling-sections", bench_compile_sibling_sections },
+    { "compile-nested-sections", bench_compile_nested_sections },
+    { "render-small", bench_render_small },
+    { "render-literals", bench_render_literals },
+    { "render-tags", bench_render_tags },
+    { "render-list", bench_render_list },
+    { "render-outer-names", bench_render_outer_names },
+    { "render-paths", bench_render_paths },
+    { "render-partials", bench_render_partials },
+    { "render-output", bench_render_output },
+    { "render-numbers", bench_render_numbers },
+    { "escape", bench_escape },
+    { 0 }
+};
+
+int
+main(int argc, char** argv)
+{
+    int i, j;
+
+    for(i = 0; bench_list[i].name != NULL; i++) {
+        if(argc > 1) {
+            for(j = 1; j < argc; j++) {
+                if(strcmp(argv[j], bench_list[i].name) == 0)
+                    break;
+            }
+            if(j >= argc)
+                continue;
+        }
+
+        bench_list[i].func();
+    }
+
+    return 0;
+}
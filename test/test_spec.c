@@ -3,7 +3,9 @@
 #include "mustache.h"
 #include "json.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>  /* for off_t */
 
@@ -30,6 +32,51 @@ static const MUSTACHE_PARSER parser = {
 };
 
 
+/*******************************************************
+ *** Implementation of MUSTACHE_ALLOCATOR interface. ***
+ *******************************************************/
+
+typedef struct ALLOC_STATS {
+    unsigned n_calls;       /* Count of mem_alloc() and mem_realloc() calls. */
+    size_t n_bytes;         /* Currently allocated bytes. */
+} ALLOC_STATS;
+
+static void*
+mem_alloc(size_t size, void* data)
+{
+    ALLOC_STATS* stats = (ALLOC_STATS*) data;
+
+    stats->n_calls++;
+    stats->n_bytes += size;
+    return malloc(size);
+}
+
+static void*
+mem_realloc(void* ptr, size_t old_size, size_t new_size, void* data)
+{
+    ALLOC_STATS* stats = (ALLOC_STATS*) data;
+
+    stats->n_calls++;
+    stats->n_bytes += new_size - old_size;
+    return realloc(ptr, new_size);
+}
+
+static void
+mem_free(void* ptr, size_t size, void* data)
+{
+    ALLOC_STATS* stats = (ALLOC_STATS*) data;
+
+    stats->n_bytes -= size;
+    free(ptr);
+}
+
+static const MUSTACHE_ALLOCATOR allocator = {
+    mem_alloc,
+    mem_realloc,
+    mem_free
+};
+
+
 /******************************************************
  *** Implementation of MUSTACHE_RENDERER interface. ***
  ******************************************************/
@@ -62,6 +109,16 @@ out_escaped(const char* output, size_t n, void* data)
     return 0;
 }
 
+static int
+out_gather(const MUSTACHE_IOVEC* iov, unsigned n_iov, void* data)
+{
+    unsigned i;
+
+    for(i = 0; i < n_iov; i++)
+        out(iov[i].data, iov[i].size, data);
+    return 0;
+}
+
 static const MUSTACHE_RENDERER renderer = {
     out,
     out_escaped,
@@ -80,6 +137,7 @@ typedef struct PARTIAL_INFO {
 typedef struct PROVIDER_DATA {
     JSON_VALUE* root;
     PARTIAL_INFO partial_dict[8];
+    int n_open_iters;
 } PROVIDER_DATA;
 
 
@@ -168,6 +226,182 @@ get_partial(const char* name, size_t size, void* data)
     return NULL;
 }
 
+/* The following callbacks are used via provider_ex and provider_len only, to
+ * test the optional parts of MUSTACHE_DATAPROVIDER. */
+static void*
+get_by_symbol(void* node, const MUSTACHE_SYMBOL* sym, void* data)
+{
+    if(!TEST_CHECK(sym->hash == mustache_hash(sym->name, sym->size)  &&
+                   sym->name[sym->size] == '\0'))
+        return NULL;
+
+    return get_named(node, sym->name, sym->size, data);
+}
+
+static void*
+iter_begin(void* node, void** p_iter, void* data)
+{
+    PROVIDER_DATA* provider_data = (PROVIDER_DATA*) data;
+    unsigned* index = (unsigned*) malloc(sizeof(unsigned));
+
+    *index = 0;
+    *p_iter = index;
+    provider_data->n_open_iters++;
+    return get_indexed(node, 0, data);
+}
+
+static void*
+iter_next(void* node, void** p_iter, void* data)
+{
+    unsigned* index = (unsigned*) *p_iter;
+    return get_indexed(node, ++(*index), data);
+}
+
+static void
+iter_end(void* node, void* iter, void* data)
+{
+    PROVIDER_DATA* provider_data = (PROVIDER_DATA*) data;
+
+    free(iter);
+    provider_data->n_open_iters--;
+}
+
+static size_t
+get_length(void* node, void* data)
+{
+    JSON_VALUE* value = (JSON_VALUE*) node;
+
+    if(value->type == JSON_NULL || value->type == JSON_FALSE)
+        return 0;
+    if(value->type == JSON_ARRAY)
+        return value->data.array.n;
+    return 1;
+}
+
+static int
+is_truthy(void* node, void* data)
+{
+    return (get_length(node, data) > 0);
+}
+
+/* Returns at most 2 items per call so that fetching more windows of items
+ * gets tested too. */
+static unsigned
+get_children(void* node, unsigned start, void** out, unsigned max, void* data)
+{
+    unsigned n = 0;
+
+    while(n < max  &&  n < 2) {
+        out[n] = get_indexed(node, start + n, data);
+        if(out[n] == NULL)
+            break;
+        n++;
+    }
+    return n;
+}
+
+/* Each JSON object is its own shape, and the slots are indexes of its keys. */
+static const void*
+get_shape(void* node, void* data)
+{
+    JSON_VALUE* value = (JSON_VALUE*) node;
+
+    return (value->type == JSON_OBJECT) ? value : NULL;
+}
+
+static int
+get_shape_slot(const void* shape, const MUSTACHE_SYMBOL* sym, void* data)
+{
+    const JSON_VALUE* value = (const JSON_VALUE*) shape;
+    int i;
+
+    for(i = 0; i < value->data.obj.n; i++) {
+        if(strcmp(value->data.obj.keys[i], sym->name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void*
+get_child_by_slot(void* node, int slot, void* data)
+{
+    JSON_VALUE* value = (JSON_VALUE*) node;
+    JSON_VALUE* child_value = value->data.obj.values[slot];
+
+    if(child_value->type == JSON_NULL || child_value->type == JSON_FALSE)
+        return NULL;
+    return (void*) child_value;
+}
+
+static void*
+get_child_by_path(void* node, const MUSTACHE_SYMBOL* const* path, unsigned n, void* data)
+{
+    unsigned i;
+
+    for(i = 0; i < n  &&  node != NULL; i++)
+        node = get_named(node, path[i]->name, path[i]->size, data);
+    return node;
+}
+
+/* Only the JSON strings have the string value. Those which need no escaping
+ * are marked as safe, so both ways of their output get tested. */
+static int
+get_string(void* node, const char** p_str, size_t* p_size, unsigned* p_flags, void* data)
+{
+    JSON_VALUE* value = (JSON_VALUE*) node;
+
+    if(value->type != JSON_STRING)
+        return -1;
+
+    *p_str = value->data.str;
+    *p_size = strlen(value->data.str);
+    if(strpbrk(value->data.str, "&\"<>") == NULL)
+        *p_flags |= MUSTACHE_STRING_SAFE;
+    return 0;
+}
+
+/* Format the double the straightforward way (i.e. as mustache_process()
+ * formats it, just slower). */
+static void
+format_double_naive(double d, char* buf, size_t bufsize)
+{
+    int prec;
+
+    for(prec = 15; prec < 17; prec++) {
+        snprintf(buf, bufsize, "%.*g", prec, d);
+        if(strtod(buf, NULL) == d)
+            return;
+    }
+    snprintf(buf, bufsize, "%.17g", d);
+}
+
+/* The JSON strings which are numbers (as formatted by the straightforward
+ * formatting) are reported as scalars. */
+static int
+get_scalar(void* node, MUSTACHE_SCALAR* scalar, void* data)
+{
+    JSON_VALUE* value = (JSON_VALUE*) node;
+    char buf[64];
+    char* end;
+
+    if(value->type != JSON_STRING  ||  value->data.str[0] == '\0')
+        return -1;
+
+    scalar->type = MUSTACHE_SCALAR_INT64;
+    scalar->value.i64 = strtoll(value->data.str, &end, 10);
+    snprintf(buf, sizeof(buf), "%lld", (long long) scalar->value.i64);
+    if(*end == '\0'  &&  strcmp(buf, value->data.str) == 0)
+        return 0;
+
+    scalar->type = MUSTACHE_SCALAR_DOUBLE;
+    scalar->value.d = strtod(value->data.str, &end);
+    format_double_naive(scalar->value.d, buf, sizeof(buf));
+    if(*end == '\0'  &&  strcmp(buf, value->data.str) == 0)
+        return 0;
+
+    return -1;
+}
+
 static const MUSTACHE_DATAPROVIDER provider = {
     dump,
     get_root,
@@ -176,23 +410,76 @@ static const MUSTACHE_DATAPROVIDER provider = {
     get_partial
 };
 
+static const MUSTACHE_DATAPROVIDER provider_ex = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    get_by_symbol,
+    iter_begin,
+    iter_next,
+    iter_end,
+    is_truthy,
+    get_length,
+    NULL,
+    get_shape,
+    get_shape_slot,
+    get_child_by_slot,
+    NULL,
+    NULL,
+    get_scalar
+};
+
+static const MUSTACHE_DATAPROVIDER provider_len = {
+    dump,
+    get_root,
+    get_named,
+    get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    get_length,
+    get_children,
+    NULL,
+    NULL,
+    NULL,
+    get_child_by_path,
+    get_string
+};
+
+/* The partials for mustache_link() are looked up the same way as for the
+ * processing. */
+static const MUSTACHE_LINKER linker = {
+    get_partial
+};
+
 
 /*********************************
  *** Main body for test units. ***
  *********************************/
 
 static void
-run(const char* desc, const char* templ, const char* data, const char* partials, const char* expected)
+run_with_flags(const char* desc, const char* templ, const char* data,
+               const char* partials, const char* expected, unsigned flags)
 {
     JSON_VALUE* json_root;
     MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_OUTPUT* output;
     BUFFER buf = { 0 };
+    BUFFER buf2 = { 0 };
+    ALLOC_STATS alloc_stats = { 0 };
 
     json_root = json_parse(data);
     if(!TEST_CHECK(json_root != NULL))
         return;
 
-    t = mustache_compile(templ, strlen(templ), &parser, (void*) &buf, 0);
+    t = mustache_compile_ex(templ, strlen(templ), &parser, (void*) &buf,
+                &allocator, &alloc_stats, flags);
     if(t != NULL) {
         PROVIDER_DATA provider_data = { 0 };
         int i;
@@ -208,18 +495,132 @@ run(const char* desc, const char* templ, const char* data, const char* partials,
             if(!TEST_CHECK(json_partials->type == JSON_OBJECT))
                 return;
 
+            /* Compile the partials into the other format than the main
+             * template so that switching between them is tested too. */
             for(i = 0; i < json_partials->data.obj.n; i++) {
                 strcpy(provider_data.partial_dict[i].name, json_partials->data.obj.keys[i]);
                 provider_data.partial_dict[i].templ = mustache_compile(
                             json_partials->data.obj.values[i]->data.str,
                             strlen(json_partials->data.obj.values[i]->data.str),
-                            NULL, NULL, 0);
+                            NULL, NULL, flags ^ MUSTACHE_FLAG_COMPACT);
                 TEST_CHECK(provider_data.partial_dict[i].templ != NULL);
             }
         }
 
         mustache_process(t, &renderer, (void*) &buf, &provider, &provider_data);
 
+        /* Check a reused processor produces the same output. (Render twice,
+         * so the 2nd run gets a processor with the stacks already warmed up.)
+         * Use the providers with the optional callbacks, the memo and the
+         * cache of partials this time. */
+        processor = mustache_processor_create_ex(&allocator, &alloc_stats,
+                        MUSTACHE_PROCESSOR_FLAG_MEMO | MUSTACHE_PROCESSOR_FLAG_KEEPPARTIALS);
+        if(TEST_CHECK(processor != NULL)) {
+            for(i = 0; i < 2; i++) {
+                unsigned n_calls = alloc_stats.n_calls;
+
+                buf2.n = 0;
+                mustache_process_ex(processor, t, &renderer, (void*) &buf2,
+                            (i == 0) ? &provider_ex : &provider_len, &provider_data);
+                TEST_CHECK_(buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                            "%s (reused processor, run %d)", desc, i+1);
+                TEST_CHECK_(provider_data.n_open_iters == 0,
+                            "%s (all iterations ended)", desc);
+                if(i > 0) {
+                    TEST_CHECK_(alloc_stats.n_calls == n_calls,
+                            "%s (no allocation with warm processor)", desc);
+                }
+            }
+            mustache_processor_release(processor);
+        }
+
+        /* Check the resumable processing produces the same output, whatever
+         * the size of the buffer. Abort it once in the middle first. */
+        processor = mustache_processor_create_ex(&allocator, &alloc_stats, 0);
+        if(TEST_CHECK(processor != NULL)) {
+            static const size_t step_sizes[] = { 1, 7, 4096 };
+            char step_buf[4096];
+            size_t n;
+            int ret;
+
+            if(mustache_process_begin(processor, t, MUSTACHE_ESCAPE_HTML,
+                        &provider_ex, &provider_data) == 0) {
+                mustache_process_step(processor, step_buf, 1, &n);
+                mustache_process_abort(processor);
+            }
+            TEST_CHECK_(provider_data.n_open_iters == 0, "%s (resumable, aborted)", desc);
+
+            /* A step with no buffer fails and aborts the processing too. */
+            if(mustache_process_begin(processor, t, MUSTACHE_ESCAPE_HTML,
+                        &provider_ex, &provider_data) == 0) {
+                mustache_process_step(processor, step_buf, 1, &n);
+                ret = mustache_process_step(processor, step_buf, 0, &n);
+                TEST_CHECK_(ret == -1  &&  n == 0  &&  provider_data.n_open_iters == 0,
+                            "%s (resumable, empty buffer)", desc);
+            }
+
+            for(i = 0; i < (int) (sizeof(step_sizes) / sizeof(step_sizes[0])); i++) {
+                buf2.n = 0;
+                ret = mustache_process_begin(processor, t, MUSTACHE_ESCAPE_HTML,
+                            &provider_ex, &provider_data);
+                while(ret == 0) {
+                    ret = mustache_process_step(processor, step_buf, step_sizes[i], &n);
+                    TEST_CHECK(n <= step_sizes[i]);
+                    out(step_buf, n, (void*) &buf2);
+                    if(ret == MUSTACHE_WOULDBLOCK)
+                        ret = 0;
+                    else
+                        break;
+                }
+                TEST_CHECK_(ret == 0  &&  buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                            "%s (resumable, buffer of %u bytes)", desc, (unsigned) step_sizes[i]);
+            }
+            mustache_processor_release(processor);
+        }
+
+        /* Check the buffered output produces the same output. Use a tiny
+         * buffer so that it has to be flushed often. */
+        output = mustache_output_create_ex(1, out, (void*) &buf2, &allocator, &alloc_stats);
+        if(TEST_CHECK(output != NULL)) {
+            buf2.n = 0;
+            mustache_process(t, mustache_output_renderer(), (void*) output,
+                        &provider, &provider_data);
+            mustache_output_flush(output);
+            TEST_CHECK_(buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                        "%s (buffered output)", desc);
+            mustache_output_release(output);
+        }
+
+        /* Same for the gathering output. Use a tiny arena so that the copied
+         * output does not fit in it. */
+        output = mustache_output_create_gather_ex(1, out_gather, (void*) &buf2,
+                        &allocator, &alloc_stats);
+        if(TEST_CHECK(output != NULL)) {
+            buf2.n = 0;
+            mustache_process(t, mustache_output_renderer(), (void*) output,
+                        &provider, &provider_data);
+            mustache_output_flush(output);
+            TEST_CHECK_(buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                        "%s (gathering output)", desc);
+            mustache_output_release(output);
+        }
+
+        /* Check the template linked with the partials produces the same
+         * output. With no inlining allowed, the linking just re-emits the
+         * code of the template. */
+        for(i = 0; i < 2; i++) {
+            MUSTACHE_TEMPLATE* linked;
+
+            linked = mustache_link(t, &linker, &provider_data, (i == 0) ? SIZE_MAX : 0);
+            if(TEST_CHECK_(linked != NULL, "%s (linked)", desc)) {
+                buf2.n = 0;
+                mustache_process(linked, &renderer, (void*) &buf2, &provider, &provider_data);
+                TEST_CHECK_(buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                            "%s (linked, %s)", desc, (i == 0) ? "inlined" : "not inlined");
+                mustache_release(linked);
+            }
+        }
+
         for(i = 0; provider_data.partial_dict[i].templ != NULL; i++) {
             const PARTIAL_INFO* info = (const PARTIAL_INFO*) &provider_data.partial_dict[i];
             mustache_release(info->templ);
@@ -251,6 +652,511 @@ run(const char* desc, const char* templ, const char* data, const char* partials,
 
     json_free(json_root);
     mustache_release(t);
+    TEST_CHECK_(alloc_stats.n_bytes == 0, "%s (no memory leak)", desc);
+}
+
+/* Check the optimizer accounts for all the instructions it has saved. */
+static void
+check_template_info(const char* desc, const char* templ)
+{
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_TEMPLATE* t_noopt;
+    MUSTACHE_TEMPLATE_INFO info;
+    MUSTACHE_TEMPLATE_INFO info_noopt;
+
+    t = mustache_compile(templ, strlen(templ), NULL, NULL, MUSTACHE_FLAG_INDENTCOPY);
+    t_noopt = mustache_compile(templ, strlen(templ), NULL, NULL,
+                               MUSTACHE_FLAG_NOOPTIMIZE | MUSTACHE_FLAG_INDENTCOPY);
+    if(t != NULL  &&  t_noopt != NULL) {
+        mustache_template_info(t, &info);
+        mustache_template_info(t_noopt, &info_noopt);
+        TEST_CHECK_(info_noopt.n_insns_saved == 0  &&
+                    info.n_insns + info.n_insns_saved == info_noopt.n_insns  &&
+                    info.insns_size <= info_noopt.insns_size  &&
+                    (info.insns_indent_size == 0  ||  info.insns_indent_size >= info.insns_size)  &&
+                    info_noopt.insns_indent_size == 0  &&
+                    info.n_symbols == info_noopt.n_symbols,
+                    "%s (template info)", desc);
+    }
+    mustache_release(t);
+    mustache_release(t_noopt);
+}
+
+#define ESCAPE_MAX_GROWTH   6
+
+/* Straightforward escaping, for checking mustache_escape() against it. */
+static void
+escape_naive(unsigned escape, const char* str, size_t size, BUFFER* buf)
+{
+    static const char xdigits[] = "0123456789ABCDEF";
+    char tmp[8];
+    size_t i;
+
+    for(i = 0; i < size; i++) {
+        unsigned char ch = (unsigned char) str[i];
+        const char* repl = NULL;
+
+        switch(escape) {
+            case MUSTACHE_ESCAPE_XML:
+                if(ch == '\'')
+                    repl = "&apos;";
+                /* Pass through. */
+            case MUSTACHE_ESCAPE_HTML:
+                if(ch == '&') repl = "&amp;";
+                else if(ch == '"') repl = "&quot;";
+                else if(ch == '<') repl = "&lt;";
+                else if(ch == '>') repl = "&gt;";
+                break;
+
+            case MUSTACHE_ESCAPE_JSON:
+                if(ch == '"') repl = "\\\"";
+                else if(ch == '\\') repl = "\\\\";
+                else if(ch == '\n') repl = "\\n";
+                else if(ch == '\r') repl = "\\r";
+                else if(ch == '\t') repl = "\\t";
+                else if(ch == '\b') repl = "\\b";
+                else if(ch == '\f') repl = "\\f";
+                else if(ch < 0x20) {
+                    snprintf(tmp, sizeof(tmp), "\\u%04X", ch);
+                    repl = tmp;
+                }
+                break;
+
+            case MUSTACHE_ESCAPE_URL:
+                if(!isalnum(ch)  &&  (ch == '\0'  ||  strchr("-._~", ch) == NULL)) {
+                    tmp[0] = '%';
+                    tmp[1] = xdigits[ch >> 4];
+                    tmp[2] = xdigits[ch & 0xf];
+                    tmp[3] = '\0';
+                    repl = tmp;
+                }
+                break;
+        }
+
+        if(repl != NULL)
+            out(repl, strlen(repl), buf);
+        else
+            out(str + i, 1, buf);
+    }
+}
+
+/* Check the library escapers. Escape the string from various offsets so that
+ * the interesting characters get to various positions in the vectors. */
+static void
+check_escape(const char* desc, const char* str, size_t len)
+{
+    static const char* names[] = { "HTML", "XML", "JSON", "URL" };
+    BUFFER buf = { 0 };
+    BUFFER buf2 = { 0 };
+    size_t off;
+    unsigned escape;
+
+    /* Make sure the escaped string fits into the buffer. */
+    if(len > sizeof(buf.data) / ESCAPE_MAX_GROWTH)
+        len = sizeof(buf.data) / ESCAPE_MAX_GROWTH;
+
+    for(escape = MUSTACHE_ESCAPE_HTML; escape <= MUSTACHE_ESCAPE_URL; escape++) {
+        for(off = 0; off <= len  &&  off < 40; off++) {
+            buf.n = 0;
+            buf2.n = 0;
+            escape_naive(escape, str + off, len - off, &buf);
+            mustache_escape(escape, str + off, len - off, out, (void*) &buf2);
+            if(!TEST_CHECK_(buf2.n == buf.n  &&  memcmp(buf2.data, buf.data, buf.n) == 0,
+                        "%s (%s escaping)", desc, names[escape]))
+                break;
+        }
+    }
+}
+
+static void
+run(const char* desc, const char* templ, const char* data, const char* partials, const char* expected)
+{
+    char desc_variant[512];
+
+    run_with_flags(desc, templ, data, partials, expected, 0);
+
+    snprintf(desc_variant, sizeof(desc_variant), "%s (compact)", desc);
+    run_with_flags(desc_variant, templ, data, partials, expected, MUSTACHE_FLAG_COMPACT);
+
+    snprintf(desc_variant, sizeof(desc_variant), "%s (not optimized)", desc);
+    run_with_flags(desc_variant, templ, data, partials, expected, MUSTACHE_FLAG_NOOPTIMIZE);
+
+    snprintf(desc_variant, sizeof(desc_variant), "%s (CSE)", desc);
+    run_with_flags(desc_variant, templ, data, partials, expected, MUSTACHE_FLAG_CSE);
+
+    snprintf(desc_variant, sizeof(desc_variant), "%s (indent copy)", desc);
+    run_with_flags(desc_variant, templ, data, partials, expected, MUSTACHE_FLAG_INDENTCOPY);
+
+    check_template_info(desc, templ);
+}
+
+
+/************************************
+ *** The hand-written test units. ***
+ ************************************/
+
+/* Check the formatting of some corner-case scalars. */
+static void
+test_scalars(void)
+{
+    static const struct {
+        int64_t i64;
+        const char* expected;
+    } ints[] = {
+        { 0, "0" },
+        { 7, "7" },
+        { -7, "-7" },
+        { 10, "10" },
+        { 99, "99" },
+        { -100, "-100" },
+        { INT64_MAX, "9223372036854775807" },
+        { INT64_MIN, "-9223372036854775808" }
+    };
+    static const struct {
+        double d;
+        const char* expected;
+    } doubles[] = {
+        { 0.0, "0" },
+        { 0.5, "0.5" },
+        { -1.21, "-1.21" },
+        { 100.0, "100" },
+        { 0.1 + 0.2, "0.30000000000000004" },
+        { 1.0 / 3.0, "0.3333333333333333" },
+        { 1e-4, "0.0001" },
+        { 9.999999999999999e-05, "9.999999999999999e-05" },
+        { 999999999999999.0, "999999999999999" },
+        { 1e15, "1e+15" },
+        { 123456.789, "123456.789" },
+        { 5e-324, "4.94065645841247e-324" },
+        { 1.7976931348623157e308, "1.7976931348623157e+308" }
+    };
+    MUSTACHE_SCALAR scalar;
+    char buf[MUSTACHE_SCALAR_BUFSIZE];
+    size_t n;
+    int i;
+
+    for(i = 0; i < (int) (sizeof(ints) / sizeof(ints[0])); i++) {
+        scalar.type = MUSTACHE_SCALAR_INT64;
+        scalar.value.i64 = ints[i].i64;
+        n = mustache_format_scalar(&scalar, buf);
+        TEST_CHECK_(n == strlen(ints[i].expected)  &&  memcmp(buf, ints[i].expected, n) == 0,
+                    "int64 %s", ints[i].expected);
+    }
+
+    scalar.type = MUSTACHE_SCALAR_UINT64;
+    scalar.value.u64 = UINT64_MAX;
+    n = mustache_format_scalar(&scalar, buf);
+    TEST_CHECK_(n == 20  &&  memcmp(buf, "18446744073709551615", n) == 0, "uint64 max");
+
+    for(i = 0; i < (int) (sizeof(doubles) / sizeof(doubles[0])); i++) {
+        scalar.type = MUSTACHE_SCALAR_DOUBLE;
+        scalar.value.d = doubles[i].d;
+        n = mustache_format_scalar(&scalar, buf);
+        TEST_CHECK_(n == strlen(doubles[i].expected)  &&  memcmp(buf, doubles[i].expected, n) == 0,
+                    "double %s", doubles[i].expected);
+    }
+
+    scalar.type = MUSTACHE_SCALAR_BOOL;
+    scalar.value.b = 0;
+    n = mustache_format_scalar(&scalar, buf);
+    TEST_CHECK_(n == 5  &&  memcmp(buf, "false", n) == 0, "bool false");
+
+    scalar.type = 0;
+    n = mustache_format_scalar(&scalar, buf);
+    TEST_CHECK_(n == 0, "unknown type");
+}
+
+
+/* Check the copy of the code with the indentation is built only once the
+ * template is processed as an indented partial. */
+static void
+test_indent_copy(void)
+{
+    static const char templ[] = "  {{>p}}\n{{>p}}\n";
+    static const char templ_p[] = "{{b}}\nline\nend\n";
+    static const char data[] = "{\"b\": \"B\"}";
+    static const char expected[] = "  B\n  line\n  end\nB\nline\nend\n";
+    PROVIDER_DATA provider_data = { 0 };
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_TEMPLATE_INFO info;
+    BUFFER buf = { 0 };
+
+    provider_data.root = json_parse(data);
+    strcpy(provider_data.partial_dict[0].name, "p");
+    provider_data.partial_dict[0].templ = mustache_compile(templ_p, strlen(templ_p), NULL, NULL, 0);
+    t = mustache_compile(templ, strlen(templ), NULL, NULL, 0);
+    if(TEST_CHECK(provider_data.root != NULL  &&  t != NULL  &&
+                  provider_data.partial_dict[0].templ != NULL)) {
+        mustache_template_info(provider_data.partial_dict[0].templ, &info);
+        TEST_CHECK_(info.insns_indent_size == 0, "no copy after compilation");
+
+        TEST_CHECK(mustache_process(t, &renderer, (void*) &buf, &provider, &provider_data) == 0);
+        TEST_CHECK_(buf.n == strlen(expected)  &&  memcmp(buf.data, expected, buf.n) == 0,
+                    "output: %.*s", (int) buf.n, buf.data);
+
+        mustache_template_info(provider_data.partial_dict[0].templ, &info);
+        TEST_CHECK_(info.insns_indent_size > info.insns_size, "copy after an indented use");
+        mustache_template_info(t, &info);
+        TEST_CHECK_(info.insns_indent_size == 0, "no copy for the top-level template");
+    }
+
+    mustache_release(t);
+    mustache_release(provider_data.partial_dict[0].templ);
+    json_free(provider_data.root);
+}
+
+/* Check a linked template with dynamic (not inlined) partials gets the stacks
+ * reserved up front: each of them is allocated at most once on the first
+ * processing, and never again. */
+static void
+test_reserve(void)
+{
+    static const char templ[] = "{{#a}}\n{{#b}}\n  {{>p}}\n{{/b}}\n{{/a}}\n";
+    static const char templ_p[] = "{{#c}}\n{{#d}}\n  {{>q}}\n{{/d}}\n{{/c}}\n";
+    static const char templ_q[] = "<{{e}}>\n";
+    static const char data[] = "{\"a\": {\"b\": {\"c\": {\"d\": {\"e\": \"x\"}}}}}";
+    ALLOC_STATS alloc_stats = { 0 };
+    PROVIDER_DATA provider_data = { 0 };
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_TEMPLATE* linked = NULL;
+    MUSTACHE_PROCESSOR* processor;
+    BUFFER buf = { 0 };
+    BUFFER expected = { 0 };
+    unsigned n_calls;
+    int i;
+
+    provider_data.root = json_parse(data);
+    strcpy(provider_data.partial_dict[0].name, "p");
+    provider_data.partial_dict[0].templ = mustache_compile(templ_p, strlen(templ_p), NULL, NULL, 0);
+    strcpy(provider_data.partial_dict[1].name, "q");
+    provider_data.partial_dict[1].templ = mustache_compile(templ_q, strlen(templ_q), NULL, NULL, 0);
+    t = mustache_compile(templ, strlen(templ), NULL, NULL, 0);
+    if(t != NULL) {
+        mustache_process(t, &renderer, (void*) &expected, &provider, &provider_data);
+        linked = mustache_link(t, &linker, &provider_data, 0);
+    }
+
+    processor = mustache_processor_create_ex(&allocator, &alloc_stats, 0);
+    if(TEST_CHECK(provider_data.root != NULL  &&  linked != NULL  &&  processor != NULL)) {
+        for(i = 0; i < 2; i++) {
+            n_calls = alloc_stats.n_calls;
+            buf.n = 0;
+            TEST_CHECK(mustache_process_ex(processor, linked, &renderer, (void*) &buf,
+                            &provider, &provider_data) == 0);
+            TEST_CHECK_(buf.n == expected.n  &&  memcmp(buf.data, expected.data, buf.n) == 0,
+                        "run %d: same output", i+1);
+
+            /* node_stack, loop_stack, partial_stack and indent_buffer. */
+            TEST_CHECK_(alloc_stats.n_calls - n_calls <= ((i == 0) ? 4 : 0),
+                        "run %d: %u allocations", i+1, alloc_stats.n_calls - n_calls);
+        }
+    }
+
+    mustache_processor_release(processor);
+    mustache_release(linked);
+    mustache_release(t);
+    for(i = 0; provider_data.partial_dict[i].templ != NULL; i++)
+        mustache_release(provider_data.partial_dict[i].templ);
+    json_free(provider_data.root);
+}
+
+/* A data tree whose objects share their shapes: the shape of an object is just
+ * the (static) array of its keys. */
+typedef struct SHAPED_NODE {
+    const char* const* keys;    /* NULL for a list or a string. */
+    unsigned n;                 /* Count of keys or list items. */
+    const char* str;
+    struct SHAPED_NODE* children[4];
+} SHAPED_NODE;
+
+typedef struct SHAPED_DATA {
+    SHAPED_NODE* root;
+    unsigned n_slot_lookups;
+} SHAPED_DATA;
+
+static int
+shaped_dump(void* node, int (*out_fn)(const char*, size_t, void*), void* renderer_data, void* data)
+{
+    const char* str = ((SHAPED_NODE*) node)->str;
+
+    return (str != NULL) ? out_fn(str, strlen(str), renderer_data) : 0;
+}
+
+static void*
+shaped_get_root(void* data)
+{
+    return ((SHAPED_DATA*) data)->root;
+}
+
+static void*
+shaped_get_named(void* node, const char* name, size_t size, void* data)
+{
+    SHAPED_NODE* n = (SHAPED_NODE*) node;
+    unsigned i;
+
+    if(n->keys == NULL)
+        return NULL;
+    for(i = 0; i < n->n; i++) {
+        if(strlen(n->keys[i]) == size  &&  memcmp(n->keys[i], name, size) == 0)
+            return n->children[i];
+    }
+    return NULL;
+}
+
+static void*
+shaped_get_indexed(void* node, unsigned index, void* data)
+{
+    SHAPED_NODE* n = (SHAPED_NODE*) node;
+
+    if(n->keys != NULL  ||  n->str != NULL)
+        return (index == 0) ? node : NULL;
+    return (index < n->n) ? n->children[index] : NULL;
+}
+
+static const void*
+shaped_get_shape(void* node, void* data)
+{
+    return ((SHAPED_NODE*) node)->keys;
+}
+
+static int
+shaped_get_shape_slot(const void* shape, const MUSTACHE_SYMBOL* sym, void* data)
+{
+    const char* const* keys = (const char* const*) shape;
+    int i;
+
+    ((SHAPED_DATA*) data)->n_slot_lookups++;
+    for(i = 0; keys[i] != NULL; i++) {
+        if(strcmp(keys[i], sym->name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void*
+shaped_get_child_by_slot(void* node, int slot, void* data)
+{
+    return ((SHAPED_NODE*) node)->children[slot];
+}
+
+static const MUSTACHE_DATAPROVIDER shaped_provider = {
+    shaped_dump,
+    shaped_get_root,
+    shaped_get_named,
+    shaped_get_indexed,
+    get_partial,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    shaped_get_shape,
+    shaped_get_shape_slot,
+    shaped_get_child_by_slot
+};
+
+/* Check the name lookups are answered from the cache of the shapes for the
+ * objects sharing a shape, and resolved anew when the shape changes. */
+static void
+test_shapes(void)
+{
+    static const char* const root_keys[] = { "list", NULL };
+    static const char* const name_age[] = { "name", "age", NULL };
+    static const char* const age_name[] = { "age", "name", NULL };
+    static const char templ[] = "{{#list}}{{name}}={{age}};{{/list}}";
+    static const char expected[] = "a=1;b=2;c=3;d=4;";
+    SHAPED_NODE strs[8] = {
+        { NULL, 0, "a" }, { NULL, 0, "1" }, { NULL, 0, "b" }, { NULL, 0, "2" },
+        { NULL, 0, "3" }, { NULL, 0, "c" }, { NULL, 0, "d" }, { NULL, 0, "4" }
+    };
+    SHAPED_NODE items[4] = {
+        { name_age, 2, NULL, { &strs[0], &strs[1] } },
+        { name_age, 2, NULL, { &strs[2], &strs[3] } },
+        { age_name, 2, NULL, { &strs[4], &strs[5] } },
+        { name_age, 2, NULL, { &strs[6], &strs[7] } }
+    };
+    SHAPED_NODE list = { NULL, 4, NULL, { &items[0], &items[1], &items[2], &items[3] } };
+    SHAPED_NODE root = { root_keys, 1, NULL, { &list } };
+    SHAPED_DATA data = { &root, 0 };
+    MUSTACHE_TEMPLATE* t;
+    MUSTACHE_PROCESSOR* processor;
+    MUSTACHE_PROCESSOR_STATS stats;
+    BUFFER buf = { 0 };
+
+    t = mustache_compile(templ, strlen(templ), NULL, NULL, 0);
+    processor = mustache_processor_create(0);
+    if(TEST_CHECK(t != NULL  &&  processor != NULL)) {
+        TEST_CHECK(mustache_process_ex(processor, t, &renderer, (void*) &buf,
+                        &shaped_provider, (void*) &data) == 0);
+        TEST_CHECK_(buf.n == strlen(expected)  &&  memcmp(buf.data, expected, buf.n) == 0,
+                    "output: %.*s", (int) buf.n, buf.data);
+
+        /* 9 lookups: "list" in the root, and "name" with "age" in each item.
+         * The 2nd item hits the entries of the 1st one, the 3rd one misses
+         * them. (The 4th one may or may not hit, depending on whether the
+         * entries of the two shapes collide in the cache.) */
+        mustache_processor_stats(processor, &stats);
+        TEST_CHECK_(stats.n_pic_hits + data.n_slot_lookups == 9,
+                    "hits %u, slot lookups %u", stats.n_pic_hits, data.n_slot_lookups);
+        TEST_CHECK(stats.n_pic_hits >= 2  &&  stats.n_pic_hits <= 4);
+        TEST_CHECK(data.n_slot_lookups >= 5);
+    }
+    mustache_processor_release(processor);
+    mustache_release(t);
+}
+
+/* Check the escapers with each special character at every position across
+ * a couple of vectors, and with all the possible bytes. */
+static void
+test_escape(void)
+{
+    static const char specials[] = "&\"<>'\\\n\r\t\b\f\x01\x1f\x7f\x80\xff %/+=?#";
+    static const struct {
+        unsigned escape;
+        const char* str;
+        size_t len;
+        const char* expected;
+    } explicit[] = {
+        { MUSTACHE_ESCAPE_HTML, "a<b>&\"'", 7, "a&lt;b&gt;&amp;&quot;'" },
+        { MUSTACHE_ESCAPE_XML, "a<b>&\"'", 7, "a&lt;b&gt;&amp;&quot;&apos;" },
+        { MUSTACHE_ESCAPE_JSON, "\x01\x1f\"\\\n\0", 6, "\\u0001\\u001F\\\"\\\\\\n\\u0000" },
+        { MUSTACHE_ESCAPE_URL, "a b\x80\xff~-._", 9, "a%20b%80%FF~-._" }
+    };
+    char str[80];
+    char desc[64];
+    BUFFER buf = { 0 };
+    size_t i;
+    size_t pos;
+
+    for(i = 0; i < sizeof(specials) - 1; i++) {
+        for(pos = 0; pos < sizeof(str); pos++) {
+            memset(str, 'a', sizeof(str));
+            str[pos] = specials[i];
+            snprintf(desc, sizeof(desc), "special 0x%02x at %u",
+                     (unsigned char) specials[i], (unsigned) pos);
+            check_escape(desc, str, sizeof(str));
+        }
+    }
+
+    for(i = 0; i < 256; i += 64) {
+        memset(str, 0, sizeof(str));
+        for(pos = 0; pos < 64; pos++)
+            str[pos] = (char) (i + pos);
+        snprintf(desc, sizeof(desc), "bytes 0x%02x to 0x%02x", (unsigned) i, (unsigned) (i + 63));
+        check_escape(desc, str, 64);
+    }
+
+    /* And a few explicit expectations, in case the straightforward escaping
+     * in the test has the same bug as the library. */
+    for(i = 0; i < sizeof(explicit) / sizeof(explicit[0]); i++) {
+        buf.n = 0;
+        mustache_escape(explicit[i].escape, explicit[i].str, explicit[i].len, out, (void*) &buf);
+        TEST_CHECK_(buf.n == strlen(explicit[i].expected)  &&
+                    memcmp(buf.data, explicit[i].expected, buf.n) == 0,
+                    "explicit %u", (unsigned) i);
+    }
 }
 
 
@@ -1980,6 +2886,11 @@ TEST_LIST = {
     { "sections-32", test_sections_32 },
     { "sections-33", test_sections_33 },
     { "sections-34", test_sections_34 },
+    { "indent-copy", test_indent_copy },
+    { "reserve", test_reserve },
+    { "shapes", test_shapes },
+    { "escape", test_escape },
+    { "scalars", test_scalars },
     { 0 }
 };
 